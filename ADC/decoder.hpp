@@ -0,0 +1,282 @@
+#ifndef DECODER_HPP_INCLUDED
+#define DECODER_HPP_INCLUDED
+
+/*
+ * Host side decoder of the ADC/main.c stream (C++20, header only)
+ * The firmware sends little endian 16 bit words, the channels selected by
+ * ctrl_params::channels (../simple/control.h) interleaved in bit order:
+ *   channel 0  the averaged input, channel 11 of myADC.c
+ *   channel 1  VREFINT
+ *   channel 2  the temperature sensor
+ * Every channel is the sum of 1024 rows of 8 conversions divided by 512,
+ * i.e. the 12 bit average scaled to 16 bits. Pass the same channel set to
+ * the decoder and feed the received bytes into Decoder::push in any
+ * portions. The sink gets every channel separately, in blocks of up to
+ * Decoder::BlockSamples, as raw words and converted to volts:
+ *
+ *   adc::Decoder dec(adc::Calibration{}, params.channels, [](const adc::Samples &s) {
+ *       if (s.channel == 0)
+ *           for (float v : s.volts) ...
+ *   });
+ *   dec.push(buffer, actual_length);
+ *
+ * The conversion uses the same reference correction as the firmware: the
+ * internal reference VREFINT (1.21 V typical) is measured as VREFMeasured on
+ * the same 16 bit scale, so  volts = raw * VREFINT / VREFMeasured.
+ * With channel 1 in the stream VREFMeasured follows it like in myADC.c,
+ * every VREFINT word moves it by a quarter of the difference, and each
+ * block is converted with the value after the previous one. Otherwise it
+ * stays at Calibration::vrefMeasured.
+ * The bulk conversion runs with AVX2 or SSE2, chosen at runtime, and falls
+ * back to scalar code elsewhere. Nothing is allocated after construction.
+ *
+ * Overflows of the firmware ring buffer are not part of the stream, they
+ * are counted in ctrl_counters::overflows. Firmware without the vendor
+ * control requests sent single bytes of the ring buffer instead of words,
+ * that stream can't be decoded here.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECODER_X86
+#endif
+
+namespace adc {
+
+/*
+ * Reference correction, see VREFINT and VREFMeasured in myADC.c
+ */
+struct Calibration {
+    double vrefint = 1.21;              // volts of the internal reference
+    double vrefMeasured = 26433;        // its 16 bit reading, 2^16/3V*1.21V,
+                                        // the start value if VREFINT is streamed
+
+    float scale() const { return static_cast<float>(vrefint/vrefMeasured); }
+};
+
+constexpr unsigned Channels = 3;        // of ADC/main.c
+constexpr unsigned ChannelVref = 1;     // VREFINT
+
+/*
+ * One block of decoded samples, valid during the sink call only.
+ */
+struct Samples {
+    unsigned channel;
+    uint64_t index;                     // number of the first sample of the channel
+    std::span<const uint16_t> raw;
+    std::span<const float> volts;
+};
+
+/*
+ * Converts n little endian 16 bit words to volts.
+ */
+using ConvertFn = void (*)(const uint8_t *in, float *out, size_t n, float scale);
+
+namespace detail {
+
+inline void convertScalar(const uint8_t *in, float *out, size_t n, float scale)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = static_cast<float>(in[2*i] | in[2*i+1] << 8)*scale;
+}
+
+#ifdef DECODER_X86
+
+__attribute__((target("sse2")))
+inline void convertSse2(const uint8_t *in, float *out, size_t n, float scale)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 s = _mm_set1_ps(scale);
+    size_t i = 0;
+
+    for (; i+8 <= n; i += 8) {
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in+2*i));
+        _mm_storeu_ps(out+i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), s));
+        _mm_storeu_ps(out+i+4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), s));
+    }
+    convertScalar(in+2*i, out+i, n-i, scale);
+}
+
+__attribute__((target("avx2")))
+inline void convertAvx2(const uint8_t *in, float *out, size_t n, float scale)
+{
+    const __m256 s = _mm256_set1_ps(scale);
+    size_t i = 0;
+
+    for (; i+16 <= n; i += 16) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in+2*i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in+2*i+16));
+        _mm256_storeu_ps(out+i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(lo)), s));
+        _mm256_storeu_ps(out+i+8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(hi)), s));
+    }
+    convertSse2(in+2*i, out+i, n-i, scale);
+}
+
+#endif
+
+} // namespace detail
+
+/*
+ * The conversion paths, by name: "avx2", "sse2" or "scalar".
+ * Returns nullptr if the path is not available on this machine.
+ */
+inline ConvertFn convertFor(const char *name)
+{
+#ifdef DECODER_X86
+    __builtin_cpu_init();
+    if (std::strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2") ? detail::convertAvx2 : nullptr;
+    if (std::strcmp(name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2") ? detail::convertSse2 : nullptr;
+#endif
+    if (std::strcmp(name, "scalar") == 0)
+        return detail::convertScalar;
+    return nullptr;
+}
+
+/*
+ * The fastest path of this machine.
+ */
+inline std::pair<const char *, ConvertFn> bestConvert()
+{
+    for (const char *name : {"avx2", "sse2"}) {
+        if (ConvertFn f = convertFor(name))
+            return {name, f};
+    }
+    return {"scalar", detail::convertScalar};
+}
+
+/*
+ * Push based stream decoder. Sink is any callable taking const Samples &.
+ * Samples are handed on as soon as a push completes them, a byte of a word
+ * split between two pushes is kept until the next one. The stream has to
+ * start with the first selected channel, like after CTRL_SET_PARAMS.
+ */
+template <class Sink>
+class Decoder {
+public:
+    static constexpr size_t BlockSamples = 4096;
+
+    // channels is the bit mask of ctrl_params::channels, 0 means channel 0
+    Decoder(Calibration cal, uint8_t channels, Sink sink, ConvertFn convert = bestConvert().second)
+        : sink_(std::move(sink)), convert_(convert)
+    {
+        for (unsigned c = 0; c < Channels; c++) {
+            if (channels>>c & 1)
+                order_[count_++] = c;
+        }
+        if (count_ == 0)
+            order_[count_++] = 0;
+        setCalibration(cal);
+    }
+
+    // e.g. when the host reads VREFINT separately, a streamed VREFINT
+    // continues from the new vrefMeasured
+    void setCalibration(Calibration cal)
+    {
+        vrefint_ = cal.vrefint;
+        vrefMeasured_ = static_cast<uint32_t>(cal.vrefMeasured);
+        scale_ = cal.scale();
+    }
+
+    // the reference the next block is converted with
+    Calibration calibration() const { return {vrefint_, static_cast<double>(vrefMeasured_)}; }
+
+    void push(const uint8_t *data, size_t len)
+    {
+        if (havePartial_ && len > 0) {
+            uint8_t word[2] = {partial_, data[0]};
+            emit(word, 1);
+            havePartial_ = false;
+            data++;
+            len--;
+        }
+        while (len >= 2) {
+            size_t n = len/2 < BlockSamples ? len/2 : BlockSamples;
+            emit(data, n);
+            data += 2*n;
+            len -= 2*n;
+        }
+        if (len) {
+            partial_ = data[0];
+            havePartial_ = true;
+        }
+    }
+
+    void push(std::span<const uint8_t> data) { push(data.data(), data.size()); }
+
+    // words of all channels
+    uint64_t samples() const { return words_; }
+
+    uint64_t samples(unsigned channel) const { return channel < Channels ? index_[channel] : 0; }
+
+private:
+    void emit(const uint8_t *in, size_t n)
+    {
+        std::memcpy(raw_, in, 2*n);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (size_t i = 0; i < n; i++)
+            raw_[i] = __builtin_bswap16(raw_[i]);
+#endif
+        convert_(in, volts_, n, scale_);
+        words_ += n;
+        // a single channel needs no splitting
+        if (count_ == 1) {
+            deliver(order_[0], raw_, volts_, n);
+            return;
+        }
+
+        size_t len[Channels] = {};
+        for (size_t i = 0; i < n; i++) {
+            unsigned c = order_[next_];
+            chRaw_[c][len[c]] = raw_[i];
+            chVolts_[c][len[c]++] = volts_[i];
+            if (++next_ == count_)
+                next_ = 0;
+        }
+        for (unsigned c = 0; c < Channels; c++) {
+            if (len[c])
+                deliver(c, chRaw_[c], chVolts_[c], len[c]);
+        }
+    }
+
+    void deliver(unsigned channel, const uint16_t *raw, const float *volts, size_t n)
+    {
+        sink_(Samples{channel, index_[channel], {raw, n}, {volts, n}});
+        index_[channel] += n;
+        if (channel != ChannelVref)
+            return;
+        // the running average of myADC.c
+        for (size_t i = 0; i < n; i++)
+            vrefMeasured_ = (vrefMeasured_*3+raw[i])>>2;
+        if (vrefMeasured_)
+            scale_ = calibration().scale();
+    }
+
+    double vrefint_;
+    uint32_t vrefMeasured_;
+    float scale_;
+    Sink sink_;
+    ConvertFn convert_;
+    unsigned order_[Channels] = {};     // the selected channels in stream order
+    unsigned count_ = 0;
+    unsigned next_ = 0;                 // position of the next word in order_
+    uint64_t index_[Channels] = {};
+    uint64_t words_ = 0;
+    uint8_t partial_ = 0;
+    bool havePartial_ = false;
+    alignas(32) uint16_t raw_[BlockSamples];
+    alignas(32) float volts_[BlockSamples];
+    uint16_t chRaw_[Channels][BlockSamples];
+    float chVolts_[Channels][BlockSamples];
+};
+
+} // namespace adc
+
+#endif // DECODER_HPP_INCLUDED
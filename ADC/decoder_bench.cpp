@@ -0,0 +1,87 @@
+/*
+ * Benchmark of the ADC stream decoder (decoder.hpp)
+ * Decodes a synthetic stream with every conversion path this machine has
+ * and prints the samples per second per core, measured in thread CPU time.
+ * The stream is pushed in pieces of one USB packet (64 bytes) and of one
+ * typical async transfer (8192 bytes). All paths are checked against the
+ * scalar one first. With more than one channel the decoder splits the
+ * stream as well.
+ *
+ * Compile:
+ *   g++ -O2 -std=c++20 -o decoder_bench decoder_bench.cpp
+ * Run:
+ *   ./decoder_bench [MiB [channels]]
+ *     MiB       size of the synthetic stream (default 256)
+ *     channels  channel set as a bit mask like ctrl_params (default 0x1)
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <vector>
+
+#include "decoder.hpp"
+
+static double cpu_seconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t mib = argc > 1 ? std::atoi(argv[1]) : 256;
+    unsigned channels = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 0x1;
+    if (mib < 1 || channels == 0 || channels >= 1u<<adc::Channels) {
+        std::fprintf(stderr, "usage: %s [MiB [channels]]\n", argv[0]);
+        return 1;
+    }
+
+    // a noisy sine like the emulator sends, little endian
+    std::vector<uint8_t> stream(mib*1024*1024);
+    for (size_t i = 0; i < stream.size()/2; i++) {
+        uint16_t w = static_cast<uint16_t>(32768+16384*std::sin(i*0.001)+(std::rand()&0xFF));
+        stream[2*i] = w;
+        stream[2*i+1] = w>>8;
+    }
+
+    // every path has to produce the scalar result
+    const float scale = adc::Calibration{}.scale();
+    const size_t check = 100003;
+    std::vector<float> expect(check), got(check);
+    adc::convertFor("scalar")(stream.data(), expect.data(), check, scale);
+    for (const char *name : {"sse2", "avx2"}) {
+        adc::ConvertFn f = adc::convertFor(name);
+        if (!f)
+            continue;
+        f(stream.data(), got.data(), check, scale);
+        if (got != expect) {
+            std::fprintf(stderr, "%s conversion differs from scalar\n", name);
+            return 1;
+        }
+    }
+
+    std::printf("%-8s %8s %16s %12s\n", "path", "push", "samples/s/core", "last V");
+    for (const char *name : {"scalar", "sse2", "avx2"}) {
+        adc::ConvertFn f = adc::convertFor(name);
+        if (!f) {
+            std::printf("%-8s not available\n", name);
+            continue;
+        }
+        for (size_t piece : {size_t(64), size_t(8192)}) {
+            // the sink only looks at the block, so the decoder is measured
+            float last = 0;
+            adc::Decoder dec(adc::Calibration{}, channels, [&last](const adc::Samples &s) {
+                last = s.volts.back();
+            }, f);
+            double t0 = cpu_seconds();
+            for (size_t off = 0; off < stream.size(); off += piece)
+                dec.push(stream.data()+off, std::min(piece, stream.size()-off));
+            double t = cpu_seconds()-t0;
+            std::printf("%-8s %8zu %16.0f %12.4f\n", name, piece, dec.samples()/t, last);
+        }
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "myADC.h"
 
 #include "usbdescriptor.h"
+#include "../simple/control.h"
 
 uint8_t receiveBuf[OUT_PACKETSIZE];
 #define IN_MULT 4
@@ -19,34 +20,98 @@ uint8_t transmitting =0;
 static Thread *tp = NULL;
 uint8_t initUSB=0;
 
+/*
+ * Vendor control requests on EP0, see ../simple/control.h
+ * The stream is made of 16 bit words, the selected channels of every
+ * decimation-th sample in bit order:
+ *   channel 0  the averaged input
+ *   channel 1  VREFINT
+ *   channel 2  the temperature sensor
+ * A sample may continue in the next transfer.
+ */
+#define NUM_CHANNELS 3
+static const struct ctrl_caps caps = {
+    CTRL_VERSION,
+    1<<CTRL_FORMAT_U16,
+    sizeof transferBuf,         //largest transfer
+    2,                          //whole words
+    BUFFLEN,                    //largest decimation
+    (1<<NUM_CHANNELS)-1,
+    0
+};
+struct control_state ctrl;
+
+static uint16_t *const channels[NUM_CHANNELS] = {data, vref, temp};
+static uint8_t nextChannel = NUM_CHANNELS;  // NUM_CHANNELS: take the next sample
+static uint16_t sample;
+static uint16_t skipped;
+
+/*
+ * Returns the next word of the stream, waits for the ADC if needed
+ */
+static uint16_t nextWord(void) {
+  while (TRUE) {
+    if(nextChannel == NUM_CHANNELS){
+      //overflows are only counted, the host reads them with CTRL_GET_COUNTERS.
+      // a word in the stream would shift the channels
+      if(overflow){
+        ctrl.counters.overflows += overflow;
+        overflow=0;
+      }
+      //wait until a sample is aquired
+      if(p1==p2){
+        chThdSleepMilliseconds(1);
+        continue;
+      }
+      sample = p2;
+      p2 = (p2+1)%BUFFLEN;
+      if(++skipped < ctrl.params.decimation)
+        continue;
+      skipped = 0;
+      nextChannel = 0;
+    }
+    while(nextChannel < NUM_CHANNELS && !(ctrl.params.channels>>nextChannel & 1))
+      nextChannel++;
+    if(nextChannel < NUM_CHANNELS)
+      return channels[nextChannel++][sample];
+  }
+}
+
 /*
  * USB transfer thread
- * when there is a whole packet of ADC data to transmit
+ * when there is a whole transfer of ADC data to transmit
  * a USB transfer will be started
  */
 static WORKING_AREA(waInitUsbTransfer, 128);
 static msg_t initUsbTransfer(void *arg) {
 
   (void)arg;
-  uint8_t i;
+  uint16_t i, n;
+  int applied;
+  uint16_t *words = (uint16_t*) transferBuf;
   chRegSetThreadName("initUsbTransfer");
 
   while (TRUE) {
-    //wait until enough ADC data is aquired or an overflow is detected
-    while((((p1+BUFFLEN-p2)%BUFFLEN)<IN_PACKETSIZE) && !overflow){
+    //stopped with CTRL_STOP, the data aquired meanwhile is dropped
+    while(!ctrl.running){
+      p2 = p1;
+      nextChannel = NUM_CHANNELS;
       chThdSleepMilliseconds(1);
     }
+    //new parameters take effect between two transfers, with a new sample
+    // CTRL_SET_PARAMS is received in the USB interrupt
+    chSysLock();
+    applied = controlApply(&ctrl);
+    chSysUnlock();
+    if(applied){
+      nextChannel = NUM_CHANNELS;
+      skipped = 0;
+    }
 
     // copy the ADC data to the USB transfer buffer
-    for (i=0;i<IN_PACKETSIZE;i++){
-      transferBuf[i]=((uint8_t*) data)[p2];
-      //if an overflow is detected, write the overflow count.
-      // in a real application this has to be send on another channel
-      if(overflow){
-          transferBuf[i]= overflow;
-          overflow=0;
-      }
-      p2 = (p2+1)%BUFFLEN;
+    n = ctrl.params.transferSize/2;
+    for (i=0;i<n;i++){
+      words[i] = nextWord();
     }
     //wait for the last transmission to complete
     while(transmitting){
@@ -54,7 +119,7 @@ static msg_t initUsbTransfer(void *arg) {
     }
 
     transmitting = 1;
-    usbPrepareTransmit(usbp, EP_IN, transferBuf, IN_PACKETSIZE);
+    usbPrepareTransmit(usbp, EP_IN, transferBuf, 2*n);
 
     chSysLock();
     usbStartTransmitI(usbp, EP_IN);
@@ -70,6 +135,8 @@ static msg_t initUsbTransfer(void *arg) {
 void dataTransmitted(USBDriver *usbp, usbep_t ep){
     (void) usbp;
     (void) ep;
+    ctrl.counters.inTransfers++;
+    ctrl.counters.inBytes += usbp->epc[ep]->in_state->txsize;
     //reset the transmitting flag
     transmitting=0;
     palTogglePad(GPIOD, GPIOD_LED3);
@@ -105,6 +172,7 @@ void dataReceived(USBDriver *usbp, usbep_t ep){
     (void) usbp;
     (void) ep;
 
+    ctrl.counters.outBytes += osp->rxcnt;
     if(osp->rxcnt){
         switch(receiveBuf[0]){
             case '1':
@@ -216,16 +284,30 @@ static const USBDescriptor *get_descriptor(USBDriver *usbp,
   return NULL;
 }
 
+/*
+ * End of the data stage of CTRL_SET_PARAMS
+ */
+static void paramsReceived(USBDriver *usbp) {
+    (void) usbp;
+    controlReceived(&ctrl, CTRL_SET_PARAMS);
+}
+
   /**
    * Requests hook callback.
    * This hook allows to be notified of standard requests or to
    *          handle non standard requests.
-   * This implementation does nothing and passes all requests to
-   *     the upper layers
+   * The vendor requests of control.h are handled here, everything else
+   *     is passed to the upper layers
    */
 bool_t requestsHook(USBDriver *usbp) {
-    (void) usbp;
-    return FALSE;
+    uint8_t *buf;
+    int n = controlSetup(&ctrl, usbp->setup, &buf);
+    if(n < 0)
+        return FALSE;
+    // CTRL_START and CTRL_STOP are picked up by the transfer thread
+    usbSetupTransfer(usbp, buf, n,
+        n && !(usbp->setup[0] & USB_RTYPE_DIR_DEV2HOST) ? paramsReceived : NULL);
+    return TRUE;
 }
 
 /**
@@ -241,12 +323,17 @@ const USBConfig   	config =   {
 
 int main(void) {
 
+  //one channel, every sample, one packet per transfer
+  static const struct ctrl_params params = {IN_PACKETSIZE, CTRL_FORMAT_U16, 0x01, 1, 0};
+  controlInit(&ctrl, &caps, &params);
+
   //start system
   halInit();
   chSysInit();
 
 
   //start and connect USB
+  usbSerialInit();
   usbStart(usbp, &config);
   usbConnectBus(usbp);
 
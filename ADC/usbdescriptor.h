@@ -121,15 +121,30 @@ static const uint8_t stringDeviceDescriptor[] = {
 
 /*
  * Serial Number string.
+ * The 96 bit unique device ID of the STM32F4 as 24 hex digits, so that
+ * identical boards can be told apart. It is filled in by usbSerialInit(),
+ * which has to be called before the USB driver is started.
  */
-static const uint8_t stringSerialNumber[] = {
-  USB_DESC_BYTE(12),                    /* bLength .                        */
+#define UID_BASE  ((const volatile uint32_t *)0x1FFF7A10)
+#define UID_DIGITS 24
+static uint8_t stringSerialNumber[2+2*UID_DIGITS] = {
+  USB_DESC_BYTE(2+2*UID_DIGITS),        /* bLength .                        */
   USB_DESC_BYTE(USB_DESCRIPTOR_STRING), /* bDescriptorType.                 */
-  '0' + CH_KERNEL_MAJOR, 0, '.', 0,
-  '0' + CH_KERNEL_MINOR, 0, '.', 0,
-  '0' + CH_KERNEL_PATCH, 0
 };
 
+static void usbSerialInit(void) {
+  static const char hex[] = "0123456789ABCDEF";
+  uint32_t uid;
+  int i;
+
+  for (i=0; i<UID_DIGITS; i++) {
+    // most significant word and digit first
+    uid = UID_BASE[2-i/8];
+    stringSerialNumber[2+2*i] = hex[(uid>>(28-4*(i%8)))&0xF];
+    stringSerialNumber[3+2*i] = 0;
+  }
+}
+
 /*
  * String not found string.
  */
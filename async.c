@@ -6,9 +6,90 @@
  * It uses Asynchronous device I/O
  *
  * Compile:
- *   gcc -lusb-1.0 -lrt -o async async.c
+ *   gcc -O2 -o async async.c verify.c capture.c replay.c pyramid.c fanout.c metrics.c usbpoll.c usbhost.c simple/pattern.c -lusb-1.0 -lrt -lpthread
  * Run:
- *   ./async
+ *   ./async [-d depth] [-s transfersize] [-S] [-t seconds]
+ *           [-T] [-c cpu] [-q buffers] [-w us] [-z] [-v pattern] [-R]
+ *           [-o prefix [-m MiB] [-M seconds] [-p]] [-i prefix [-x speed]]
+ *           [-F socket] [-P socket] [-f priority] [-L] [-Q us] [-J] [-A percent]
+ *           [-e strategy [-k ms]] [-E]
+ *     -d  number of IN transfers kept in flight (default 4, max MAX_DEPTH)
+ *     -s  size of every single IN transfer in bytes (default 8192)
+ *     -S  sweep the queue depth 1,2,4,... up to -d and print a table
+ *     -t  seconds measured per depth in sweep mode and per run of -J (default 2)
+ *     -T  reap completions on a dedicated event thread and hand them to the
+ *         main thread through a lock-free queue (see below)
+ *     -c  pin the thread that handles the events to this cpu (the event
+ *         thread with -T, the main thread otherwise)
+ *     -q  buffers in the handoff queue on top of the -d in flight (default 16)
+ *     -w  simulated processing time per transfer in the consumer, in us
+ *     -z  zero-copy: map the transfer buffers from usbfs with
+ *         libusb_dev_mem_alloc, falls back to malloc if unavailable
+ *     -v  check every received byte against the test pattern alphabet,
+ *         counter or prbs (see simple/pattern.h). The pattern is selected
+ *         on the device first, lost, repeated and corrupted blocks are
+ *         reported with their stream offset.
+ *     -R  keep running when the device goes away: on detach the transfers
+ *         are torn down, on the next attach of a 0483:FFFF device (libusb
+ *         hotplug) the interface is claimed again and the stream restarted.
+ *         The time to reconnect and the data lost meanwhile are reported.
+ *         Not available with -S and -T.
+ *     -o  write the received data to disk as prefix-0000.bin, ... through
+ *         io_uring with O_DIRECT (see capture.h). The writes are done on a
+ *         thread of their own, data the disk can not keep up with is dropped
+ *         and counted instead of delaying the transfers.
+ *     -m  start a new file every MiB megabytes (default: one file)
+ *     -M  start a new file every so many seconds
+ *     -p  also build the min/max/mean pyramid of the ADC samples for
+ *         overviews of long captures (see pyramid.h and overview.c), of
+ *         the first channel if the device streams several
+ *     -i  replay a capture of -o instead of using the device (see replay.h):
+ *         the transfers are completed from the files through the same
+ *         callbacks, so decoding and analysis can be profiled on recorded
+ *         data at any speed. Also takes a single raw file.
+ *     -x  replay speed relative to the recorded timing, e.g. 1 for real
+ *         time or 10 for ten times faster (default 0: as fast as possible)
+ *     -F  publish every buffer in a shared memory ring for other local
+ *         processes (see fanout.h and tap.c), they get it from this Unix
+ *         socket, e.g. /tmp/stm32-stream.sock
+ *     -P  serve live metrics in Prometheus text format at this Unix socket
+ *         (see metrics.h), e.g. /tmp/stm32-metrics.sock:
+ *           curl --unix-socket /tmp/stm32-metrics.sock http://localhost/metrics
+ *     -f  run the event handling under SCHED_FIFO at this priority
+ *     -L  lock all memory with mlockall
+ *     -Q  hold a /dev/cpu_dma_latency request of this many us while
+ *         running, 0 keeps the CPUs out of deep idle states (see rt.h)
+ *     -J  compare the settings of -c, -f, -L and -Q: stream for -t seconds
+ *         without any, with each one alone and with all of them, and print
+ *         the completion gap percentiles of every run
+ *     -A  auto-tune -s and -d before the capture: every transfer size from
+ *         512 bytes to 64 KiB is streamed briefly with 1,2,4,... in flight
+ *         and the configuration with the least buffer memory that comes
+ *         within this many percent of the peak throughput is used
+ *     -e  how the main thread handles the libusb events:
+ *           completed  libusb_handle_events_completed, blocks (default)
+ *           locked     libusb_handle_events_locked with the event lock held
+ *                      and a timeout of -k ms
+ *           busy       libusb_handle_events_timeout_completed with a zero
+ *                      timeout in a tight loop, never sleeps
+ *           poll       poll(2) on the libusb pollfds, then a zero-timeout
+ *                      event handler call
+ *           epoll      the pollfds in an epoll set (see usbpoll.h), the
+ *                      statistics are then printed once a second from a
+ *                      timerfd instead of from cb_in
+ *           all        stream for -t seconds with each of them and print
+ *                      a table
+ *         At exit the throughput, the completion gap p99, the CPU time of
+ *         the thread and its wakeups (voluntary context switches) per
+ *         second are printed for the strategy.
+ *     -k  timeout of the locked, poll and epoll waits in ms (default 100)
+ *     -E  same as -e epoll
+ * The CPU cost of the capture is reported in cycles and CPU time per MiB,
+ * run once with and once without -z to compare.
+ * At exit the inter-completion gaps and the submit-to-complete latency of
+ * every transfer are printed as p50/p90/p99/p99.9/max.
+ * For machine-readable, repeatable measurements use the harness in
+ *   benchmark.c instead: ./bench -m async -d 8 -f csv
  * As far as I know, sys/time.h is POSIX only and not available on Windows.
  * It should be trivial to exchange for a precise Windows time API.
  * For Documentation on libusb see:
@@ -18,10 +99,34 @@
  * http://libusb.6.n5.nabble.com/porting-from-0-1-to-0-93-example-code-tp5589p5593.html
  */
 
+#define _GNU_SOURCE
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/resource.h>
 #include <libusb-1.0/libusb.h>
 
+#include "spsc.h"
+#include "cpucycles.h"
+#include "timing.h"
+#include "hist.h"
+#include "verify.h"
+#include "capture.h"
+#include "replay.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "rt.h"
+#include "usbpoll.h"
+#include "usbhost.h"
+
 
 #define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
                                          * 0x0483 is STMs ID
@@ -29,22 +134,62 @@
 #define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
 #define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
 #define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
+#define USB_TIMEOUT	        3000        /* Connection timeout (in ms) */
+
+#define MAX_DEPTH           64          /* upper limit for transfers in flight */
+#define MAX_RETRIES         3           /* failures in a row before a slot is given up */
 
 
 //Global variables:
-struct libusb_device_handle *devh = NULL;
+static struct usb_device usbdev;
 #define LEN_IN_BUFFER 1024*8
-static uint8_t in_buffer[LEN_IN_BUFFER];
+// the ring of transfers and one buffer of transferSize bytes per transfer,
+// the threaded mode has spareBuffers buffers more
+static struct usb_pool pool;
+static int zeroCopy = 0;
+static int depth = 4;
+static int transferSize = LEN_IN_BUFFER;
 
 // OUT-going transfers (OUT from host PC to USB-device)
 struct libusb_transfer *transfer_out = NULL;
 
-// IN-coming transfers (IN to host PC from USB-device)
-struct libusb_transfer *transfer_in = NULL;
+// IN-coming transfers (IN to host PC from USB-device) are pool.transfers.
+// All of them are submitted at the same time, so the host controller always
+// has the next transfer queued when the current one completes.
+static int inFlight = 0;        // transfers currently owned by libusb
+static int nextIn = 0;          // ring slot expected to complete next
+static int ringSize = 0;        // slots used by the current run (<= depth)
+static volatile int stopping = 0; // set to stop resubmitting completed transfers
+static uint32_t outOfOrder = 0; // completions that did not match nextIn
+static uint32_t inErrors = 0;   // completions with a status other than COMPLETED
 
 static libusb_context *ctx = NULL;
 
-int do_exit = 0;
+volatile int do_exit = 0;
+
+/*
+ * Threaded mode (-T)
+ * The event thread only reaps completions: it pushes a descriptor of the
+ * filled buffer into fullQueue and resubmits the transfer right away with a
+ * fresh buffer taken from freeQueue. The main thread pops the descriptors,
+ * does the accounting and printing and returns the buffers to freeQueue.
+ * Slow processing therefore only drains the spare buffers instead of
+ * delaying the next resubmission. When no spare buffer is left the event
+ * thread has to wait for the consumer, this is counted as a handoff stall.
+ */
+struct buf_desc {
+    uint32_t buf;               // index of the buffer in pool
+    int32_t length;             // actual_length of the transfer
+    uint64_t t;                 // completion time in ns
+};
+static int threaded = 0;
+static int numBuffers = 0;      // depth + spareBuffers in threaded mode
+static int spareBuffers = 16;
+static int workUs = 0;
+static struct spsc_ring fullQueue;  // event thread -> consumer
+static struct spsc_ring freeQueue;  // consumer -> event thread
+static _Atomic uint32_t handoffStalls = 0;
+static size_t maxOccupancy = 0;
 
 // Function Prototypes:
 void sighandler(int signum);
@@ -52,8 +197,104 @@ void print_libusb_transfer(struct libusb_transfer *p_t);
 
 uint32_t benchPackets=1;
 uint32_t benchBytes=0;
-struct timespec t1, t2;
-uint32_t diff=0;
+uint64_t t1, t2;        // CLOCK_MONOTONIC in ns, see timing.h
+uint64_t diff=0;
+// totals per depth step, used by the depth sweep
+static uint64_t totalBytes = 0;
+static uint64_t totalTransfers = 0;
+static int quiet = 0;
+
+// Latency histograms, written only by the thread that runs the callbacks.
+// gapHist: time between two completions, latencyHist: submit to complete.
+static struct hist gapHist;
+static struct hist latencyHist;
+static uint64_t submitTime[MAX_DEPTH];
+static uint8_t failures[MAX_DEPTH];         // of every slot since its last data
+static uint64_t lastCompletion = 0;
+static struct cpu_cycles cycles;
+
+// stream check (-v), runs on the thread that does the accounting
+static int verifying = 0;
+static int pattern = -1;
+static struct verify verifier;
+
+// capture to disk (-o), fed by the same thread as the stream check
+static const char *capturePrefix = NULL;
+static uint64_t rotateMiB = 0;
+static int rotateSeconds = 0;
+static int captureFlags = 0;
+static struct capture capture;
+
+// replay (-i) instead of the device, see submit_in and handle_events
+static const char *replayPrefix = NULL;
+static double replaySpeed = 0;
+static struct replay replay;
+static _Atomic int replayEnded = 0;
+
+// fan-out to local readers (-F), fed by the same thread as the capture
+static const char *fanoutPath = NULL;
+static struct fanout fanout;
+
+// always recorded, served with -P
+static const char *metricsPath = NULL;
+static struct metrics metrics;
+
+// real-time settings of the event handling thread (-c -f -L -Q)
+static struct rt_settings rt = RT_SETTINGS_NONE;
+static int rtCompare = 0;
+
+/*
+ * Event handling strategies (-e)
+ * run_events handles the events with one of them until do_exit or for a
+ * number of seconds and measures the thread that runs it.
+ */
+enum {
+    EVENTS_COMPLETED,
+    EVENTS_LOCKED,
+    EVENTS_BUSY,
+    EVENTS_POLL,
+    EVENTS_EPOLL,
+    EVENT_STRATEGIES
+};
+static const char *strategyNames[EVENT_STRATEGIES] = {
+    "completed", "locked", "busy", "poll", "epoll"
+};
+static int strategy = EVENTS_COMPLETED;
+static int strategyAll = 0;
+static int eventTimeoutMs = 100;
+static int pollfdsChanged;
+
+struct event_run {
+    uint64_t start, end;        // ns
+    uint64_t bytes;             // totalBytes at the start
+    uint64_t rounds;            // returns from the wait or the event handler
+    long switches;              // voluntary context switches of the thread
+    double cpu;                 // CPU time of the thread in s
+};
+
+// the epoll strategy, the statistics are printed from a timerfd then
+static int timerReport = 0;
+static struct usbpoll usbpoll;
+static uint64_t reportTime, reportBytes, reportTransfers, reportWakeups;
+
+/*
+ * Reconnect (-R)
+ * The hotplug callback and the transfer callbacks only set flags, the
+ * teardown and the restart are done by reconnect_step() in the main loop,
+ * outside of any libusb callback.
+ */
+static int reconnect = 0;
+static libusb_hotplug_callback_handle hotplugHandle;
+static volatile int detached = 0;       // the device is gone, tear down
+static libusb_device *arrived = NULL;   // a new device to open, referenced
+static int resuming = 0;                // waiting for the first transfer after a reconnect
+static uint64_t streamStart;            // time the stream (re)started
+static uint64_t streamBytes;            // totalBytes at that time
+static uint64_t detachTime, attachTime;
+static double detachRate;               // average B/s before the last detach
+static double lostBytes = 0;            // estimated from detachRate
+static uint32_t reconnects = 0;
+static uint64_t downTime = 0;
 
 enum {
     out_deinit,
@@ -69,36 +310,1110 @@ void cb_out(struct libusb_transfer *transfer)
 		transfer->status, transfer->actual_length);
 }
 
+/*
+ * Accounting of one filled IN buffer.
+ * Called from cb_in, or from the consumer loop in threaded mode.
+ */
+static void account_transfer(int length, uint64_t t)
+{
+	size_t occupancy;
+
+	t2 = t;
+	if (resuming) {
+		// the stream runs again, so the reconnect is complete
+		resuming = 0;
+		downTime += t-detachTime;
+		lostBytes += detachRate*(t-detachTime)/NS_PER_SEC;
+		printf("\nreconnected: %.1f ms without data, attach to first transfer %.1f ms, "
+			"~%.0f bytes lost\n", (t-detachTime)/(double)NS_PER_MS,
+			(t-attachTime)/(double)NS_PER_MS, detachRate*(t-detachTime)/NS_PER_SEC);
+	}
+	benchBytes += length;
+	totalBytes += length;
+	totalTransfers++;
+	metric_add(&metrics.bytes, length);
+	metric_add(&metrics.transfers, 1);
+	if (length < transferSize)
+		metric_add(&metrics.shortTransfers, 1);
+
+	//this averages the bandwidth over many transfers
+	if(++benchPackets%100==0){
+		diff = t2-t1;
+		t1 = t2;
+	 	if (!quiet && !timerReport) {
+	 		printf("\rreceived %5d transfers and %8d bytes in %8llu us, %8.1f B/s", benchPackets, benchBytes,
+	 			(unsigned long long)(diff/NS_PER_US), benchBytes*(double)NS_PER_SEC/diff);
+	 		if (threaded) {
+	 			occupancy = spsc_count(&fullQueue);
+	 			printf(", queue %3zu/%3zu, %u stalls", occupancy, maxOccupancy, handoffStalls);
+	 		}
+			fflush(stdout);
+		}
+		benchPackets=0;
+		benchBytes=0;
+	}
+}
+
+/*
+ * Checks the status and the order of a completed IN transfer and records
+ * its timing. Returns 0 if the transfer carries data, -1 otherwise.
+ */
+static int reap_transfer(struct libusb_transfer *transfer, uint64_t now)
+{
+	int slot = (int)(intptr_t)transfer->user_data;
+
+	inFlight--;
+	metric_set(&metrics.inFlight, inFlight);
+	metric_add(&metrics.status[transfer->status < METRICS_STATUSES ? transfer->status
+		: LIBUSB_TRANSFER_ERROR], 1);
+
+	if (slot != nextIn)
+		outOfOrder++;
+	nextIn = (slot+1)%ringSize;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		// cancelled transfers are expected while shutting down
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+			inErrors++;
+			fprintf(stderr, "\ncb_in: slot %d status=%d\n", slot, transfer->status);
+		}
+		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+			if (reconnect)
+				detached = 1;
+			else
+				do_exit = 1;
+		}
+		return -1;
+	}
+
+	failures[slot] = 0;
+	hist_record(&latencyHist, now-submitTime[slot]);
+	metric_record(&metrics.latency, now-submitTime[slot]);
+	if (lastCompletion) {
+		hist_record(&gapHist, now-lastCompletion);
+		metric_record(&metrics.gap, now-lastCompletion);
+	}
+	lastCompletion = now;
+	return 0;
+}
+
+/*
+ * The transfers go to the replay instead of libusb with -i.
+ */
+static int submit_in(struct libusb_transfer *transfer)
+{
+	if (replayPrefix)
+		return replaySubmit(&replay, transfer);
+	return libusb_submit_transfer(transfer);
+}
+
+static void cancel_ring(int n)
+{
+	int i;
+
+	if (replayPrefix) {
+		replayCancel(&replay);
+		return;
+	}
+	for (i=0; i<n; i++)
+		libusb_cancel_transfer(pool.transfers[i]);
+}
+
+/*
+ * Runs the event handler for at most tv. Returns REPLAY_END when a replay
+ * ran out of data, < 0 on error.
+ */
+static int handle_events(struct timeval *tv)
+{
+	if (replayPrefix)
+		return replayEvents(&replay);
+	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+/*
+ * Without a transfer in flight no callback would ever end the event loop,
+ * so the stream ends here. A detached device is torn down by reconnect_step.
+ */
+static void check_ring(void)
+{
+	if (inFlight == 0 && !stopping && !detached) {
+		fprintf(stderr, "\nno transfer left in flight\n");
+		do_exit = 1;
+	}
+}
+
+//hand the slot back to the host controller
+static void resubmit(struct libusb_transfer *transfer)
+{
+	if (!stopping && !do_exit) {
+		submitTime[(int)(intptr_t)transfer->user_data] = now_ns();
+		if (submit_in(transfer) == 0)
+			inFlight++;
+		else
+			inErrors++;
+		metric_set(&metrics.inFlight, inFlight);
+		check_ring();
+	}
+}
+
+/*
+ * A transfer that came back without data. Timeouts and transmission errors
+ * are retried, a stalled endpoint stays stalled until it is cleared.
+ * A slot that fails MAX_RETRIES times in a row is given up, a persistent
+ * fault would otherwise keep it busy forever.
+ */
+static void retry_transfer(struct libusb_transfer *transfer)
+{
+	int slot = (int)(intptr_t)transfer->user_data;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	case LIBUSB_TRANSFER_ERROR:
+		if (++failures[slot] <= MAX_RETRIES) {
+			resubmit(transfer);
+			break;
+		}
+		fprintf(stderr, "\nslot %d failed %d times in a row, giving it up\n", slot, MAX_RETRIES+1);
+		// fall through
+	default:
+		if (!do_exit)
+			check_ring();
+		break;
+	}
+}
+
 // In Callback
 //   - This is called after the command for version is processed.
-//     That is, the data for in_buffer IS AVAILABLE.
+//     That is, the data in the buffer IS AVAILABLE.
+//   - user_data holds the ring slot of the transfer. libusb completes bulk
+//     transfers of one endpoint in submission order, so the slots complete
+//     round robin. The data is processed before the slot is handed back.
 void cb_in(struct libusb_transfer *transfer)
 {
     //measure the time
-	clock_gettime(CLOCK_REALTIME, &t2);
-	//submit the next transfer
-	libusb_submit_transfer(transfer_in);
+	uint64_t now = now_ns();
 
-	benchBytes += transfer->actual_length;
-	//this averages the bandwidth over many transfers
-	if(++benchPackets%100==0){
-		//Warning: uint32_t has a max value of 4294967296 so this will overflow over 4secs
-		diff = (t2.tv_sec-t1.tv_sec)*1000000000L+(t2.tv_nsec-t1.tv_nsec);
-		t1.tv_sec = t2.tv_sec;
-	 	t1.tv_nsec = t2.tv_nsec;
-	 	printf("\rreceived %5d transfers and %8d bytes in %8d us, %8.1f B/s", benchPackets, benchBytes, diff/1000, benchBytes*1000000.0/(diff/1000));
+	if (reap_transfer(transfer, now) < 0) {
+		retry_transfer(transfer);
+		return;
+	}
+	// a zero-copy buffer is overwritten as soon as it is resubmitted
+	if (verifying)
+		verifyData(&verifier, transfer->buffer, transfer->actual_length);
+	if (capturePrefix) {
+		captureWrite(&capture, transfer->buffer, transfer->actual_length, now);
+		metric_set(&metrics.dropped, capture.droppedBuffers);
+	}
+	if (fanoutPath)
+		fanoutPublish(&fanout, transfer->buffer, transfer->actual_length, now);
+	resubmit(transfer);
+	account_transfer(transfer->actual_length, now);
+}
+
+// In Callback of the threaded mode, runs on the event thread
+//   - The filled buffer is handed to the consumer and the transfer is
+//     resubmitted with a free buffer before anything else is done.
+void cb_in_threaded(struct libusb_transfer *transfer)
+{
+	struct buf_desc d;
+	uint32_t next;
+
+	d.t = now_ns();
+	if (reap_transfer(transfer, d.t) < 0) {
+		retry_transfer(transfer);
+		return;
+	}
+
+	d.buf = (transfer->buffer-pool.slab)/transferSize;
+	d.length = transfer->actual_length;
+	// fullQueue holds every buffer, so this push can not fail
+	spsc_push(&fullQueue, &d);
+
+	if (spsc_pop(&freeQueue, &next) < 0) {
+		handoffStalls++;
+		while (spsc_pop(&freeQueue, &next) < 0) {
+			if (stopping || do_exit)
+				return;
+			sched_yield();
+		}
+	}
+	transfer->buffer = usbPoolBuffer(&pool, next);
+	resubmit(transfer);
+}
+
+/*
+ * Event thread of the threaded mode.
+ * It runs until shutdown was requested and every transfer called back.
+ */
+static void *event_thread(void *arg)
+{
+	struct timeval tv = {0, 100000};
+	struct rt_state st;
+	int r;
+
+	(void)arg;
+	rt_apply(&rt, &st);
+	while (!stopping || inFlight > 0) {
+		r = handle_events(&tv);
+		if (r < 0)
+			break;
+		if (r == REPLAY_END) {
+			// the consumer finishes the queue and stops
+			replayEnded = 1;
+			usleep(100);
+		}
+	}
+	rt_restore(&st);
+	return NULL;
+}
+
+/*
+ * Consumer loop of the threaded mode, runs on the main thread.
+ */
+static void consume(void)
+{
+	struct buf_desc d;
+	uint64_t start;
+	size_t occupancy;
+
+	while (!do_exit) {
+		occupancy = spsc_count(&fullQueue);
+		if (occupancy > maxOccupancy)
+			maxOccupancy = occupancy;
+		metric_set(&metrics.queued, occupancy);
+		if (spsc_pop(&fullQueue, &d) < 0) {
+			if (replayEnded)
+				break;
+			usleep(100);
+			continue;
+		}
+		account_transfer(d.length, d.t);
+		if (verifying)
+			verifyData(&verifier, usbPoolBuffer(&pool, d.buf), d.length);
+		if (capturePrefix) {
+			captureWrite(&capture, usbPoolBuffer(&pool, d.buf), d.length, d.t);
+			metric_set(&metrics.dropped, capture.droppedBuffers);
+		}
+		if (fanoutPath)
+			fanoutPublish(&fanout, usbPoolBuffer(&pool, d.buf), d.length, d.t);
+		if (workUs) {
+			// stands in for real processing of buffer d.buf
+			start = now_ns();
+			while (now_ns()-start < workUs*NS_PER_US)
+				;
+		}
+		spsc_push(&freeQueue, &d.buf);
+	}
+}
+
+/*
+ * Submits the first n transfers of the ring, the statistics are kept.
+ * Returns the number of transfers that are in flight afterwards.
+ */
+static int restart_ring(int n)
+{
+	int i, r;
+
+	stopping = 0;
+	nextIn = 0;
+	ringSize = n;
+	lastCompletion = 0;
+	for (i=0; i<n; i++) {
+		failures[i] = 0;
+		submitTime[i] = now_ns();
+		r = submit_in(pool.transfers[i]);
+		if (r < 0) {
+			fprintf(stderr, "submit of slot %d failed: %s\n", i, libusb_error_name(r));
+			break;
+		}
+		inFlight++;
+	}
+	metric_set(&metrics.inFlight, inFlight);
+	return inFlight;
+}
+
+/*
+ * Submits the first n transfers of the ring for a new measurement.
+ */
+static int submit_ring(int n)
+{
+	hist_reset(&gapHist);
+	hist_reset(&latencyHist);
+	return restart_ring(n);
+}
+
+/*
+ * Cancels all transfers in flight and runs the event handler until every
+ * one of them has called back. Only then the buffers may be reused or freed.
+ */
+static void drain_ring(int n)
+{
+	struct timeval tv = {0, 100000};
+
+	stopping = 1;
+	cancel_ring(n);
+	while (inFlight > 0) {
+		if (handle_events(&tv) < 0)
+			break;
+	}
+}
+
+/*
+ * Switches the stream firmware to the test pattern and restarts the check.
+ * The firmware switches and restarts the pattern on 'a', 'c' or 'p'.
+ */
+static void select_pattern(void)
+{
+	uint8_t command = "acp"[pattern];
+	int r, len;
+
+	// a replay carries whatever pattern was recorded
+	if (!replayPrefix) {
+		r = libusb_bulk_transfer(usbdev.h, USB_ENDPOINT_OUT, &command, 1, &len, USB_TIMEOUT);
+		if (r < 0)
+			fprintf(stderr, "could not select the pattern: %s\n", libusb_error_name(r));
+	}
+	verifyInit(&verifier, pattern, stderr, 20);
+}
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *c, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	(void)c;
+	(void)user_data;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		if (usbdev.h && dev == libusb_get_device(usbdev.h))
+			detached = 1;
+	} else if (!arrived) {
+		arrived = libusb_ref_device(dev);
+	}
+	return 0;
+}
+
+/*
+ * Called from the main loop after every round of event handling.
+ * On detach it waits until every transfer called back and closes the
+ * device. A device that arrived afterwards is opened and streamed from.
+ */
+static void reconnect_step(void)
+{
+	uint64_t now;
+	int i, r;
+
+	if (detached && usbdev.h) {
+		if (inFlight > 0) {
+			stopping = 1;
+			for (i=0; i<depth; i++)
+				libusb_cancel_transfer(pool.transfers[i]);
+			return;
+		}
+		now = now_ns();
+		if (!resuming) {
+			detachTime = now;
+			// the data the device would have sent until it streams again
+			// is estimated at the average rate up to now
+			detachRate = now > streamStart
+				? (totalBytes-streamBytes)*(double)NS_PER_SEC/(now-streamStart) : 0;
+			printf("\ndevice detached after %llu bytes, waiting for it to come back\n",
+				(unsigned long long)totalBytes);
+		}
+		// a zero-copy mapping belongs to the device handle
+		usbPoolUnbind(&pool);
+		usbClose(&usbdev);
+		detached = 0;
+		resuming = 1;
+		return;
+	}
+	if (usbdev.h || !arrived)
+		return;
+
+	attachTime = now_ns();
+	r = usbOpenDevice(&usbdev, arrived);
+	libusb_unref_device(arrived);
+	arrived = NULL;
+	if (r == 0) {
+		r = usbPoolBind(&pool, &usbdev);
+		if (r < 0)
+			usbClose(&usbdev);
+	}
+	if (r < 0) {
+		fprintf(stderr, "could not open the new device: %s\n", libusb_error_name(r));
+		return;
+	}
+	// the buffers may have moved with the new mapping
+	usbPoolFill(&pool, &usbdev, USB_ENDPOINT_IN, cb_in, 0);
+	if (verifying)
+		select_pattern();
+	streamStart = now_ns();
+	streamBytes = totalBytes;
+	reconnects++;
+	restart_ring(depth);
+}
+
+/*
+ * Prints the CPU cost of the bytes received since cycles_start.
+ */
+static void print_cpu_cost(uint64_t bytes)
+{
+	double mib = bytes/(1024.0*1024.0);
+	uint64_t c = cycles_read(&cycles);
+
+	if (mib <= 0)
+		return;
+	printf("zero-copy %s: ", zeroCopy ? "on" : "off");
+	if (c)
+		printf("%.0f %scycles/MiB, ", c/mib, cycles.userOnly ? "user " : "");
+	printf("%.3f ms CPU/MiB\n", cycles_cpu_seconds(&cycles)*1000/mib);
+}
+
+/*
+ * Measures the throughput for every queue depth 1,2,4,... up to depth.
+ * Every step runs for the given number of seconds with n transfers in flight.
+ */
+static int sweep_depth(int seconds)
+{
+	int n, r = 0;
+	uint64_t start, now;
+	struct timeval tv = {0, 100000};
+	double s, mib, cpu;
+	uint64_t c;
+
+	quiet = 1;
+	printf("\nzero-copy %s\n", zeroCopy ? "on" : "off");
+	printf("%6s %10s %12s %12s %12s %12s %12s %10s\n", "depth", "size", "transfers/s", "B/s",
+		"cycles/MiB", "ms CPU/MiB", "gap p99 us", "out of order");
+	for (n=1; n<=depth && !do_exit; n = (n*2 > depth && n != depth) ? depth : n*2) {
+		totalBytes = 0;
+		totalTransfers = 0;
+		outOfOrder = 0;
+		if (submit_ring(n) == 0)
+			return -1;
+		cycles_start(&cycles);
+		start = now_ns();
+		do {
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+			now = now_ns();
+		} while (r >= 0 && !do_exit && now-start < seconds*NS_PER_SEC);
+		s = (now-start)/(double)NS_PER_SEC;
+		mib = totalBytes/(1024.0*1024.0);
+		c = cycles_read(&cycles);
+		cpu = cycles_cpu_seconds(&cycles);
+		cycles_stop(&cycles);
+		drain_ring(n);
+		if (r < 0)
+			return r;
+		printf("%6d %10d %12.1f %12.1f %12.0f %12.3f %12.1f %10u\n", n, transferSize,
+			totalTransfers/s, totalBytes/s, mib > 0 ? c/mib : 0.0,
+			mib > 0 ? cpu*1000/mib : 0.0, hist_percentile(&gapHist, 99)/1000.0, outOfOrder);
+	}
+	return 0;
+}
+
+/*
+ * Streams for the given number of seconds without real-time settings, with
+ * each of the requested ones alone and with all of them, and prints the
+ * completion gaps of every run.
+ */
+static int compare_rt(int seconds)
+{
+	struct rt_settings runs[6], none = RT_SETTINGS_NONE;
+	struct rt_state st;
+	struct timeval tv = {0, 100000};
+	uint64_t start, now;
+	char name[64];
+	int i, n = 0, r = 0, failed;
+
+	runs[n++] = none;
+	if (rt.cpu >= 0) {
+		runs[n] = none;
+		runs[n++].cpu = rt.cpu;
+	}
+	if (rt.fifo > 0) {
+		runs[n] = none;
+		runs[n++].fifo = rt.fifo;
+	}
+	if (rt.lock) {
+		runs[n] = none;
+		runs[n++].lock = 1;
+	}
+	if (rt.dmaLatency >= 0) {
+		runs[n] = none;
+		runs[n++].dmaLatency = rt.dmaLatency;
+	}
+	if (n > 2)
+		runs[n++] = rt;
+
+	quiet = 1;
+	printf("\n%-34s %12s %10s %10s %10s %10s %10s\n", "settings", "transfers/s",
+		"gap p50 us", "p90", "p99", "p99.9", "max");
+	for (i=0; i<n && !do_exit; i++) {
+		failed = rt_apply(&runs[i], &st);
+		totalTransfers = 0;
+		if (submit_ring(depth) == 0) {
+			rt_restore(&st);
+			return -1;
+		}
+		start = now_ns();
+		do {
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+			now = now_ns();
+		} while (r >= 0 && !do_exit && now-start < seconds*NS_PER_SEC);
+		drain_ring(depth);
+		rt_restore(&st);
+		if (r < 0)
+			return r;
+		rt_describe(&runs[i], name, sizeof name);
+		if (failed)
+			strncat(name, " (not all)", sizeof name-strlen(name)-1);
+		printf("%-34s %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+			totalTransfers/((now-start)/(double)NS_PER_SEC),
+			hist_percentile(&gapHist, 50)/1000.0, hist_percentile(&gapHist, 90)/1000.0,
+			hist_percentile(&gapHist, 99)/1000.0, hist_percentile(&gapHist, 99.9)/1000.0,
+			gapHist.max/1000.0);
+	}
+	return 0;
+}
+
+/*
+ * Auto-tune (-A)
+ * Runs before the ring is set up, with transfers and a buffer of its own.
+ * For every size the depth is only raised while that still gains more
+ * than the tolerance, deeper queues would just cost memory.
+ */
+#define TUNE_MIN_SIZE   512         /* a multiple of every max packet size */
+#define TUNE_MAX_SIZE   (64*1024)
+#define TUNE_MAX_DEPTH  32
+#define TUNE_MS         200         /* per configuration */
+#define TUNE_POINTS     64
+
+static int tuneInFlight;
+static int tuneStop;
+static uint64_t tuneBytes, tuneFirst, tuneLast;
+
+static void LIBUSB_CALL cb_tune(struct libusb_transfer *transfer)
+{
+	uint64_t now = now_ns();
+
+	tuneInFlight--;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		// the rate is taken from the first completion on, not from the submit
+		if (tuneFirst)
+			tuneBytes += transfer->actual_length;
+		else
+			tuneFirst = now;
+		tuneLast = now;
+	} else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		do_exit = 1;
+	}
+	if (!tuneStop && !do_exit && libusb_submit_transfer(transfer) == 0)
+		tuneInFlight++;
+}
+
+/*
+ * Streams with n transfers of size bytes for TUNE_MS, returns the B/s.
+ */
+static double tune_point(struct usb_pool *tp, int size, int n)
+{
+	struct timeval tv = {0, 100000};
+	uint64_t start;
+	int i;
+
+	tuneBytes = tuneFirst = tuneLast = 0;
+	tuneStop = 0;
+	for (i=0; i<n; i++) {
+		libusb_fill_bulk_transfer(tp->transfers[i], usbdev.h, USB_ENDPOINT_IN,
+			usbPoolBuffer(tp, i), size, cb_tune, NULL, 0);
+		if (libusb_submit_transfer(tp->transfers[i]) == 0)
+			tuneInFlight++;
+	}
+	start = now_ns();
+	while (!do_exit && now_ns()-start < TUNE_MS*NS_PER_MS) {
+		if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+			break;
+	}
+	tuneStop = 1;
+	for (i=0; i<n; i++)
+		libusb_cancel_transfer(tp->transfers[i]);
+	while (tuneInFlight > 0) {
+		if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+			break;
+	}
+	return tuneLast > tuneFirst ? tuneBytes*(double)NS_PER_SEC/(tuneLast-tuneFirst) : 0;
+}
+
+/*
+ * Sets transferSize and depth to the smallest configuration within
+ * tolerance percent of the peak. Returns -1 if nothing could be measured.
+ */
+static int autotune(double tolerance)
+{
+	struct { int size, depth; double rate; } p[TUNE_POINTS];
+	struct usb_pool tp;
+	double peak = 0, prev;
+	int size, n, i, np = 0, best = -1;
+
+	// a pool of its own, the ring is sized from the result
+	if (usbPoolCreate(&tp, &usbdev, TUNE_MAX_DEPTH, TUNE_MAX_DEPTH, TUNE_MAX_SIZE, 0) < 0)
+		return -1;
+
+	printf("auto-tune: %d ms per configuration\n%10s %6s %12s\n", TUNE_MS, "size", "depth", "B/s");
+	for (size=TUNE_MIN_SIZE; size<=TUNE_MAX_SIZE && !do_exit; size *= 2) {
+		prev = 0;
+		for (n=1; n<=TUNE_MAX_DEPTH && np < TUNE_POINTS && !do_exit; n *= 2) {
+			p[np].size = size;
+			p[np].depth = n;
+			p[np].rate = tune_point(&tp, size, n);
+			printf("%10d %6d %12.1f\n", size, n, p[np].rate);
+			if (p[np].rate > peak)
+				peak = p[np].rate;
+			// saturated, more in flight only costs memory
+			if (n > 1 && p[np].rate < prev*(1+tolerance/100)) {
+				np++;
+				break;
+			}
+			prev = p[np++].rate;
+		}
+	}
+	for (i=0; i<np; i++) {
+		if (p[i].rate < peak*(1-tolerance/100))
+			continue;
+		if (best < 0 || (size_t)p[i].size*p[i].depth < (size_t)p[best].size*p[best].depth
+				|| ((size_t)p[i].size*p[i].depth == (size_t)p[best].size*p[best].depth
+					&& p[i].depth < p[best].depth))
+			best = i;
+	}
+
+	usbPoolDestroy(&tp);
+	if (best < 0 || peak <= 0)
+		return -1;
+	transferSize = p[best].size;
+	depth = p[best].depth;
+	printf("auto-tune: %d transfers of %d bytes, %.1f B/s (%.1f%% of the peak %.1f B/s), %d KiB of buffers\n",
+		depth, transferSize, p[best].rate, p[best].rate*100/peak, peak, depth*transferSize/1024);
+	return 0;
+}
+
+/*
+ * Timer of the epoll loop, prints what was received since the last call.
+ */
+static void report(void *arg, uint64_t expirations)
+{
+	uint64_t now = now_ns();
+
+	(void)arg;
+	(void)expirations;
+	if (!quiet) {
+		printf("\rreceived %8llu transfers and %10llu bytes in %8llu us, %12.1f B/s, %6llu wakeups",
+			(unsigned long long)(totalTransfers-reportTransfers),
+			(unsigned long long)(totalBytes-reportBytes),
+			(unsigned long long)((now-reportTime)/NS_PER_US),
+			(totalBytes-reportBytes)*(double)NS_PER_SEC/(now-reportTime),
+			(unsigned long long)(usbpoll.wakeups-reportWakeups));
 		fflush(stdout);
-		benchPackets=0;
-		benchBytes=0;
 	}
+	reportTime = now;
+	reportBytes = totalBytes;
+	reportTransfers = totalTransfers;
+	reportWakeups = usbpoll.wakeups;
+}
+
+static double thread_cpu(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static long thread_switches(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_nvcsw;
+}
+
+static void LIBUSB_CALL pollfd_changed(int fd, short events, void *user_data)
+{
+	(void)fd;
+	(void)events;
+	(void)user_data;
+	pollfdsChanged = 1;
+}
+
+static void LIBUSB_CALL pollfd_gone(int fd, void *user_data)
+{
+	(void)fd;
+	(void)user_data;
+	pollfdsChanged = 1;
+}
+
+/*
+ * Copies the libusb pollfds into pfd, returns their number.
+ */
+static int load_pollfds(struct pollfd *pfd, int max)
+{
+	const struct libusb_pollfd **fds;
+	int n;
+
+	pollfdsChanged = 0;
+	fds = libusb_get_pollfds(ctx);
+	if (!fds)
+		return 0;
+	for (n=0; fds[n] && n<max; n++) {
+		pfd[n].fd = fds[n]->fd;
+		pfd[n].events = fds[n]->events;
+	}
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+	libusb_free_pollfds(fds);
+#else
+	free(fds);
+#endif
+	return n;
 }
 
-int main(void)
+/*
+ * One round of the poll strategy: waits for the pollfds or the next libusb
+ * timeout, then lets libusb handle whatever is ready without blocking.
+ */
+static int poll_events(struct pollfd *pfd, int *n)
+{
+	struct timeval zero = {0, 0}, next;
+	int timeout = eventTimeoutMs;
+
+	if (pollfdsChanged)
+		*n = load_pollfds(pfd, 16);
+	if (libusb_get_next_timeout(ctx, &next) == 1 && next.tv_sec*1000+(next.tv_usec+999)/1000 < timeout)
+		timeout = next.tv_sec*1000+(next.tv_usec+999)/1000;
+	if (poll(pfd, *n, timeout) < 0 && errno != EINTR)
+		return LIBUSB_ERROR_IO;
+	return libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+}
+
+/*
+ * Handles the events with strategy s until do_exit, or for the given
+ * number of seconds if not 0. Returns < 0 on a libusb error.
+ */
+static int run_events(int s, int seconds, struct event_run *run)
+{
+	struct timeval tv = {eventTimeoutMs/1000, (eventTimeoutMs%1000)*1000}, zero = {0, 0};
+	struct pollfd pfd[16];
+	struct epoll_event ev[16];
+	int epfd = -1, npfd = 0, i, n, r = 0;
+
+	if (s == EVENTS_POLL) {
+		libusb_set_pollfd_notifiers(ctx, pollfd_changed, pollfd_gone, NULL);
+		npfd = load_pollfds(pfd, 16);
+	} else if (s == EVENTS_EPOLL) {
+		// the loop of an application that multiplexes the device with its
+		// other fds, here there are none besides the report timer
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0 || usbpollInit(&usbpoll, ctx, epfd) < 0) {
+			perror("epoll loop");
+			if (epfd >= 0)
+				close(epfd);
+			return LIBUSB_ERROR_OTHER;
+		}
+		if (!quiet) {
+			if (usbpollTimer(&usbpoll, NS_PER_SEC, report, NULL) < 0)
+				perror("report timer");
+			else
+				timerReport = 1;
+		}
+	} else if (s == EVENTS_LOCKED) {
+		// nobody else can handle events until it is released again
+		libusb_lock_events(ctx);
+	}
+
+	run->start = reportTime = now_ns();
+	run->bytes = reportBytes = totalBytes;
+	reportTransfers = totalTransfers;
+	run->rounds = 0;
+	run->switches = thread_switches();
+	run->cpu = thread_cpu();
+	while (!do_exit && r >= 0 && (!seconds || now_ns()-run->start < seconds*NS_PER_SEC)) {
+		switch (s) {
+		case EVENTS_COMPLETED:
+			// blocks until something happened
+			r = libusb_handle_events_completed(ctx, NULL);
+			break;
+		case EVENTS_LOCKED:
+			// the lock is already held, it is not taken for every call
+			r = libusb_handle_events_locked(ctx, &tv);
+			break;
+		case EVENTS_BUSY:
+			r = libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+			break;
+		case EVENTS_POLL:
+			r = poll_events(pfd, &npfd);
+			break;
+		case EVENTS_EPOLL:
+			// a signal ends the wait with EINTR, do_exit is checked then
+			n = epoll_wait(epfd, ev, sizeof ev/sizeof ev[0], eventTimeoutMs);
+			for (i=0; i<n && r >= 0; i++) {
+				r = usbpollDispatch(&usbpoll, &ev[i]);
+				if (r == 0) {
+					// an fd of the application would be handled here
+				}
+			}
+			break;
+		}
+		run->rounds++;
+		if (reconnect) {
+			// closing the device takes the event lock
+			if (s == EVENTS_LOCKED)
+				libusb_unlock_events(ctx);
+			reconnect_step();
+			if (s == EVENTS_LOCKED)
+				libusb_lock_events(ctx);
+		}
+	}
+	run->end = now_ns();
+	run->cpu = thread_cpu()-run->cpu;
+	run->switches = thread_switches()-run->switches;
+	run->bytes = totalBytes-run->bytes;
+
+	if (s == EVENTS_POLL) {
+		libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+	} else if (s == EVENTS_EPOLL) {
+		usbpollClose(&usbpoll);
+		close(epfd);
+		timerReport = 0;
+	} else if (s == EVENTS_LOCKED) {
+		libusb_unlock_events(ctx);
+	}
+	return r < 0 ? r : 0;
+}
+
+static void print_event_run(const char *name, struct event_run *run)
+{
+	double s = (run->end-run->start)/(double)NS_PER_SEC;
+
+	printf("%-10s %12.1f %12.1f %8.1f %12.0f %12.0f\n", name, s > 0 ? run->bytes/s : 0.0,
+		hist_percentile(&gapHist, 99)/1000.0, s > 0 ? run->cpu*100/s : 0.0,
+		s > 0 ? run->switches/s : 0.0, s > 0 ? run->rounds/s : 0.0);
+}
+
+static void print_event_header(void)
+{
+	printf("%-10s %12s %12s %8s %12s %12s\n", "strategy", "B/s", "gap p99 us", "CPU %",
+		"wakeups/s", "rounds/s");
+}
+
+/*
+ * Streams for the given number of seconds with every event handling
+ * strategy and prints their cost next to their throughput and jitter.
+ */
+static int compare_strategies(int seconds)
+{
+	struct event_run run;
+	int i, r = 0;
+
+	quiet = 1;
+	printf("\n");
+	print_event_header();
+	for (i=0; i<EVENT_STRATEGIES && !do_exit; i++) {
+		if (submit_ring(depth) == 0)
+			return -1;
+		r = run_events(i, seconds, &run);
+		drain_ring(depth);
+		if (r < 0)
+			return r;
+		print_event_run(strategyNames[i], &run);
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d depth] [-s transfersize] [-S] [-t seconds]\n"
+		"       %*s [-T] [-c cpu] [-q buffers] [-w us] [-z] [-v alphabet|counter|prbs] [-R]\n"
+		"       %*s [-o prefix [-m MiB] [-M seconds] [-p]]\n"
+		"       %*s [-i prefix [-x speed]] [-F socket] [-P socket]\n"
+		"       %*s [-f priority] [-L] [-Q us] [-J] [-A percent]\n"
+		"       %*s [-e completed|locked|busy|poll|epoll|all [-k ms]] [-E]\n",
+		name, (int)strlen(name), "", (int)strlen(name), "", (int)strlen(name), "",
+		(int)strlen(name), "", (int)strlen(name), "");
+}
+
+int main(int argc, char **argv)
 {
 	struct sigaction sigact;
 
 	int r = 1;  // result
-	int i;
+	int i, opt;
+	int sweep = 0;
+	int sweepSeconds = 2;
+	struct rt_state rtState = { .qosFd = -1 };
+	char rtName[64];
+	double tuneTolerance = -1;
+	struct event_run eventRun;
+	pthread_t eventThread;
+	struct ctrl_caps caps;
+	struct ctrl_params params;
+	uint32_t channels = 0x01;
+	const char *conflict = NULL;
+
+	while ((opt = getopt(argc, argv, "d:s:St:Tc:q:w:zv:Ro:m:M:pi:x:F:P:f:LQ:JA:e:k:Eh")) != -1) {
+		switch (opt) {
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			transferSize = atoi(optarg);
+			break;
+		case 'S':
+			sweep = 1;
+			break;
+		case 't':
+			sweepSeconds = atoi(optarg);
+			break;
+		case 'T':
+			threaded = 1;
+			break;
+		case 'c':
+			rt.cpu = atoi(optarg);
+			break;
+		case 'q':
+			spareBuffers = atoi(optarg);
+			break;
+		case 'w':
+			workUs = atoi(optarg);
+			break;
+		case 'z':
+			zeroCopy = 1;
+			break;
+		case 'v':
+			pattern = verifyParse(optarg);
+			if (pattern < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			verifying = 1;
+			break;
+		case 'R':
+			reconnect = 1;
+			break;
+		case 'o':
+			capturePrefix = optarg;
+			break;
+		case 'm':
+			rotateMiB = strtoull(optarg, NULL, 0);
+			break;
+		case 'M':
+			rotateSeconds = atoi(optarg);
+			break;
+		case 'p':
+			captureFlags |= CAPTURE_PYRAMID;
+			break;
+		case 'i':
+			replayPrefix = optarg;
+			break;
+		case 'x':
+			replaySpeed = atof(optarg);
+			break;
+		case 'F':
+			fanoutPath = optarg;
+			break;
+		case 'P':
+			metricsPath = optarg;
+			break;
+		case 'f':
+			rt.fifo = atoi(optarg);
+			break;
+		case 'L':
+			rt.lock = 1;
+			break;
+		case 'Q':
+			rt.dmaLatency = atoi(optarg);
+			break;
+		case 'J':
+			rtCompare = 1;
+			break;
+		case 'A':
+			tuneTolerance = atof(optarg);
+			break;
+		case 'e':
+			if (strcmp(optarg, "all") == 0) {
+				strategyAll = 1;
+				break;
+			}
+			for (strategy=0; strategy<EVENT_STRATEGIES; strategy++)
+				if (strcmp(optarg, strategyNames[strategy]) == 0)
+					break;
+			if (strategy == EVENT_STRATEGIES) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'k':
+			eventTimeoutMs = atoi(optarg);
+			break;
+		case 'E':
+			strategy = EVENTS_EPOLL;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	// every rejected value or combination says what is wrong with it
+	if (depth < 1 || depth > MAX_DEPTH) {
+		fprintf(stderr, "-d must be between 1 and %d\n", MAX_DEPTH);
+		usage(argv[0]);
+		return 1;
+	}
+	if (transferSize < 1)
+		conflict = "-s must be at least 1";
+	else if (sweepSeconds < 1)
+		conflict = "-t must be at least 1";
+	else if (spareBuffers < 1)
+		conflict = "-q must be at least 1";
+	else if (workUs < 0)
+		conflict = "-w can't be negative";
+	else if (rotateSeconds < 0)
+		conflict = "-M can't be negative";
+	else if (replaySpeed < 0)
+		conflict = "-x can't be negative";
+	else if (rt.fifo < 0 || rt.fifo > 99)
+		conflict = "-f must be between 0 and 99";
+	else if (eventTimeoutMs < 0)
+		conflict = "-k can't be negative";
+	else if (sweep && threaded)
+		conflict = "-S cannot be combined with -T";
+	else if (sweep && verifying)
+		conflict = "-S cannot be combined with -v";
+	else if (reconnect && sweep)
+		conflict = "-R cannot be combined with -S";
+	else if (reconnect && threaded)
+		conflict = "-R cannot be combined with -T";
+	else if (capturePrefix && sweep)
+		conflict = "-o cannot be combined with -S";
+	else if (fanoutPath && sweep)
+		conflict = "-F cannot be combined with -S";
+	else if (replayPrefix && sweep)
+		conflict = "-i cannot be combined with -S";
+	else if (replayPrefix && reconnect)
+		conflict = "-i cannot be combined with -R";
+	else if (replayPrefix && zeroCopy)
+		conflict = "-i cannot be combined with -z";
+	else if (rtCompare && (sweep || threaded || reconnect || replayPrefix))
+		conflict = "-J cannot be combined with -S, -T, -R or -i";
+	else if (tuneTolerance >= 0 && (sweep || replayPrefix))
+		conflict = "-A cannot be combined with -S or -i";
+	else if ((strategy != EVENTS_COMPLETED || strategyAll)
+			&& (sweep || threaded || rtCompare || replayPrefix))
+		conflict = "-e and -E cannot be combined with -S, -T, -J or -i";
+	else if (strategyAll && reconnect)
+		conflict = "-e all cannot be combined with -R";
+	if (conflict) {
+		fprintf(stderr, "%s\n", conflict);
+		usage(argv[0]);
+		return 1;
+	}
+
+	metricsInit(&metrics);
 
 	//init libUSB
 	r = libusb_init(NULL);
@@ -107,114 +1422,247 @@ int main(void)
 		return 1;
 	}
 
-    //open the device
-	devh = libusb_open_device_with_vid_pid(ctx,
- 		USB_VENDOR_ID, USB_PRODUCT_ID);
- 	if (!devh) {
- 		perror("device not found");
- 		return 1;
- 	}
+    //open the device, or the capture to replay
+	if (replayPrefix) {
+		if (replayOpen(&replay, replayPrefix, replaySpeed) < 0)
+			return 1;
+		printf("replaying %s %s\n", replayPrefix, replaySpeed > 0 ? "paced" : "as fast as possible");
+		r = 0;
+	} else {
+		r = usbOpen(&usbdev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+		if (r == LIBUSB_ERROR_NOT_FOUND) {
+			perror("device not found");
+			return 1;
+		}
+	}
+
+	// Define signal handler to catch system generated signals
+	// (If user hits CTRL+C, this will deal with it.)
+	sigact.sa_handler = sighandler;  // sighandler is defined below. It just sets do_exit.
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGQUIT, &sigact, NULL);
 
-    //claim the interface
-	r = libusb_claim_interface(devh, 0);
+    //usbOpen claimed the interface as well
 	if (r < 0) {
 		fprintf(stderr, "usb_claim_interface error %d\n", r);
 		exitflag = out;
 		do_exit = 1;
 	} else  {
         printf("Claimed interface\n");
+        exitflag = out_deinit;
 
-        // allocate transfer of data IN (IN to host PC from USB-device)
-        transfer_in  = libusb_alloc_transfer(0);
-        libusb_fill_bulk_transfer( transfer_in, devh, USB_ENDPOINT_IN,
-            in_buffer,  LEN_IN_BUFFER,  // Note: in_buffer is where input data written.
-            cb_in, NULL, 0); // no user data
+        if (tuneTolerance >= 0 && autotune(tuneTolerance) < 0)
+            fprintf(stderr, "auto-tune failed, keeping %d transfers of %d bytes\n", depth, transferSize);
 
-        //take the initial time measurement
-        clock_gettime(CLOCK_REALTIME, &t1);
-        //submit the transfer, all following transfers are initiated from the CB
-        r = libusb_submit_transfer(transfer_in);
-
-        // Define signal handler to catch system generated signals
-        // (If user hits CTRL+C, this will deal with it.)
-        sigact.sa_handler = sighandler;  // sighandler is defined below. It just sets do_exit.
-        sigemptyset(&sigact.sa_mask);
-        sigact.sa_flags = 0;
-        sigaction(SIGINT, &sigact, NULL);
-        sigaction(SIGTERM, &sigact, NULL);
-        sigaction(SIGQUIT, &sigact, NULL);
+        // allocate the ring of transfers IN (IN to host PC from USB-device)
+        // every transfer starts with its own buffer of the pool, the threaded
+        // mode gets spareBuffers buffers more to hand to the consumer
+        numBuffers = threaded ? depth+spareBuffers : depth;
+        if (usbPoolCreate(&pool, &usbdev, depth, numBuffers, transferSize, zeroCopy) < 0
+                || (threaded && (spsc_init(&fullQueue, numBuffers, sizeof(struct buf_desc))
+                              || spsc_init(&freeQueue, numBuffers, sizeof(uint32_t))))) {
+            fprintf(stderr, "could not allocate %d x %d bytes\n", numBuffers, transferSize);
+            exitflag = out_release;
+            do_exit = 1;
+        }
+        if (zeroCopy && !pool.zeroCopy)
+            fprintf(stderr, "zero-copy buffers not available, falling back to malloc\n");
+        zeroCopy = pool.zeroCopy;
+        // the slot number is the user data, a replay has no device
+        if (!do_exit)
+            usbPoolFill(&pool, &usbdev, USB_ENDPOINT_IN, threaded ? cb_in_threaded : cb_in, 0);
+        for (i=depth; i<numBuffers && !do_exit; i++) {
+            uint32_t b = i;
+            spsc_push(&freeQueue, &b);
+        }
+        printf("%d transfers of %d bytes in flight, zero-copy %s\n", depth, transferSize,
+            zeroCopy ? "on" : "off");
+    }
 
+    if (verifying && !do_exit) {
+        select_pattern();
+        printf("verifying the %s pattern with %s compares\n", verifyName(pattern), verifySimd());
+    }
+
+    if (capturePrefix && !do_exit) {
+        // the pyramid summarizes the first of the interleaved ADC channels,
+        // a replay or a device without control requests has a single one
+        if ((captureFlags & CAPTURE_PYRAMID) && usbdev.h && usbCtrlCaps(&usbdev, &caps) == 0
+                && usbCtrlGetParams(&usbdev, &params) == 0)
+            channels = params.channels;
+        // a chunk has to hold at least one whole transfer
+        if (captureOpen(&capture, capturePrefix,
+                transferSize > CAPTURE_CHUNK ? transferSize : CAPTURE_CHUNK, CAPTURE_CHUNKS,
+                rotateMiB*1024*1024, (uint64_t)rotateSeconds*NS_PER_SEC, captureFlags, channels) < 0) {
+            perror("could not start the capture");
+            capturePrefix = NULL;
+            do_exit = 1;
+        } else {
+            printf("capturing to %s-0000.bin\n", capturePrefix);
+        }
+    }
+
+    if (metricsPath && !do_exit) {
+        if (metricsServe(&metrics, metricsPath) < 0) {
+            perror("could not serve the metrics");
+            metricsPath = NULL;
+        } else {
+            printf("metrics at %s\n", metricsPath);
+        }
+    }
+
+    if (fanoutPath && !do_exit) {
+        if (fanoutCreate(&fanout, fanoutPath, FANOUT_SLOTS, transferSize) < 0) {
+            perror("could not create the fan-out ring");
+            fanoutPath = NULL;
+            do_exit = 1;
+        } else {
+            printf("publishing to %s\n", fanoutPath);
+        }
+    }
+
+    // the event thread of -T applies them itself
+    if (!threaded && !rtCompare && !do_exit && rt_apply(&rt, &rtState) == 0)
+        printf("real-time settings: %s\n", rt_describe(&rt, rtName, sizeof rtName));
+
+    if (rtCompare && !do_exit) {
+        r = compare_rt(sweepSeconds);
+        do_exit = 1;
+    } else if (sweep && !do_exit) {
+        r = sweep_depth(sweepSeconds);
+        do_exit = 1;
+    } else if (strategyAll && !do_exit) {
+        r = compare_strategies(sweepSeconds);
+        do_exit = 1;
+    } else if (!do_exit) {
+        //take the initial time measurement
+        t1 = now_ns();
+        cycles_start(&cycles);
+        //submit the whole ring, all following transfers are initiated from the CB
+        streamStart = t1;
+        if (submit_ring(depth) == 0)
+            do_exit = 1;
         printf("Entering loop to process callbacks...\n");
     }
 
+    if (reconnect && !do_exit) {
+        if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+            fprintf(stderr, "hotplug is not supported on this system, -R disabled\n");
+            reconnect = 0;
+        } else {
+            r = libusb_hotplug_register_callback(ctx,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+                USB_VENDOR_ID, USB_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+                hotplug_callback, NULL, &hotplugHandle);
+            if (r < 0) {
+                fprintf(stderr, "could not register the hotplug callback: %s\n", libusb_error_name(r));
+                reconnect = 0;
+            }
+        }
+    }
+
+    if (threaded && !do_exit) {
+        // the event thread owns the event handling, this thread consumes
+        if (pthread_create(&eventThread, NULL, event_thread, NULL)) {
+            fprintf(stderr, "could not create the event thread\n");
+            do_exit = 1;
+            threaded = 0;
+        } else {
+            consume();
+            stopping = 1;
+            cancel_ring(depth);
+            pthread_join(eventThread, NULL);
+            printf("\nhandoff queue: max occupancy %zu of %d buffers, %u stalls\n",
+                maxOccupancy, numBuffers, handoffStalls);
+        }
+    }
+
 	/* The implementation of the following while loop makes a huge difference.
 	 * Since libUSB asynchronous mode doesn't create a background thread,
 	 * libUSB can't create a callback out of nowhere. This loop calls the event handler.
 	 * In real applications you might want to create a background thread or call the event
-	 * handler from your main event hanlder.
+	 * handler from your main event hanlder, -e epoll shows the latter (see usbpoll.h).
+	 * run_events implements the strategies of -e, -e all compares them.
 	 * For a proper description see:
 	 * http://libusbx.sourceforge.net/api-1.0/group__asyncio.html#asyncevent
 	 * http://libusbx.sourceforge.net/api-1.0/group__poll.html
 	 * http://libusbx.sourceforge.net/api-1.0/mtasync.html
 	 */
-    if(1){
-        // This implementation uses a blocking call
-        while (!do_exit) {
-            r =  libusb_handle_events_completed(ctx, NULL);
-            if (r < 0){   // negative values are errors
-                exitflag = out_deinit;
-                break;
-            }
-        }
+    if(threaded){
+        // events were handled by the event thread
     }
-    else{
-        // This implementation uses a blocking call and aquires a lock to the event handler
-        struct timeval timeout;
-		timeout.tv_sec  = 0;       // seconds
-		timeout.tv_usec = 100000;  // ( .1 sec)
-        libusb_lock_events(ctx);
-        while (!do_exit) {
-            r = libusb_handle_events_locked(ctx, &timeout);
-         	if (r < 0){   // negative values are errors
-                exitflag = out_deinit;
-                break;
-         	}
-		}
-        libusb_unlock_events(ctx);
+    else if(replayPrefix){
+        // the replay completes the transfers instead of the device
+        while (!do_exit && replayEvents(&replay) != REPLAY_END)
+            ;
+    }
+    else if(!do_exit){
+        r = run_events(strategy, 0, &eventRun);
+        printf("\n");
+        print_event_header();
+        print_event_run(strategyNames[strategy], &eventRun);
     }
 
-	// If these transfers did not complete then we cancel them.
-	// Unsure if this is correct...
+	// Transfers still in flight are cancelled. They may only be freed after
+	// their callback reported LIBUSB_TRANSFER_CANCELLED.
 	if (transfer_out) {
 		r = libusb_cancel_transfer(transfer_out);
 		if (0 == r){
 			printf("transfer_out successfully cancelled\n");
 		}
-		if (r < 0){
-		    exitflag = out_deinit;
-		}
-
 	}
-	if (transfer_in) {
-		r = libusb_cancel_transfer(transfer_in);
-		if (0 == r){
-			printf("transfer_in successfully cancelled\n");
-		}
-		if (r < 0){
-		    exitflag = out_deinit;
+	if (reconnect) {
+		libusb_hotplug_deregister_callback(ctx, hotplugHandle);
+		if (arrived)
+			libusb_unref_device(arrived);
+	}
+	if (exitflag == out_deinit) {
+		if (!threaded)
+			drain_ring(depth);
+		printf("\n%u out of order completions, %u errors\n", outOfOrder, inErrors);
+		if (reconnect)
+			printf("%u reconnects, %.1f ms without data, ~%.0f bytes (%.0f 16 bit samples) lost\n",
+				reconnects, downTime/(double)NS_PER_MS, lostBytes, lostBytes/2);
+		if (!sweep && !rtCompare) {
+			print_cpu_cost(totalBytes);
+			hist_print(stdout, "completion gap", &gapHist);
+			hist_print(stdout, "submit to complete", &latencyHist);
 		}
+		if (verifying)
+			verifyPrint(stdout, &verifier);
+	}
+	if (capturePrefix) {
+		captureClose(&capture);
+		capturePrint(stdout, &capture);
+	}
+	rt_restore(&rtState);
+	if (metricsPath)
+		metricsStop(&metrics);
+	if (fanoutPath) {
+		printf("fan-out: %llu buffers published, %llu readers attached\n",
+			(unsigned long long)fanout.next, (unsigned long long)fanout.readers);
+		fanoutClose(&fanout);
+	}
+	if (replayPrefix) {
+		replayPrint(stdout, &replay);
+		replayClose(&replay);
 	}
 
     switch(exitflag){
     case out_deinit:
         printf("at out_deinit\n");
         libusb_free_transfer(transfer_out);
-        libusb_free_transfer(transfer_in);
 
     case out_release:
-        libusb_release_interface(devh, 0);
+        usbPoolDestroy(&pool);
+        spsc_free(&fullQueue);
+        spsc_free(&freeQueue);
     case out:
-        libusb_close(devh);
+        // with -R the device may be gone at this point
+        usbClose(&usbdev);
         libusb_exit(NULL);
     }
 	return 0;
@@ -222,9 +1670,9 @@ int main(void)
 
 
 // This will catch user initiated CTRL+C type events and allow the program to exit
+// Only sets the flag, stdio is not async-signal-safe.
 void sighandler(int signum)
 {
-	printf("sighandler\n");
 	do_exit = 1;
 }
 
@@ -252,5 +1700,3 @@ void print_libusb_transfer(struct libusb_transfer *p_t)
 	}
 	return;
 }
-
-
@@ -0,0 +1,74 @@
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+/*
+ * Interface between the benchmark harness (benchmark.c) and its backends.
+ * A backend opens the device its own way, streams IN transfers from EP1
+ * and reports every completed transfer with bench_complete(). The harness
+ * does all the timing and statistics, so every backend is measured the same.
+ */
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#include "usbhost.h"
+
+#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
+                                         * 0x0483 is STMs ID
+                                         */
+#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
+#define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
+#define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
+#define USB_TIMEOUT	        3000        /* Connection timeout (in ms) */
+
+#define BENCH_MAX_DEPTH     64          /* upper limit for transfers in flight */
+
+/*
+ * Parameters of a run, filled in by the harness.
+ */
+struct bench_params {
+    libusb_context *ctx;
+    libusb_device *dev;         // the device to benchmark (not opened)
+    int transferSize;           // bytes requested per transfer
+    int depth;                  // transfers in flight (async backends)
+    int zeroCopy;               // map the buffers from usbfs, cleared if unavailable
+    int reapBatch;              // URBs reaped per wakeup, 0 for depth (urb backend)
+    int busyPoll;               // spin on the reap instead of sleeping (urb backend)
+};
+
+struct bench_backend {
+    const char *name;
+    int defaultSize;            // transfer size if none was given
+    // opens and claims the device and allocates the buffers, 0 on success
+    int (*open)(struct bench_params *p);
+    // starts streaming, 0 on success
+    int (*start)(void);
+    // waits for completions and reports them with bench_complete,
+    // returns within USB_TIMEOUT, <0 on a fatal error
+    int (*poll)(void);
+    // stops streaming, waits for transfers in flight and releases everything
+    void (*close)(void);
+};
+
+extern const struct bench_backend bench_sync;
+extern const struct bench_backend bench_async;
+extern const struct bench_backend bench_raw;
+extern const struct bench_backend bench_urb;
+extern const struct bench_backend bench_coro;   // bench_coro.cpp, with BENCH_CORO
+
+/*
+ * Reports one finished transfer to the harness.
+ * status uses the libusb transfer status for every backend,
+ * LIBUSB_TRANSFER_COMPLETED if the data is valid.
+ */
+void bench_complete(int length, enum libusb_transfer_status status);
+
+/*
+ * Opens p->dev and claims interface 0, then creates the transfers and
+ * buffers in pool (see usbhost.h), shared by the libusb backends.
+ * p->zeroCopy is cleared if the buffers could not be mapped.
+ */
+int bench_open_libusb(struct bench_params *p, struct usb_device *d, struct usb_pool *pool,
+    int numTransfers, int numBuffers);
+
+#endif // BENCH_H_INCLUDED
@@ -0,0 +1,104 @@
+/*
+ * Asynchronous libusb backend of the benchmark harness.
+ * It keeps a ring of depth transfers submitted like async.c does and hands
+ * every completed slot straight back to the host controller.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bench.h"
+
+static libusb_context *ctx;
+static struct usb_device dev;
+static struct usb_pool ring;    // a transfer and a buffer per slot
+static int depth;
+static int inFlight;
+static int stopping;
+static int fatal;
+
+static void cb_in(struct libusb_transfer *transfer)
+{
+    inFlight--;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    bench_complete(transfer->actual_length, transfer->status);
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        fatal = LIBUSB_ERROR_NO_DEVICE;
+        return;
+    }
+    //hand the slot back to the host controller
+    if (!stopping) {
+        if (libusb_submit_transfer(transfer) == 0)
+            inFlight++;
+        else
+            fatal = LIBUSB_ERROR_IO;
+    }
+}
+
+static int async_open(struct bench_params *p)
+{
+    int r;
+
+    ctx = p->ctx;
+    depth = p->depth;
+    r = bench_open_libusb(p, &dev, &ring, depth, depth);
+    if (r < 0)
+        return r;
+    // every transfer owns its own slice of the slab
+    usbPoolFill(&ring, &dev, USB_ENDPOINT_IN, cb_in, 0);
+    return 0;
+}
+
+static int async_start(void)
+{
+    int i, r;
+
+    stopping = 0;
+    fatal = 0;
+    for (i=0; i<depth; i++) {
+        r = libusb_submit_transfer(ring.transfers[i]);
+        if (r < 0) {
+            fprintf(stderr, "submit of slot %d failed: %s\n", i, libusb_error_name(r));
+            return r;
+        }
+        inFlight++;
+    }
+    return 0;
+}
+
+static int async_poll(void)
+{
+    struct timeval tv = {0, 100000};
+    int r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (r < 0)
+        return r;
+    return fatal;
+}
+
+static void async_close(void)
+{
+    struct timeval tv = {0, 100000};
+    int i;
+
+    // cancel everything in flight, the transfers may only be freed after
+    // their callback arrived
+    stopping = 1;
+    for (i=0; i<depth; i++)
+        libusb_cancel_transfer(ring.transfers[i]);
+    while (inFlight > 0) {
+        if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+            break;
+    }
+    usbPoolDestroy(&ring);
+    usbClose(&dev);
+}
+
+const struct bench_backend bench_async = {
+    "async",
+    1024*8,
+    async_open,
+    async_start,
+    async_poll,
+    async_close
+};
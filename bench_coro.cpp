@@ -0,0 +1,132 @@
+/*
+ * Coroutine backend of the benchmark harness (C++20, see usbcoro.hpp)
+ * Streams like bench_async.c, but with depth tasks that each loop over
+ * co_await bulk_in instead of a callback that resubmits the transfer.
+ * Compare the two at the same depth for the cost of the coroutines:
+ *   ./bench -m async -d 8
+ *   ./bench -m coro -d 8
+ * That comparison has not been run yet, so whether the coroutines cost
+ * more per transfer than the callback is still open.
+ * The coroutine frames are counted, after the start of the tasks there
+ * must be no allocation left.
+ */
+#include <cstdio>
+#include <memory>
+
+#include "usbcoro.hpp"
+
+extern "C" {
+#include "bench.h"
+}
+
+static libusb_context *ctx;
+static usb::Device device;
+static usb::TransferPool buffers;       // a buffer per task, no transfers
+static std::unique_ptr<usb::AsyncDevice> async;
+static std::vector<usb::Task> lanes;
+static int depth;
+static int stopping;
+static int fatal;
+static usb::FrameStats framesAtStart;
+
+/*
+ * One transfer in flight, the sequential equivalent of cb_in of
+ * bench_async.c.
+ */
+static usb::Task lane(std::span<uint8_t> buf)
+{
+    while (!stopping) {
+        usb::Result r = co_await async->bulk_in(buf);
+        if (r.error) {
+            fatal = LIBUSB_ERROR_IO;
+            break;
+        }
+        if (r.status == LIBUSB_TRANSFER_CANCELLED)
+            break;
+        bench_complete(r.length, r.status);
+        if (r.status == LIBUSB_TRANSFER_NO_DEVICE) {
+            fatal = LIBUSB_ERROR_NO_DEVICE;
+            break;
+        }
+    }
+}
+
+static int coro_open(struct bench_params *p)
+{
+    ctx = p->ctx;
+    depth = p->depth;
+    device = usb::Device(p->dev);
+    if (!device) {
+        std::fprintf(stderr, "could not open the device: %s\n", libusb_error_name(device.error()));
+        return device.error();
+    }
+
+    // every task owns its own buffer of the pool
+    buffers = usb::TransferPool(device, 0, depth, p->transferSize, p->zeroCopy);
+    if (!buffers) {
+        std::fprintf(stderr, "could not allocate %d x %d bytes\n", depth, p->transferSize);
+        device = usb::Device();
+        return buffers.error();
+    }
+    if (p->zeroCopy && !buffers.zeroCopy())
+        std::fprintf(stderr, "zero-copy buffers not available, falling back to malloc\n");
+    p->zeroCopy = buffers.zeroCopy();
+    async = std::make_unique<usb::AsyncDevice>(device, depth);
+    lanes.reserve(depth);
+    return 0;
+}
+
+static int coro_start(void)
+{
+    int i;
+
+    stopping = 0;
+    fatal = 0;
+    lanes.clear();
+    for (i=0; i<depth; i++)
+        lanes.push_back(lane(buffers.buffer(i)));
+    framesAtStart = usb::frameStats();
+    for (usb::Task &t : lanes)
+        t.start();
+    return fatal;
+}
+
+static int coro_poll(void)
+{
+    struct timeval tv = {0, 100000};
+    int r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (r < 0)
+        return r;
+    return fatal;
+}
+
+static void coro_close(void)
+{
+    struct timeval tv = {0, 100000};
+    usb::FrameStats frames = usb::frameStats();
+
+    // the tasks end on the cancelled transfers
+    stopping = 1;
+    async->cancel();
+    while (async->inFlight() > 0) {
+        if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+            break;
+    }
+    std::fprintf(stderr, "coroutine frames: %llu from the heap, %llu recycled, %llu allocated while streaming\n",
+        (unsigned long long)frames.heap, (unsigned long long)frames.pooled,
+        (unsigned long long)(frames.heap-framesAtStart.heap));
+    lanes.clear();
+    // in this order, the pool and the transfers belong to the device
+    async.reset();
+    buffers = usb::TransferPool();
+    device = usb::Device();
+}
+
+extern "C" const struct bench_backend bench_coro = {
+    "coro",
+    1024*8,
+    coro_open,
+    coro_start,
+    coro_poll,
+    coro_close
+};
@@ -0,0 +1,108 @@
+/*
+ * Raw usbfs backend of the benchmark harness (Linux only).
+ * It bypasses libusb and talks to /dev/bus/usb/BBB/DDD directly with the
+ * synchronous USBDEVFS_BULK ioctl, which shows how much of the per
+ * transfer cost is libusb itself.
+ * USBDEVFS_BULK always copies the data, so -z has no effect here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "bench.h"
+
+static int fd = -1;
+static uint8_t *receiveBuf;
+static int receiveLen;
+
+static int raw_open(struct bench_params *p)
+{
+    char path[64];
+    unsigned int iface = 0;
+
+    snprintf(path, sizeof path, "/dev/bus/usb/%03d/%03d",
+        libusb_get_bus_number(p->dev), libusb_get_device_address(p->dev));
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return LIBUSB_ERROR_ACCESS;
+    }
+    if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0) {
+        perror("USBDEVFS_CLAIMINTERFACE");
+        close(fd);
+        return LIBUSB_ERROR_BUSY;
+    }
+    p->zeroCopy = 0;
+    receiveLen = p->transferSize;
+    receiveBuf = malloc(receiveLen);
+    if (!receiveBuf) {
+        ioctl(fd, USBDEVFS_RELEASEINTERFACE, &iface);
+        close(fd);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    return 0;
+}
+
+static int raw_start(void)
+{
+    return 0;
+}
+
+static int raw_poll(void)
+{
+    struct usbdevfs_bulktransfer bulk;
+    int n;
+
+    bulk.ep = USB_ENDPOINT_IN;
+    bulk.len = receiveLen;
+    bulk.timeout = USB_TIMEOUT;
+    bulk.data = receiveBuf;
+    n = ioctl(fd, USBDEVFS_BULK, &bulk);
+    if (n >= 0) {
+        bench_complete(n, LIBUSB_TRANSFER_COMPLETED);
+        return 0;
+    }
+    switch (errno) {
+    case ETIMEDOUT:
+        bench_complete(0, LIBUSB_TRANSFER_TIMED_OUT);
+        return 0;
+    case EPIPE:
+        bench_complete(0, LIBUSB_TRANSFER_STALL);
+        return 0;
+    case EOVERFLOW:
+        bench_complete(0, LIBUSB_TRANSFER_OVERFLOW);
+        return 0;
+    case ENODEV:
+    case ESHUTDOWN:
+        bench_complete(0, LIBUSB_TRANSFER_NO_DEVICE);
+        return LIBUSB_ERROR_NO_DEVICE;
+    case EINTR:
+        return 0;
+    default:
+        bench_complete(0, LIBUSB_TRANSFER_ERROR);
+        return 0;
+    }
+}
+
+static void raw_close(void)
+{
+    unsigned int iface = 0;
+
+    free(receiveBuf);
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &iface);
+    close(fd);
+    fd = -1;
+}
+
+const struct bench_backend bench_raw = {
+    "raw",
+    1024*16,
+    raw_open,
+    raw_start,
+    raw_poll,
+    raw_close
+};
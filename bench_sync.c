@@ -0,0 +1,49 @@
+/*
+ * Synchronous libusb backend of the benchmark harness.
+ * Every poll is one blocking libusb_bulk_transfer, as the original
+ * benchmark.c did it. Nothing is queued while a transfer is being
+ * processed, so this is the baseline for the other backends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+static struct usb_device dev;
+static struct usb_pool pool;    // the receive buffer, no transfers
+
+static int sync_open(struct bench_params *p)
+{
+    return bench_open_libusb(p, &dev, &pool, 0, 1);
+}
+
+static int sync_start(void)
+{
+    return 0;
+}
+
+static int sync_poll(void)
+{
+    int nread = 0, ret;
+
+    //blocking synchronous call to libUSB, when it returns the transfer is complete
+    ret = libusb_bulk_transfer(dev.h, USB_ENDPOINT_IN, usbPoolBuffer(&pool, 0), pool.bufferSize,
+        &nread, USB_TIMEOUT);
+    bench_complete(nread, usbStatus(ret));
+    return ret == LIBUSB_ERROR_NO_DEVICE ? ret : 0;
+}
+
+static void sync_close(void)
+{
+    usbPoolDestroy(&pool);
+    usbClose(&dev);
+}
+
+const struct bench_backend bench_sync = {
+    "sync",
+    1024*256*4,
+    sync_open,
+    sync_start,
+    sync_poll,
+    sync_close
+};
@@ -0,0 +1,229 @@
+/*
+ * Asynchronous raw usbfs backend of the benchmark harness (Linux only).
+ * Like bench_async.c it keeps depth transfers in flight, but as URBs
+ * submitted with USBDEVFS_SUBMITURB on /dev/bus/usb/BBB/DDD, without
+ * libusb in between. Comparing the CPU/MiB of
+ *   ./bench -m async -d 8
+ *   ./bench -m urb -d 8
+ * gives the cost of libusb's event handling itself.
+ * Completed URBs are reaped with USBDEVFS_REAPURBNDELAY, up to -r of them
+ * per wakeup, and resubmitted right away. Without -p the backend sleeps in
+ * poll() until usbfs signals a completed URB (POLLOUT), with -p it spins on
+ * the reap ioctl instead and trades a core for the wakeup latency.
+ * With -z the buffers are mapped from usbfs, as libusb_dev_mem_alloc does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+
+#include "bench.h"
+
+#define URB_MAX_SIZE    16384       /* bulk URB limit without USBDEVFS_CAP_NO_PACKET_SIZE_LIM */
+
+static int fd = -1;
+static struct usbdevfs_urb urbs[BENCH_MAX_DEPTH];
+static uint8_t *buffers;
+static size_t buffersLen;
+static int mapped;              // buffers come from mmap of fd
+static int depth;
+static int transferSize;
+static int reapBatch;
+static int busyPoll;
+static int inFlight;
+static int stopping;
+
+/*
+ * The status of a reaped URB as the libusb transfer status.
+ */
+static enum libusb_transfer_status urb_status(int status)
+{
+    switch (status) {
+    case 0:
+        return LIBUSB_TRANSFER_COMPLETED;
+    case -ENOENT:
+    case -ECONNRESET:
+        return LIBUSB_TRANSFER_CANCELLED;
+    case -EPIPE:
+        return LIBUSB_TRANSFER_STALL;
+    case -EOVERFLOW:
+        return LIBUSB_TRANSFER_OVERFLOW;
+    case -ETIMEDOUT:
+        return LIBUSB_TRANSFER_TIMED_OUT;
+    case -ENODEV:
+    case -ESHUTDOWN:
+        return LIBUSB_TRANSFER_NO_DEVICE;
+    default:
+        return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+static int submit(struct usbdevfs_urb *urb)
+{
+    if (ioctl(fd, USBDEVFS_SUBMITURB, urb) < 0)
+        return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+    inFlight++;
+    return 0;
+}
+
+static void release(void)
+{
+    unsigned int iface = 0;
+
+    if (mapped)
+        munmap(buffers, buffersLen);
+    else
+        free(buffers);
+    buffers = NULL;
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &iface);
+    close(fd);
+    fd = -1;
+}
+
+static int urb_open(struct bench_params *p)
+{
+    char path[64];
+    unsigned int iface = 0;
+    uint32_t caps = 0;
+    int i;
+
+    depth = p->depth;
+    transferSize = p->transferSize;
+    reapBatch = p->reapBatch > 0 ? p->reapBatch : depth;
+    busyPoll = p->busyPoll;
+    buffers = NULL;
+    mapped = 0;
+
+    snprintf(path, sizeof path, "/dev/bus/usb/%03d/%03d",
+        libusb_get_bus_number(p->dev), libusb_get_device_address(p->dev));
+    fd = open(path, O_RDWR|O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return LIBUSB_ERROR_ACCESS;
+    }
+    if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0) {
+        perror("USBDEVFS_CLAIMINTERFACE");
+        close(fd);
+        return LIBUSB_ERROR_BUSY;
+    }
+    // older kernels refuse larger bulk URBs than that
+    ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps);
+    if (transferSize > URB_MAX_SIZE && !(caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)) {
+        fprintf(stderr, "usbfs can't do bulk URBs of more than %d bytes\n", URB_MAX_SIZE);
+        release();
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    // every URB owns its own slice of the buffers
+    buffersLen = (size_t)depth*transferSize;
+    if (p->zeroCopy) {
+        buffers = mmap(NULL, buffersLen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (buffers == MAP_FAILED) {
+            fprintf(stderr, "zero-copy buffers not available, falling back to malloc\n");
+            buffers = NULL;
+        } else {
+            mapped = 1;
+        }
+    }
+    if (!buffers)
+        buffers = malloc(buffersLen);
+    p->zeroCopy = mapped;
+    if (!buffers) {
+        fprintf(stderr, "could not allocate %d x %d bytes\n", depth, transferSize);
+        release();
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    for (i=0; i<depth; i++) {
+        urbs[i] = (struct usbdevfs_urb){0};
+        urbs[i].type = USBDEVFS_URB_TYPE_BULK;
+        urbs[i].endpoint = USB_ENDPOINT_IN;
+        urbs[i].buffer = buffers+(size_t)i*transferSize;
+        urbs[i].buffer_length = transferSize;
+        urbs[i].usercontext = (void*)(intptr_t)i;
+    }
+    return 0;
+}
+
+static int urb_start(void)
+{
+    int i, r;
+
+    stopping = 0;
+    inFlight = 0;
+    for (i=0; i<depth; i++) {
+        r = submit(&urbs[i]);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+static int urb_poll(void)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    struct usbdevfs_urb *urb;
+    enum libusb_transfer_status status;
+    int n, r;
+
+    if (!busyPoll) {
+        r = poll(&pfd, 1, USB_TIMEOUT);
+        if (r < 0)
+            return errno == EINTR ? 0 : LIBUSB_ERROR_IO;
+        if (pfd.revents & (POLLERR|POLLHUP))
+            return LIBUSB_ERROR_NO_DEVICE;
+    }
+    // everything that completed since the last wakeup, up to reapBatch
+    for (n=0; n<reapBatch; n++) {
+        if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+            if (errno == EAGAIN)
+                break;
+            return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+        }
+        inFlight--;
+        status = urb_status(urb->status);
+        bench_complete(urb->actual_length, status);
+        if (status == LIBUSB_TRANSFER_NO_DEVICE)
+            return LIBUSB_ERROR_NO_DEVICE;
+        if (!stopping) {
+            r = submit(urb);
+            if (r < 0)
+                return r;
+        }
+    }
+    return 0;
+}
+
+static void urb_close(void)
+{
+    struct usbdevfs_urb *urb;
+    int i;
+
+    stopping = 1;
+    for (i=0; i<depth; i++)
+        ioctl(fd, USBDEVFS_DISCARDURB, &urbs[i]);
+    // a discarded URB is still reaped, blocking until it is given back
+    while (inFlight > 0) {
+        if (ioctl(fd, USBDEVFS_REAPURB, &urb) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        inFlight--;
+    }
+    release();
+}
+
+const struct bench_backend bench_urb = {
+    "urb",
+    1024*16,
+    urb_open,
+    urb_start,
+    urb_poll,
+    urb_close
+};
@@ -3,19 +3,50 @@
  * It openes an USB device, expects two Bulk endpoints,
  *   EP1 should be IN
  *   EP2 should be OUT
- * It uses Synchronous device I/O
+ * It streams EP1 with one of several backends for a fixed time or number
+ * of bytes and reports the results as text, CSV or JSON:
+ *   sync   blocking libusb_bulk_transfer calls (bench_sync.c)
+ *   async  a ring of asynchronous libusb transfers (bench_async.c)
+ *   raw    libusb bypassed, usbfs ioctls on /dev/bus/usb (bench_raw.c)
+ *   urb    libusb bypassed, a ring of usbfs URBs (bench_urb.c)
+ *   coro   async with C++20 coroutines instead of callbacks (bench_coro.cpp),
+ *          only if built with BENCH_CORO
  *
  * Compile:
- *   gcc -lusb-1.0 -lrt -o bench benchmark.c
+ *   gcc -O2 -o bench benchmark.c bench_sync.c bench_async.c bench_raw.c bench_urb.c usbhost.c -lusb-1.0 -lm
+ * or with the coroutine backend:
+ *   gcc -O2 -DBENCH_CORO -c benchmark.c bench_sync.c bench_async.c bench_raw.c bench_urb.c usbhost.c
+ *   g++ -O2 -std=c++20 -c bench_coro.cpp
+ *   g++ -o bench benchmark.o bench_sync.o bench_async.o bench_raw.o bench_urb.o usbhost.o bench_coro.o \
+ *       -lusb-1.0 -lm
  * Run:
- *   ./bench
- * As far as I know, sys/time.h is POSIX only and not available on Windows.
- * It should be trivial to exchange for a precise Windows time API.
+ *   ./bench [-m sync|async|raw|urb|coro] [-s transfersize] [-d depth] [-z]
+ *           [-r batch] [-p] [-t seconds | -b bytes] [-w warmup] [-i interval]
+ *           [-f text|csv|json] [-o file] [-l label]
+ *     -m  backend (default sync)
+ *     -s  bytes per transfer (default depends on the backend)
+ *     -d  transfers in flight for the async, urb and coro backends (default 4)
+ *     -z  zero-copy buffers mapped from usbfs (libusb and urb backends)
+ *     -r  URBs reaped per wakeup by the urb backend (default depth)
+ *     -p  the urb backend busy-polls instead of sleeping in poll()
+ *     -t  measured run time in seconds (default 10)
+ *     -b  stop after this many measured bytes instead
+ *     -w  warm-up seconds that are not measured (default 1)
+ *     -i  interval in ms for the throughput mean/stddev (default 1000)
+ *     -f  result format, csv and json write one line per run
+ *     -o  append the result to this file instead of stdout, a CSV header
+ *         is written if the file is empty
+ *     -l  free text label stored with the result, e.g. the host name
+ * All times are taken from CLOCK_MONOTONIC as 64 bit nanoseconds.
  * For Documentation on libusb see:
  *   http://libusb.sourceforge.net/api-1.0/modules.html
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <signal.h>
 
@@ -24,151 +55,415 @@
 //or uncomment this line:
 //#include <libusb.h>
 //and compile with:
-//gcc -lusb-1.0 -lrt -o bench -I/path/to/libusb-1.0/ benchmark.c
+//gcc -O2 -o bench -I/path/to/libusb-1.0/ benchmark.c bench_*.c usbhost.c -lusb-1.0 -lm
 
-#include <sys/time.h>
+#include "bench.h"
+#include "timing.h"
+#include "cpucycles.h"
 
-#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
-                                         * 0x0483 is STMs ID
-                                         */
-#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
-#define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
-#define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
-#define USB_TIMEOUT	        3000        /* Connection timeout (in ms) */
+static const struct bench_backend *backends[] = {
+    &bench_sync,
+    &bench_async,
+    &bench_raw,
+    &bench_urb,
+#ifdef BENCH_CORO
+    &bench_coro
+#endif
+};
 
-static libusb_context *ctx = NULL;
-static libusb_device_handle *handle;
+enum format {
+    format_text,
+    format_csv,
+    format_json
+};
 
-static uint8_t receiveBuf[1024*256*4];
-uint8_t transferBuf[64];
+static volatile int do_exit = 0;
 
-uint16_t counter=0;
+/*
+ * Everything measured during one run.
+ * Transfers completing before warmEnd are only counted as warm-up.
+ * The throughput is sampled once per interval for mean and stddev.
+ */
+static struct {
+    uint64_t warmupNs;
+    uint64_t warmEnd;           // end of the warm-up
+    uint64_t end;               // end of the run if it is time limited
+    uint64_t byteLimit;         // end of the run if it is byte limited
+    uint64_t intervalNs;
+    uint64_t intervalEnd;
+    uint64_t intervalBytes;
+    uint64_t last;              // time of the last measured completion
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t shortTransfers;    // completed with less than transferSize bytes
+    uint64_t errors;
+    uint64_t warmupTransfers;
+    uint64_t samples;           // throughput samples (Welford)
+    double mean;
+    double m2;
+    int transferSize;
+    int done;
+    struct cpu_cycles cycles;
+    int cyclesRunning;
+} stats;
+
+static void add_sample(double v)
+{
+    double delta = v-stats.mean;
+    stats.samples++;
+    stats.mean += delta/stats.samples;
+    stats.m2 += delta*(v-stats.mean);
+}
+
+void bench_complete(int length, enum libusb_transfer_status status)
+{
+    uint64_t t = now_ns();
+
+    if (stats.done)
+        return;
+    if (t < stats.warmEnd) {
+        stats.warmupTransfers++;
+        return;
+    }
+    if (!stats.cyclesRunning) {
+        // first completion after the warm-up
+        cycles_start(&stats.cycles);
+        stats.cyclesRunning = 1;
+    }
+    while (t >= stats.intervalEnd) {
+        add_sample(stats.intervalBytes*(double)NS_PER_SEC/stats.intervalNs);
+        stats.intervalBytes = 0;
+        stats.intervalEnd += stats.intervalNs;
+    }
+    if (stats.end && t >= stats.end) {
+        stats.done = 1;
+        return;
+    }
+
+    stats.last = t;
+    if (status != LIBUSB_TRANSFER_COMPLETED) {
+        stats.errors++;
+        return;
+    }
+    stats.transfers++;
+    stats.bytes += length;
+    stats.intervalBytes += length;
+    if (length < stats.transferSize)
+        stats.shortTransfers++;
+    if (stats.byteLimit && stats.bytes >= stats.byteLimit)
+        stats.done = 1;
+}
+
+int bench_open_libusb(struct bench_params *p, struct usb_device *d, struct usb_pool *pool,
+    int numTransfers, int numBuffers)
+{
+    int r = usbOpenDevice(d, p->dev);
+    if (r < 0) {
+        fprintf(stderr, "could not open the device: %s\n", libusb_error_name(r));
+        return r;
+    }
+    r = usbPoolCreate(pool, d, numTransfers, numBuffers, p->transferSize, p->zeroCopy);
+    if (r < 0) {
+        fprintf(stderr, "could not allocate %d x %d bytes\n", numBuffers, p->transferSize);
+        usbClose(d);
+        return r;
+    }
+    if (p->zeroCopy && !pool->zeroCopy)
+        fprintf(stderr, "zero-copy buffers not available, falling back to malloc\n");
+    p->zeroCopy = pool->zeroCopy;
+    return 0;
+}
+
+/*
+ * Returns the first device with our VID/PID, with a reference held.
+ */
+static libusb_device *find_device(libusb_context *ctx)
+{
+    libusb_device **list, *found = NULL;
+    struct libusb_device_descriptor desc;
+    ssize_t i, n;
+
+    n = libusb_get_device_list(ctx, &list);
+    for (i=0; i<n && !found; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) == 0
+                && desc.idVendor == USB_VENDOR_ID && desc.idProduct == USB_PRODUCT_ID)
+            found = libusb_ref_device(list[i]);
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    return found;
+}
+
+/*
+ * A CSV field, quoted, with every quote doubled
+ */
+static void print_csv_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
 
-uint32_t benchPackets=1;
-uint32_t benchBytes=0;
-struct timespec t1, t2;
-uint32_t diff=0;
+/*
+ * A JSON string, quoted and escaped
+ */
+static void print_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
 
 /*
- * Read a packet
+ * Writes the result of the run in the requested format.
  */
- static int usb_read(void)
- {
- 	int nread, ret;
- 	//blocking synchronous call to libUSB when it finished, one packet was received
- 	ret = libusb_bulk_transfer(handle, USB_ENDPOINT_IN, receiveBuf, sizeof(receiveBuf),
- 		&nread, USB_TIMEOUT);
-	benchBytes =nread;
-	clock_gettime(CLOCK_REALTIME, &t2);
-
-	//Warning: uint32_t has a max value of 4294967296 so this will overflow over 4secs
-	diff = (t2.tv_sec-t1.tv_sec)*1000000000L+(t2.tv_nsec-t1.tv_nsec);
-    t1.tv_sec = t2.tv_sec;
- 	t1.tv_nsec = t2.tv_nsec;
- 	printf("\rreceived %5d transfers and %8d bytes in %8d us, %8.1f B/s, transfersize: %d", benchPackets, benchBytes, diff/1000, benchBytes*1000000.0/(diff/1000), nread);
-    fflush(stdout);
- }
+static void print_result(FILE *f, enum format fmt, const char *label,
+    const struct bench_backend *b, const struct bench_params *p, uint64_t measuredNs)
+{
+    double s = measuredNs/(double)NS_PER_SEC;
+    double mib = stats.bytes/(1024.0*1024.0);
+    double stddev = stats.samples > 1 ? sqrt(stats.m2/(stats.samples-1)) : 0.0;
+    double throughput = s > 0 ? stats.bytes/s : 0.0;
+    double transfersPerS = s > 0 ? stats.transfers/s : 0.0;
+    uint64_t c = stats.cyclesRunning ? cycles_read(&stats.cycles) : 0;
+    double cpu = stats.cyclesRunning ? cycles_cpu_seconds(&stats.cycles) : 0.0;
+    double cyclesPerMiB = mib > 0 ? c/mib : 0.0;
+    double cpuMsPerMiB = mib > 0 ? cpu*1000/mib : 0.0;
+    long timestamp = (long)time(NULL);
 
+    switch (fmt) {
+    case format_text:
+        fprintf(f, "backend %s, %d bytes per transfer, depth %d, zero-copy %s\n",
+            b->name, p->transferSize, p->depth, p->zeroCopy ? "on" : "off");
+        fprintf(f, "measured %.3f s after %.3f s warm-up (%llu warm-up transfers)\n",
+            s, stats.warmupNs/(double)NS_PER_SEC, (unsigned long long)stats.warmupTransfers);
+        fprintf(f, "%llu bytes in %llu transfers, %llu short, %llu errors\n",
+            (unsigned long long)stats.bytes, (unsigned long long)stats.transfers,
+            (unsigned long long)stats.shortTransfers, (unsigned long long)stats.errors);
+        fprintf(f, "%.1f B/s (interval mean %.1f B/s, stddev %.1f B/s over %llu intervals)\n",
+            throughput, stats.mean, stddev, (unsigned long long)stats.samples);
+        fprintf(f, "%.1f transfers/s, ", transfersPerS);
+        if (c)
+            fprintf(f, "%.0f %scycles/MiB, ", cyclesPerMiB, stats.cycles.userOnly ? "user " : "");
+        fprintf(f, "%.3f ms CPU/MiB\n", cpuMsPerMiB);
+        break;
+    case format_csv:
+        if (ftell(f) == 0)
+            fprintf(f, "timestamp,label,backend,transfer_size,depth,zero_copy,duration_s,"
+                "bytes,transfers,short_transfers,errors,throughput_Bps,"
+                "throughput_mean_Bps,throughput_stddev_Bps,transfers_per_s,"
+                "cycles_per_MiB,cpu_ms_per_MiB\n");
+        fprintf(f, "%ld,", timestamp);
+        print_csv_string(f, label);
+        fprintf(f, ",%s,%d,%d,%d,%.6f,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.0f,%.3f\n",
+            b->name, p->transferSize, p->depth, p->zeroCopy, s,
+            (unsigned long long)stats.bytes, (unsigned long long)stats.transfers,
+            (unsigned long long)stats.shortTransfers, (unsigned long long)stats.errors,
+            throughput, stats.mean, stddev, transfersPerS, cyclesPerMiB, cpuMsPerMiB);
+        break;
+    case format_json:
+        fprintf(f, "{\"timestamp\":%ld,\"label\":", timestamp);
+        print_json_string(f, label);
+        fprintf(f, ",\"backend\":\"%s\","
+            "\"transfer_size\":%d,\"depth\":%d,\"zero_copy\":%s,\"duration_s\":%.6f,"
+            "\"bytes\":%llu,\"transfers\":%llu,\"short_transfers\":%llu,\"errors\":%llu,"
+            "\"throughput_Bps\":%.1f,\"throughput_mean_Bps\":%.1f,\"throughput_stddev_Bps\":%.1f,"
+            "\"transfers_per_s\":%.1f,\"cycles_per_MiB\":%.0f,\"cpu_ms_per_MiB\":%.3f}\n",
+            b->name, p->transferSize, p->depth, p->zeroCopy ? "true" : "false", s,
+            (unsigned long long)stats.bytes, (unsigned long long)stats.transfers,
+            (unsigned long long)stats.shortTransfers, (unsigned long long)stats.errors,
+            throughput, stats.mean, stddev, transfersPerS, cyclesPerMiB, cpuMsPerMiB);
+        break;
+    }
+}
 
 /*
- * write a few bytes to the device
- * this function is unused for benchmarking
+ * on SIGINT: stop the run, the result so far is still reported
  */
- uint16_t count=0;
- static int usb_write(void)
- {
- 	int n, ret;
-    //count up
- 	n = sprintf((char*)transferBuf, "%d\0",count++);
-    //write transfer
- 	ret = libusb_bulk_transfer(handle, USB_ENDPOINT_OUT, transferBuf, n,
- 		&n, USB_TIMEOUT);
-    //Error handling
- 	switch(ret){
- 		case 0:
- 		printf("send %d bytes to device\n", n);
- 		return 0;
- 		case LIBUSB_ERROR_TIMEOUT:
- 		printf("ERROR in bulk write: %d Timeout\n", ret);
- 		break;
- 		case LIBUSB_ERROR_PIPE:
- 		printf("ERROR in bulk write: %d Pipe\n", ret);
- 		break;
- 		case LIBUSB_ERROR_OVERFLOW:
- 		printf("ERROR in bulk write: %d Overflow\n", ret);
- 		break;
- 		case LIBUSB_ERROR_NO_DEVICE:
- 		printf("ERROR in bulk write: %d No Device\n", ret);
- 		break;
- 		default:
- 		printf("ERROR in bulk write: %d\n", ret);
- 		break;
-
- 	}
- 	return -1;
-
- }
+static void sighandler(int signum)
+{
+    do_exit = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m sync|async|raw|urb|coro] [-s transfersize] [-d depth] [-z]\n"
+        "       [-r batch] [-p] [-t seconds | -b bytes] [-w warmup] [-i interval]\n"
+        "       [-f text|csv|json] [-o file] [-l label]\n", name);
+}
 
 /*
- * on SIGINT: close USB interface
- * This still leads to a segfault on my system...
+ * main
+ * parses the options, runs the selected backend and reports the result
  */
- static void sighandler(int signum)
- {
- 	printf( "\nInterrupt signal received\n" );
- 	if (handle){
- 		libusb_release_interface (handle, 0);
- 		printf( "\nInterrupt signal received1\n" );
- 		libusb_close(handle);
- 		printf( "\nInterrupt signal received2\n" );
- 	}
- 	printf( "\nInterrupt signal received3\n" );
- 	libusb_exit(NULL);
- 	printf( "\nInterrupt signal received4\n" );
-
- 	exit(0);
- }
-
- /*
-  * main loop
-  * inits the USB and starts the receiving loop
-  */
- int main(int argc, char **argv)
- {
+int main(int argc, char **argv)
+{
+    const struct bench_backend *backend = &bench_sync;
+    struct bench_params params;
+    libusb_context *ctx = NULL;
+    enum format fmt = format_text;
+    const char *outName = NULL;
+    const char *label = "";
+    double seconds = 10, warmup = 1;
+    unsigned long long byteLimit = 0;
+    int intervalMs = 1000;
+    uint64_t start, stop, measured;
+    FILE *out = stdout;
+    unsigned int i;
+    int opt, r;
+
+    memset(&params, 0, sizeof params);
+    params.depth = 4;
+
+    while ((opt = getopt(argc, argv, "m:s:d:zr:pt:b:w:i:f:o:l:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            backend = NULL;
+            for (i=0; i<sizeof backends/sizeof backends[0]; i++)
+                if (strcmp(optarg, backends[i]->name) == 0)
+                    backend = backends[i];
+            if (!backend) {
+                fprintf(stderr, "unknown backend %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            params.transferSize = atoi(optarg);
+            break;
+        case 'd':
+            params.depth = atoi(optarg);
+            break;
+        case 'z':
+            params.zeroCopy = 1;
+            break;
+        case 'r':
+            params.reapBatch = atoi(optarg);
+            break;
+        case 'p':
+            params.busyPoll = 1;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'b':
+            byteLimit = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'i':
+            intervalMs = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0)
+                fmt = format_text;
+            else if (strcmp(optarg, "csv") == 0)
+                fmt = format_csv;
+            else if (strcmp(optarg, "json") == 0)
+                fmt = format_json;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o':
+            outName = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (params.transferSize == 0)
+        params.transferSize = backend->defaultSize;
+    if (params.transferSize < 1 || params.depth < 1 || params.depth > BENCH_MAX_DEPTH
+            || params.reapBatch < 0 || seconds <= 0 || warmup < 0 || intervalMs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (outName) {
+        out = fopen(outName, "a");
+        if (!out) {
+            perror(outName);
+            return 1;
+        }
+    }
+
     //Pass Interrupt Signal to our handler
- 	signal(SIGINT, sighandler);
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
 
     //init libUSB
- 	libusb_init(&ctx);
- 	libusb_set_debug(ctx, 3);
-
-    //Open Device with VendorID and ProductID
- 	handle = libusb_open_device_with_vid_pid(ctx,
- 		USB_VENDOR_ID, USB_PRODUCT_ID);
- 	if (!handle) {
- 		perror("device not found");
- 		return 1;
- 	}
-
- 	int r = 1;
-	//Claim Interface 0 from the device
- 	r = libusb_claim_interface(handle, 0);
- 	if (r < 0) {
- 		fprintf(stderr, "usb_claim_interface error %d\n", r);
- 		return 2;
- 	}
- 	printf("Interface claimed\n");
- 	//take the first time measurement
- 	clock_gettime(CLOCK_REALTIME, &t1);
-
-    //continuously read USB transfers
- 	while (1){
- 		usb_read();
-//		usb_write();
- 	}
-    //never reached
- 	libusb_close(handle);
- 	libusb_exit(NULL);
-
- 	return 0;
- }
+    r = libusb_init(&ctx);
+    if (r < 0) {
+        fprintf(stderr, "Failed to initialise libusb\n");
+        return 1;
+    }
+    params.ctx = ctx;
+    params.dev = find_device(ctx);
+    if (!params.dev) {
+        fprintf(stderr, "device not found\n");
+        libusb_exit(ctx);
+        return 1;
+    }
+
+    r = backend->open(&params);
+    if (r < 0) {
+        libusb_unref_device(params.dev);
+        libusb_exit(ctx);
+        return 2;
+    }
+
+    memset(&stats, 0, sizeof stats);
+    stats.transferSize = params.transferSize;
+    stats.intervalNs = intervalMs*NS_PER_MS;
+    stats.byteLimit = byteLimit;
+    start = now_ns();
+    stats.warmupNs = (uint64_t)(warmup*NS_PER_SEC);
+    stats.warmEnd = start + stats.warmupNs;
+    stats.intervalEnd = stats.warmEnd + stats.intervalNs;
+    if (!byteLimit)
+        stats.end = stats.warmEnd + (uint64_t)(seconds*NS_PER_SEC);
+
+    r = backend->start();
+    while (r >= 0 && !do_exit && !stats.done) {
+        r = backend->poll();
+        if (stats.end && now_ns() >= stats.end)
+            stats.done = 1;
+    }
+    stop = now_ns();
+    if (r < 0)
+        fprintf(stderr, "run aborted: %s\n", libusb_error_name(r));
+
+    // the measured time ends with the run or with the last completion
+    if (stats.end && stop > stats.end)
+        stop = stats.end;
+    if (byteLimit && stats.last)
+        stop = stats.last;
+    measured = stop > stats.warmEnd ? stop-stats.warmEnd : 0;
+    print_result(out, fmt, label, backend, &params, measured);
+    if (stats.cyclesRunning)
+        cycles_stop(&stats.cycles);
+
+    backend->close();
+    if (out != stdout)
+        fclose(out);
+    libusb_unref_device(params.dev);
+    libusb_exit(ctx);
+
+    return r < 0 ? 3 : 0;
+}
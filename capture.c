@@ -0,0 +1,460 @@
+/*
+ * Capture to disk with io_uring and O_DIRECT, see capture.h
+ * liburing is not needed, the few io_uring calls are made directly.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "capture.h"
+#include "timing.h"
+
+/*
+ * Submission and completion queue of one io_uring instance.
+ * Only the writer thread uses it.
+ */
+struct capture_ring {
+    int fd;
+    int fixed;                  // the pool is registered, WRITE_FIXED is used
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingLen, cqRingLen, sqesLen;
+};
+
+static void ring_free(struct capture_ring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqesLen);
+    if (r->cqRing && r->cqRing != MAP_FAILED && r->cqRing != r->sqRing)
+        munmap(r->cqRing, r->cqRingLen);
+    if (r->sqRing && r->sqRing != MAP_FAILED)
+        munmap(r->sqRing, r->sqRingLen);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+static struct capture_ring *ring_setup(unsigned entries, uint8_t *pool, size_t chunkSize, int numChunks)
+{
+    struct io_uring_params p;
+    struct capture_ring *r;
+    struct iovec *iov;
+    int i;
+
+    r = calloc(1, sizeof *r);
+    if (!r)
+        return NULL;
+    memset(&p, 0, sizeof p);
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->sqRingLen = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    r->cqRingLen = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqRingLen > r->sqRingLen)
+            r->sqRingLen = r->cqRingLen;
+        r->cqRingLen = r->sqRingLen;
+    }
+    r->sqRing = mmap(NULL, r->sqRingLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqRing = r->sqRing;
+    else
+        r->cqRing = mmap(NULL, r->cqRingLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+    if (r->cqRing == MAP_FAILED)
+        goto fail;
+    r->sqesLen = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sqHead = (unsigned *)((char *)r->sqRing+p.sq_off.head);
+    r->sqTail = (unsigned *)((char *)r->sqRing+p.sq_off.tail);
+    r->sqMask = (unsigned *)((char *)r->sqRing+p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)((char *)r->sqRing+p.sq_off.array);
+    r->cqHead = (unsigned *)((char *)r->cqRing+p.cq_off.head);
+    r->cqTail = (unsigned *)((char *)r->cqRing+p.cq_off.tail);
+    r->cqMask = (unsigned *)((char *)r->cqRing+p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cqRing+p.cq_off.cqes);
+
+    // pinning the pool once saves the page lookups on every write,
+    // it fails if RLIMIT_MEMLOCK is too small and plain writes are used
+    iov = calloc(numChunks, sizeof *iov);
+    if (iov) {
+        for (i=0; i<numChunks; i++) {
+            iov[i].iov_base = pool+(size_t)i*chunkSize;
+            iov[i].iov_len = chunkSize;
+        }
+        r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, numChunks) == 0;
+        free(iov);
+    }
+    return r;
+
+fail:
+    ring_free(r);
+    return NULL;
+}
+
+/*
+ * Queues and submits the write of one chunk at the given file offset.
+ */
+static int ring_write(struct capture *c, struct capture_chunk ch, size_t len, uint64_t offset)
+{
+    struct capture_ring *r = c->ring;
+    unsigned tail = *r->sqTail;
+    unsigned idx = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->pool+(size_t)ch.index*c->chunkSize);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = r->fixed ? ch.index : 0;
+    sqe->user_data = (uint64_t)ch.index | (uint64_t)len<<32;
+    r->sqArray[idx] = idx;
+    __atomic_store_n(r->sqTail, tail+1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Waits for at least one completion and returns the chunks of all
+ * completed writes to the pool. Returns the number of completions.
+ */
+static int ring_reap(struct capture *c)
+{
+    struct capture_ring *r = c->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    uint32_t index;
+    int n = 0;
+
+    for (;;) {
+        head = *r->cqHead;
+        tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+            break;
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR)
+            return -1;
+    }
+    for (; head != tail; head++, n++) {
+        cqe = &r->cqes[head & *r->cqMask];
+        index = (uint32_t)cqe->user_data;
+        if (cqe->res != (int32_t)(cqe->user_data>>32)) {
+            if (!c->writeErrors)
+                fprintf(stderr, "capture: write failed: %s\n",
+                    cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            c->writeErrors++;
+        }
+        spsc_push(&c->free, &index);
+    }
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Closes the current file. O_DIRECT writes are padded to CAPTURE_ALIGN,
+ * the file is cut back to the data afterwards.
+ */
+static void close_file(struct capture *c)
+{
+    if (c->fd < 0)
+        return;
+    if (c->direct && ftruncate(c->fd, c->fileBytes) < 0)
+        c->writeErrors++;
+    close(c->fd);
+    c->fd = -1;
+}
+
+static int open_file(struct capture *c)
+{
+    char name[256];
+
+    snprintf(name, sizeof name, "%s-%04d.bin", c->prefix, c->files);
+    if (c->direct) {
+        c->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+        if (c->fd < 0 && errno == EINVAL) {
+            fprintf(stderr, "capture: O_DIRECT not supported for %s, using buffered I/O\n", name);
+            c->direct = 0;
+        }
+    }
+    if (!c->direct)
+        c->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (c->fd < 0) {
+        fprintf(stderr, "capture: %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    c->files++;
+    c->fileBytes = 0;
+    c->fileOpened = now_ns();
+    return 0;
+}
+
+static int needs_rotation(struct capture *c, size_t len)
+{
+    if (c->fd < 0)
+        return 1;
+    if (c->rotateBytes && c->fileBytes > 0 && c->fileBytes+len > c->rotateBytes)
+        return 1;
+    return c->rotateNs && now_ns()-c->fileOpened >= c->rotateNs;
+}
+
+/*
+ * Appends the queued index records to the index file.
+ */
+static void write_marks(struct capture *c)
+{
+    struct capture_mark m;
+
+    while (spsc_pop(&c->marks, &m) == 0) {
+        if (fwrite(&m, sizeof m, 1, c->idx) != 1)
+            c->writeErrors++;
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct capture *c = arg;
+    struct capture_chunk ch;
+    struct pollfd pfd = { c->wakeFd, POLLIN, 0 };
+    uint64_t start = now_ns(), wake;
+    int havePending = 0, inFlight = 0, failed = 0;
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        while (inFlight < CAPTURE_QUEUE_DEPTH) {
+            if (!havePending && spsc_pop(&c->full, &ch) < 0)
+                break;
+            havePending = 1;
+            if (needs_rotation(c, ch.len)) {
+                // the old file is closed once all its writes are done
+                if (inFlight > 0)
+                    break;
+                close_file(c);
+                if (!failed && open_file(c) < 0)
+                    failed = 1;
+            }
+            havePending = 0;
+            if (failed) {
+                spsc_push(&c->free, &ch.index);
+                continue;
+            }
+            if (c->pyramid)
+                pyramidAdd(&c->pyr, c->pool+(size_t)ch.index*c->chunkSize, ch.len);
+            // O_DIRECT needs whole blocks, the padding is cut off in close_file
+            len = c->direct ? (ch.len+CAPTURE_ALIGN-1)/CAPTURE_ALIGN*CAPTURE_ALIGN : ch.len;
+            if (c->ring) {
+                if (ring_write(c, ch, len, c->fileBytes) < 0) {
+                    c->writeErrors++;
+                    spsc_push(&c->free, &ch.index);
+                    continue;
+                }
+                if (++inFlight > c->maxInFlight)
+                    c->maxInFlight = inFlight;
+            } else {
+                n = pwrite(c->fd, c->pool+(size_t)ch.index*c->chunkSize, len, c->fileBytes);
+                if (n != (ssize_t)len)
+                    c->writeErrors++;
+                c->maxInFlight = 1;
+                spsc_push(&c->free, &ch.index);
+            }
+            c->fileBytes += ch.len;
+            c->written += ch.len;
+        }
+        write_marks(c);
+        if (inFlight > 0) {
+            n = ring_reap(c);
+            if (n < 0)
+                break;
+            inFlight -= n;
+            continue;
+        }
+        if (!havePending && atomic_load(&c->stop) && spsc_count(&c->full) == 0)
+            break;
+        if (!havePending && poll(&pfd, 1, 100) > 0 && read(c->wakeFd, &wake, sizeof wake) < 0)
+            break;
+    }
+    close_file(c);
+    write_marks(c);
+    if (fclose(c->idx))
+        c->writeErrors++;
+    if (c->pyramid && pyramidFinish(&c->pyr) < 0)
+        c->writeErrors++;
+    c->ns = now_ns()-start;
+    return NULL;
+}
+
+int captureOpen(struct capture *c, const char *prefix, size_t chunkSize, int numChunks,
+                uint64_t rotateBytes, uint64_t rotateNs, int flags, uint32_t channels)
+{
+    char name[256];
+    uint32_t i;
+    int err;
+
+    memset(c, 0, sizeof *c);
+    snprintf(c->prefix, sizeof c->prefix, "%s", prefix);
+    c->chunkSize = (chunkSize+CAPTURE_ALIGN-1)/CAPTURE_ALIGN*CAPTURE_ALIGN;
+    c->numChunks = numChunks;
+    c->rotateBytes = rotateBytes;
+    c->rotateNs = rotateNs;
+    c->fd = -1;
+    c->direct = 1;
+    c->wakeFd = -1;
+
+    if (posix_memalign((void **)&c->pool, CAPTURE_ALIGN, c->chunkSize*numChunks)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // touch the pool now, not in the event thread
+    memset(c->pool, 0, c->chunkSize*numChunks);
+    if (spsc_init(&c->full, numChunks, sizeof(struct capture_chunk))
+            || spsc_init(&c->free, numChunks, sizeof(uint32_t))
+            || spsc_init(&c->marks, CAPTURE_MARKS, sizeof(struct capture_mark)))
+        goto fail;
+    snprintf(name, sizeof name, "%s.idx", c->prefix);
+    c->idx = fopen(name, "wb");
+    if (!c->idx)
+        goto fail;
+    c->pyramid = flags & CAPTURE_PYRAMID;
+    if (c->pyramid && pyramidCreate(&c->pyr, c->prefix, channels) < 0)
+        goto fail;
+    for (i=0; i<(uint32_t)numChunks; i++)
+        spsc_push(&c->free, &i);
+    c->wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (c->wakeFd < 0)
+        goto fail;
+    c->ring = ring_setup(CAPTURE_QUEUE_DEPTH, c->pool, c->chunkSize, numChunks);
+    c->uring = c->ring != NULL;
+    if (!c->ring)
+        fprintf(stderr, "capture: io_uring not available, using pwrite\n");
+    err = pthread_create(&c->thread, NULL, writer_thread, c);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    if (c->ring)
+        ring_free(c->ring);
+    if (c->wakeFd >= 0)
+        close(c->wakeFd);
+    if (c->idx)
+        fclose(c->idx);
+    if (c->pyramid && c->pyr.files[0])
+        fclose(c->pyr.files[0]);
+    spsc_free(&c->full);
+    spsc_free(&c->free);
+    spsc_free(&c->marks);
+    free(c->pool);
+    errno = err;
+    return -1;
+}
+
+static void hand_off(struct capture *c)
+{
+    uint64_t one = 1;
+
+    // full has room for every chunk, this can not fail
+    spsc_push(&c->full, &c->cur);
+    c->haveChunk = 0;
+    if (write(c->wakeFd, &one, sizeof one) < 0) {
+        // the writer also polls with a timeout
+    }
+}
+
+void captureWrite(struct capture *c, const uint8_t *data, size_t len, uint64_t t)
+{
+    struct capture_mark m = { t, len, 0 };
+    size_t space, n;
+
+    c->buffers++;
+    // the whole buffer has to fit, or it is dropped
+    space = c->haveChunk ? c->chunkSize-c->cur.len : 0;
+    if (len > space && spsc_count(&c->free) < (len-space+c->chunkSize-1)/c->chunkSize) {
+        c->droppedBuffers++;
+        c->droppedBytes += len;
+        m.dropped = 1;
+    }
+    if (spsc_push(&c->marks, &m) < 0)
+        c->lostMarks++;
+    if (m.dropped)
+        return;
+    while (len > 0) {
+        if (!c->haveChunk) {
+            spsc_pop(&c->free, &c->cur.index);
+            c->cur.len = 0;
+            c->haveChunk = 1;
+        }
+        n = c->chunkSize-c->cur.len;
+        if (n > len)
+            n = len;
+        memcpy(c->pool+(size_t)c->cur.index*c->chunkSize+c->cur.len, data, n);
+        c->cur.len += n;
+        data += n;
+        len -= n;
+        if (c->cur.len == c->chunkSize)
+            hand_off(c);
+    }
+}
+
+void captureClose(struct capture *c)
+{
+    uint64_t one = 1;
+
+    if (c->haveChunk && c->cur.len > 0)
+        hand_off(c);
+    atomic_store(&c->stop, 1);
+    if (write(c->wakeFd, &one, sizeof one) < 0) {
+        // the writer also polls with a timeout and sees stop
+    }
+    pthread_join(c->thread, NULL);
+    if (c->ring)
+        ring_free(c->ring);
+    c->ring = NULL;
+    close(c->wakeFd);
+    spsc_free(&c->full);
+    spsc_free(&c->free);
+    spsc_free(&c->marks);
+    free(c->pool);
+}
+
+void capturePrint(FILE *f, const struct capture *c)
+{
+    fprintf(f, "capture: %llu bytes in %d file%s (%s, %s), %.1f MB/s, %d writes in flight max\n",
+        (unsigned long long)c->written, c->files, c->files == 1 ? "" : "s",
+        c->uring ? "io_uring" : "pwrite", c->direct ? "O_DIRECT" : "buffered",
+        c->ns ? c->written*1000.0/c->ns : 0.0, c->maxInFlight);
+    fprintf(f, "capture: %llu of %llu buffers (%llu bytes) dropped because the disk fell behind, "
+        "%llu write errors\n", (unsigned long long)c->droppedBuffers,
+        (unsigned long long)c->buffers, (unsigned long long)c->droppedBytes,
+        (unsigned long long)c->writeErrors);
+    if (c->pyramid)
+        fprintf(f, "capture: pyramid of %llu samples in %s.pyr*\n",
+            (unsigned long long)c->pyr.samples, c->prefix);
+    if (c->lostMarks)
+        fprintf(f, "capture: %llu index records lost, %s.idx is incomplete\n",
+            (unsigned long long)c->lostMarks, c->prefix);
+}
@@ -0,0 +1,122 @@
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+/*
+ * Capture to disk (Linux)
+ * The received data is copied into a pool of large, page aligned chunks.
+ * Full chunks go to a writer thread that writes them with O_DIRECT through
+ * io_uring, several writes in flight at a time. A chunk returns to the pool
+ * once its write completed.
+ * captureWrite never waits: if the disk fell behind and no free chunk is
+ * left, the whole buffer is dropped and counted, so a slow disk can not
+ * delay the resubmission of USB transfers.
+ * Files are named <prefix>-0000.bin, <prefix>-0001.bin, ... and a new one
+ * is started when the current one reached the size or age limit.
+ * <prefix>.idx records every buffer as a struct capture_mark, the files
+ * hold only the data. A buffer may span two files. replay.h reads both.
+ * With CAPTURE_PYRAMID the writer thread also builds the min/max/mean
+ * pyramid of the data as 16 bit samples of the first of channels (see
+ * pyramid.h).
+ * Falls back to buffered I/O where O_DIRECT is not supported (e.g. tmpfs)
+ * and to pwrite where io_uring is not available.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "spsc.h"
+#include "pyramid.h"
+
+#define CAPTURE_ALIGN       4096        /* O_DIRECT offset and size alignment */
+#define CAPTURE_CHUNK       (1024*1024) /* default chunk size */
+#define CAPTURE_CHUNKS      32          /* default pool size */
+#define CAPTURE_QUEUE_DEPTH 8           /* writes in flight */
+#define CAPTURE_MARKS       65536       /* index records queued for the writer */
+
+#define CAPTURE_PYRAMID     1           /* captureOpen flag */
+
+struct capture_chunk {
+    uint32_t index;             // chunk in the pool
+    uint32_t len;               // bytes of data, less than the chunk only at the end
+};
+
+/*
+ * Index record of one buffer passed to captureWrite, in host byte order.
+ * The data of a dropped buffer is not in the files, its offset is that of
+ * the next buffer.
+ */
+struct capture_mark {
+    uint64_t t;                 // receive time in ns, CLOCK_MONOTONIC
+    uint32_t len;
+    uint32_t dropped;           // 1 if the data was dropped
+};
+
+struct capture_ring;
+
+struct capture {
+    // set up by captureOpen
+    char prefix[200];
+    size_t chunkSize;
+    int numChunks;
+    uint64_t rotateBytes;       // 0: no size limit
+    uint64_t rotateNs;          // 0: no time limit
+    uint8_t *pool;
+    struct spsc_ring full;      // producer -> writer
+    struct spsc_ring free;      // writer -> producer
+    struct spsc_ring marks;     // producer -> writer, index records
+    FILE *idx;
+    int wakeFd;                 // eventfd, the producer signals full chunks
+    pthread_t thread;
+    _Atomic int stop;
+
+    // producer side
+    int haveChunk;              // cur is being filled
+    struct capture_chunk cur;
+    uint64_t buffers;           // buffers passed to captureWrite
+    uint64_t droppedBuffers;
+    uint64_t droppedBytes;
+    uint64_t lostMarks;         // index records that did not fit into marks
+
+    // writer side
+    struct capture_ring *ring;  // io_uring, NULL if pwrite is used
+    int uring;                  // io_uring was set up
+    int direct;                 // files are opened with O_DIRECT
+    int fd;                     // current file
+    int files;
+    uint64_t fileBytes;
+    uint64_t fileOpened;
+    uint64_t written;
+    uint64_t writeErrors;
+    int maxInFlight;
+    int pyramid;                // CAPTURE_PYRAMID was given
+    struct pyramid pyr;
+    uint64_t ns;                // writer thread lifetime
+};
+
+/*
+ * Starts the writer thread. chunkSize is rounded up to CAPTURE_ALIGN, the
+ * largest buffer passed to captureWrite must not be larger than a chunk.
+ * channels is the channel set of the stream for the pyramid, 0x01 if it
+ * has a single one.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int captureOpen(struct capture *c, const char *prefix, size_t chunkSize, int numChunks,
+                uint64_t rotateBytes, uint64_t rotateNs, int flags, uint32_t channels);
+
+/*
+ * Appends one buffer received at time t, only ever from one thread.
+ * Never blocks.
+ */
+void captureWrite(struct capture *c, const uint8_t *data, size_t len, uint64_t t);
+
+/*
+ * Writes what is left, stops the writer thread and closes the file.
+ */
+void captureClose(struct capture *c);
+
+void capturePrint(FILE *f, const struct capture *c);
+
+#endif // CAPTURE_H_INCLUDED
@@ -0,0 +1,87 @@
+#ifndef CPUCYCLES_H_INCLUDED
+#define CPUCYCLES_H_INCLUDED
+
+/*
+ * CPU cost measurement for the host benchmarks.
+ * Counts the CPU cycles spent by this process (user and kernel, the kernel
+ * side is where usbfs copies the URB data) with perf_event_open. If the
+ * kernel does not allow that (see /proc/sys/kernel/perf_event_paranoid) it
+ * falls back to user space cycles only, and the process CPU time is always
+ * measured as well.
+ * The counter is inherited by threads created after cycles_start, their
+ * cycles are added when they have been joined.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+struct cpu_cycles {
+    int fd;                     // perf counter, -1 if not available
+    int userOnly;               // 1 if kernel cycles are not counted
+    struct timespec cpu0;       // process CPU time at cycles_start
+};
+
+static inline int cycles_open(int excludeKernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline void cycles_start(struct cpu_cycles *c)
+{
+    c->userOnly = 0;
+    c->fd = cycles_open(0);
+    if (c->fd < 0) {
+        c->userOnly = 1;
+        c->fd = cycles_open(1);
+    }
+    if (c->fd >= 0) {
+        ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c->cpu0);
+}
+
+/*
+ * Cycles since cycles_start, 0 if no counter is available.
+ */
+static inline uint64_t cycles_read(struct cpu_cycles *c)
+{
+    uint64_t v = 0;
+    if (c->fd < 0 || read(c->fd, &v, sizeof v) != sizeof v)
+        return 0;
+    return v;
+}
+
+/*
+ * Process CPU time since cycles_start in seconds, all threads, user and system.
+ */
+static inline double cycles_cpu_seconds(struct cpu_cycles *c)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (now.tv_sec-c->cpu0.tv_sec) + (now.tv_nsec-c->cpu0.tv_nsec)/1e9;
+}
+
+static inline void cycles_stop(struct cpu_cycles *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+#endif // CPUCYCLES_H_INCLUDED
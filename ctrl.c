@@ -0,0 +1,170 @@
+/*
+ * Configuration tool for the vendor control requests of simple/control.h
+ * It openes an USB device running simple/main.c, ADC/main.c or the
+ * emulator and reads or changes the stream configuration on EP0, the data
+ * endpoints are left alone. Without options it prints the capabilities,
+ * the parameters and the counters.
+ *
+ * Compile:
+ *   gcc -O2 -o ctrl ctrl.c usbhost.c -lusb-1.0
+ * Run:
+ *   ./ctrl [-s transfersize] [-f alphabet|counter|prbs|u16] [-c channels]
+ *          [-n decimation] [-r | -p]
+ *     -s  bytes per IN transfer
+ *     -f  sample format
+ *     -c  channel set as a bit mask, e.g. 0x5 for channels 0 and 2
+ *     -n  only every n-th sample is sent
+ *     -r  start streaming on EP1
+ *     -p  stop streaming on EP1 after the current transfer
+ * Parameters that are not given keep their current value.
+ * For Documentation on libusb see:
+ *   http://libusb.sourceforge.net/api-1.0/modules.html
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbhost.h"
+
+#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
+                                         * 0x0483 is STMs ID
+                                         */
+#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
+
+static const char *formatNames[] = {"alphabet", "counter", "prbs", "u16"};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s transfersize] [-f alphabet|counter|prbs|u16] [-c channels]\n"
+        "       [-n decimation] [-r | -p]\n", name);
+}
+
+static void print_caps(const struct ctrl_caps *c)
+{
+    unsigned int i;
+
+    printf("protocol %d.%d, formats", c->version>>8, c->version&0xFF);
+    for (i=0; i<sizeof formatNames/sizeof formatNames[0]; i++)
+        if (c->formats>>i & 1)
+            printf(" %s", formatNames[i]);
+    printf(", channels 0x%02X\n", c->channels);
+    printf("transfer size %d..%d in steps of %d, decimation 1..%d\n",
+        c->transferGranule, c->maxTransferSize, c->transferGranule, c->maxDecimation);
+}
+
+static void print_params(const struct ctrl_params *p)
+{
+    printf("%d bytes per transfer, format %s, channels 0x%02X, decimation %d\n",
+        p->transferSize, p->format < sizeof formatNames/sizeof formatNames[0]
+            ? formatNames[p->format] : "?", p->channels, p->decimation);
+}
+
+int main(int argc, char **argv)
+{
+    libusb_context *ctx = NULL;
+    struct usb_device dev;
+    struct ctrl_caps caps;
+    struct ctrl_params params, set;
+    struct ctrl_counters counters;
+    int size = -1, format = -1, chans = -1, decimation = -1, run = -1;
+    int opt, r;
+    unsigned int i;
+
+    while ((opt = getopt(argc, argv, "s:f:c:n:rph")) != -1) {
+        switch (opt) {
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'f':
+            for (i=0; i<sizeof formatNames/sizeof formatNames[0]; i++)
+                if (strcmp(optarg, formatNames[i]) == 0)
+                    format = i;
+            if (format < 0) {
+                fprintf(stderr, "unknown format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            chans = strtol(optarg, NULL, 0);
+            break;
+        case 'n':
+            decimation = atoi(optarg);
+            break;
+        case 'r':
+            run = 1;
+            break;
+        case 'p':
+            run = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    r = libusb_init(&ctx);
+    if (r < 0) {
+        fprintf(stderr, "Failed to initialise libusb\n");
+        return 1;
+    }
+    r = usbOpen(&dev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+    if (r < 0) {
+        fprintf(stderr, "could not open the device: %s\n", libusb_error_name(r));
+        libusb_exit(ctx);
+        return 1;
+    }
+
+    r = usbCtrlCaps(&dev, &caps);
+    if (r == 0)
+        r = usbCtrlGetParams(&dev, &params);
+    if (r < 0) {
+        fprintf(stderr, "no control requests: %s\n", libusb_error_name(r));
+        goto out;
+    }
+    print_caps(&caps);
+
+    if (size >= 0 || format >= 0 || chans >= 0 || decimation >= 0) {
+        set = params;
+        if (size >= 0)
+            set.transferSize = size;
+        if (format >= 0)
+            set.format = format;
+        if (chans >= 0)
+            set.channels = chans;
+        if (decimation >= 0)
+            set.decimation = decimation;
+        // checked here as well, the device can only ignore them
+        if (!controlValid(&caps, &set)) {
+            fprintf(stderr, "parameters outside of the capabilities\n");
+            r = LIBUSB_ERROR_INVALID_PARAM;
+            goto out;
+        }
+        r = usbCtrlSetParams(&dev, &set);
+        if (r < 0) {
+            fprintf(stderr, "could not set the parameters: %s\n", libusb_error_name(r));
+            goto out;
+        }
+        params = set;
+    }
+    print_params(&params);
+
+    if (run >= 0) {
+        r = run ? usbCtrlStart(&dev) : usbCtrlStop(&dev);
+        if (r < 0) {
+            fprintf(stderr, "could not %s: %s\n", run ? "start" : "stop", libusb_error_name(r));
+            goto out;
+        }
+        printf("%s\n", run ? "started" : "stopped");
+    }
+
+    r = usbCtrlCounters(&dev, &counters);
+    if (r == 0)
+        printf("%u IN transfers, %u IN bytes, %u overflows, %u OUT bytes\n",
+            counters.inTransfers, counters.inBytes, counters.overflows, counters.outBytes);
+
+out:
+    usbClose(&dev);
+    libusb_exit(ctx);
+    return r < 0 ? 2 : 0;
+}
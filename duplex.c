@@ -0,0 +1,243 @@
+/*
+ * libusb-1.0 full-duplex bulk benchmark
+ * It openes an USB device running the sink mode firmware
+ * (simple/main.c built with DEFAULT_MODE=MODE_SINK), expects two Bulk endpoints,
+ *   EP1 should be IN
+ *   EP2 should be OUT
+ * It keeps a ring of asynchronous transfers in flight per direction and
+ * measures three phases of equal length: IN only, OUT only and both at
+ * once. The result is the throughput of every direction alone and in
+ * duplex, and how much each direction loses because of the other one.
+ *
+ * Compile:
+ *   gcc -O2 -o duplex duplex.c usbhost.c -lusb-1.0
+ * Run:
+ *   ./duplex [-s transfersize] [-d depth] [-t seconds]
+ *     -s  bytes per transfer in both directions (default 8192)
+ *     -d  transfers in flight per direction (default 4)
+ *     -t  seconds per phase (default 5)
+ * For Documentation on libusb see:
+ *   http://libusb.sourceforge.net/api-1.0/modules.html
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include "usbhost.h"
+#include "timing.h"
+
+#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
+                                         * 0x0483 is STMs ID
+                                         */
+#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
+#define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
+#define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
+
+static libusb_context *ctx = NULL;
+static struct usb_device dev;
+static volatile int do_exit = 0;
+
+/*
+ * One direction: a ring of transfers that are resubmitted on completion.
+ */
+struct stream {
+    const char *name;
+    unsigned char endpoint;
+    libusb_transfer_cb_fn cb;
+    struct usb_pool pool;
+    int inFlight;
+    int stopping;
+    uint64_t bytes;
+    uint32_t errors;
+};
+
+static void cb_in(struct libusb_transfer *transfer);
+static void cb_out(struct libusb_transfer *transfer);
+
+static struct stream in = { .name = "IN", .endpoint = USB_ENDPOINT_IN, .cb = cb_in };
+static struct stream out = { .name = "OUT", .endpoint = USB_ENDPOINT_OUT, .cb = cb_out };
+static int depth = 4;
+static int transferSize = 1024*8;
+
+static void transfer_done(struct stream *s, struct libusb_transfer *transfer)
+{
+    s->inFlight--;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        s->errors++;
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+            do_exit = 1;
+            return;
+        }
+    }
+    s->bytes += transfer->actual_length;
+    if (!s->stopping && !do_exit) {
+        if (libusb_submit_transfer(transfer) == 0)
+            s->inFlight++;
+        else
+            s->errors++;
+    }
+}
+
+// user_data is the slot, the direction is told by the callback
+static void cb_in(struct libusb_transfer *transfer)
+{
+    transfer_done(&in, transfer);
+}
+
+static void cb_out(struct libusb_transfer *transfer)
+{
+    transfer_done(&out, transfer);
+}
+
+static int stream_alloc(struct stream *s)
+{
+    int r;
+
+    r = usbPoolCreate(&s->pool, &dev, depth, depth, transferSize, 0);
+    if (r < 0)
+        return r;
+    // the OUT data is never looked at, but should not be uninitialised
+    memset(s->pool.slab, 0, s->pool.slabLen);
+    usbPoolFill(&s->pool, &dev, s->endpoint, s->cb, 0);
+    return 0;
+}
+
+static void stream_start(struct stream *s)
+{
+    int i;
+
+    s->stopping = 0;
+    s->bytes = 0;
+    s->errors = 0;
+    for (i=0; i<depth; i++) {
+        if (libusb_submit_transfer(s->pool.transfers[i]) == 0)
+            s->inFlight++;
+        else
+            s->errors++;
+    }
+}
+
+static void stream_stop(struct stream *s)
+{
+    int i;
+
+    s->stopping = 1;
+    for (i=0; i<depth; i++)
+        libusb_cancel_transfer(s->pool.transfers[i]);
+}
+
+/*
+ * Runs one phase with the given directions active.
+ * Stores the throughput of both directions in B/s, 0 if inactive.
+ */
+static void run_phase(int doIn, int doOut, int seconds, double *inBps, double *outBps)
+{
+    struct timeval tv = {0, 100000};
+    uint64_t start, stop;
+    double s;
+
+    start = now_ns();
+    if (doIn)
+        stream_start(&in);
+    if (doOut)
+        stream_start(&out);
+    do {
+        if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+            do_exit = 1;
+        stop = now_ns();
+    } while (!do_exit && stop-start < seconds*NS_PER_SEC);
+    s = (stop-start)/(double)NS_PER_SEC;
+    *inBps = doIn ? in.bytes/s : 0;
+    *outBps = doOut ? out.bytes/s : 0;
+
+    // wait until both rings are idle before the next phase
+    stream_stop(&in);
+    stream_stop(&out);
+    while (in.inFlight > 0 || out.inFlight > 0) {
+        if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+            break;
+    }
+    printf("%-8s %14.1f %14.1f %8u %8u\n", doIn && doOut ? "duplex" : doIn ? "IN" : "OUT",
+        *inBps, *outBps, doIn ? in.errors : 0, doOut ? out.errors : 0);
+    fflush(stdout);
+}
+
+static void sighandler(int signum)
+{
+    do_exit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    double inAlone, outAlone, inDuplex, outDuplex, unused;
+    int seconds = 5;
+    int opt, r;
+
+    while ((opt = getopt(argc, argv, "s:d:t:h")) != -1) {
+        switch (opt) {
+        case 's':
+            transferSize = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s transfersize] [-d depth] [-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (transferSize < 1 || depth < 1 || depth > USB_POOL_MAX || seconds < 1) {
+        fprintf(stderr, "invalid transfer size, depth or time\n");
+        return 1;
+    }
+
+    signal(SIGINT, sighandler);
+
+    r = libusb_init(&ctx);
+    if (r < 0) {
+        fprintf(stderr, "Failed to initialise libusb\n");
+        return 1;
+    }
+    r = usbOpen(&dev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+    if (r < 0) {
+        fprintf(stderr, "could not open the device: %s\n", libusb_error_name(r));
+        libusb_exit(ctx);
+        return r == LIBUSB_ERROR_NOT_FOUND ? 1 : 2;
+    }
+    if (stream_alloc(&in) < 0 || stream_alloc(&out) < 0) {
+        fprintf(stderr, "could not allocate the transfers\n");
+        do_exit = 1;
+    }
+
+    printf("%d transfers of %d bytes in flight per direction, %d s per phase\n",
+        depth, transferSize, seconds);
+    printf("%-8s %14s %14s %8s %8s\n", "phase", "IN B/s", "OUT B/s", "IN err", "OUT err");
+    if (!do_exit)
+        run_phase(1, 0, seconds, &inAlone, &unused);
+    if (!do_exit)
+        run_phase(0, 1, seconds, &unused, &outAlone);
+    if (!do_exit)
+        run_phase(1, 1, seconds, &inDuplex, &outDuplex);
+    if (!do_exit) {
+        printf("IN  loses %5.1f%% because of OUT traffic\n",
+            inAlone > 0 ? (1-inDuplex/inAlone)*100 : 0.0);
+        printf("OUT loses %5.1f%% because of IN traffic\n",
+            outAlone > 0 ? (1-outDuplex/outAlone)*100 : 0.0);
+        printf("duplex total %.1f B/s\n", inDuplex+outDuplex);
+    }
+
+    usbPoolDestroy(&in.pool);
+    usbPoolDestroy(&out.pool);
+    usbClose(&dev);
+    libusb_exit(ctx);
+    return 0;
+}
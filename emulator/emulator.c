@@ -0,0 +1,552 @@
+/*
+ * Software replacement for the STM32F4 board (Linux only)
+ * It is a FunctionFS user space gadget that presents the same device as
+ * simple/main.c and ADC/main.c: vendor specific interface 0 with
+ *   EP1 bulk IN, 64 bytes
+ *   EP2 bulk OUT, 64 bytes
+ * Together with the dummy_hcd virtual host controller the gadget shows up
+ * as 0483:FFFF on the local machine, so benchmark.c, async.c, ping.c,
+ * duplex.c and both test.c programs run without any hardware.
+ * gadget.sh loads the modules, creates the gadget with the descriptors
+ * from usbdescriptor.h through configfs and starts this program.
+ *
+ * Modes (-m):
+ *   stream  EP1 sends the test pattern of simple/main.c, by default the
+ *           'a'+(i%26) alphabet, EP2 takes LED and pattern commands
+ *   adc     EP1 sends 64 byte packets of averaged 16 bit ADC words like
+ *           ADC/main.c, paced to -r words per second (default 137, the
+ *           rate of the ADC callback), EP2 takes LED commands
+ *   echo    EP2 transfers are returned on EP1, see simple/echo.h
+ *   sink    like stream, but EP2 data is discarded at full rate
+ * The vendor control requests of simple/control.h work as on the board
+ * of the mode: stream and sink like simple/main.c, adc like ADC/main.c.
+ *
+ * Compile:
+ *   gcc -O2 -pthread -o emulator emulator.c ../simple/echo.c ../simple/pattern.c \
+ *       ../simple/control.c -lm
+ * Run (as root, normally through gadget.sh):
+ *   ./emulator [-m stream|adc|echo|sink] [-p alphabet|counter|prbs]
+ *              [-r words/s] /dev/ffs-stm32-0
+ *
+ * FunctionFS assigns the endpoint addresses when the gadget is bound.
+ * dummy_hcd lists ep1in-bulk and ep2out-bulk first, so they end up as
+ * 0x81 and 0x02 like on the real board.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <endian.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "../simple/echo.h"
+#include "../simple/pattern.h"
+#include "../simple/control.h"
+
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+#error "the FunctionFS descriptors below are written for little endian hosts"
+#endif
+
+//same values as usbdescriptor.h and main.c
+#define IN_PACKETSIZE  0x0040
+#define OUT_PACKETSIZE 0x0040
+#define IN_MULT 4
+#define HS_PACKETSIZE  0x0200       /* only used if dummy_hcd runs high speed */
+#define ADC_CHANNELS   3            /* input, VREFINT, temperature */
+#define ADC_VREF       26433        /* initial VREFMeasured of ADC/myADC.c */
+#define ADC_TEMP       940          /* about 25 degrees */
+
+enum mode {
+    mode_stream,
+    mode_adc,
+    mode_echo,
+    mode_sink
+};
+
+/*
+ * Interface and endpoint descriptors, once for full and once for high speed.
+ * The device and configuration descriptors are set up by gadget.sh.
+ */
+struct func_descs {
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio in;
+    struct usb_endpoint_descriptor_no_audio out;
+} __attribute__((packed));
+
+#define FUNC_DESCS(packetsize) {                                    \
+    .intf = {                                                       \
+        .bLength = sizeof(struct usb_interface_descriptor),         \
+        .bDescriptorType = USB_DT_INTERFACE,                        \
+        .bInterfaceNumber = 0,                                      \
+        .bAlternateSetting = 0,                                     \
+        .bNumEndpoints = 2,                                         \
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,                   \
+        .bInterfaceSubClass = 0,                                    \
+        .bInterfaceProtocol = 0,                                    \
+        .iInterface = 0,                                            \
+    },                                                              \
+    .in = {                                                         \
+        .bLength = sizeof(struct usb_endpoint_descriptor_no_audio), \
+        .bDescriptorType = USB_DT_ENDPOINT,                         \
+        .bEndpointAddress = 1 | USB_DIR_IN,                         \
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,                     \
+        .wMaxPacketSize = packetsize,                               \
+        .bInterval = 0,                                             \
+    },                                                              \
+    .out = {                                                        \
+        .bLength = sizeof(struct usb_endpoint_descriptor_no_audio), \
+        .bDescriptorType = USB_DT_ENDPOINT,                         \
+        .bEndpointAddress = 2 | USB_DIR_OUT,                        \
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,                     \
+        .wMaxPacketSize = packetsize,                               \
+        .bInterval = 0,                                             \
+    },                                                              \
+}
+
+static const struct {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct func_descs fs;
+    struct func_descs hs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = FUNCTIONFS_DESCRIPTORS_MAGIC_V2,
+        .length = sizeof descriptors,
+        .flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC,
+    },
+    .fs_count = 3,
+    .hs_count = 3,
+    .fs = FUNC_DESCS(IN_PACKETSIZE),
+    .hs = FUNC_DESCS(HS_PACKETSIZE),
+};
+
+// no interface strings, the device strings come from configfs
+static const struct usb_functionfs_strings_head strings = {
+    .magic = FUNCTIONFS_STRINGS_MAGIC,
+    .length = sizeof strings,
+    .str_count = 0,
+    .lang_count = 0,
+};
+
+static enum mode mode = mode_stream;
+static double adcRate = 137;
+static int pattern = PATTERN_ALPHABET;
+static volatile int requestedPattern = -1;
+static int ep0 = -1, epIn = -1, epOut = -1;
+
+static volatile int do_exit = 0;
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t enabledCond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t ctrlLock = PTHREAD_MUTEX_INITIALIZER;  // EP0 vs. the stream
+
+static uint8_t leds[4];             // LED3..LED6 of the discovery board
+static uint64_t sinkBytes = 0;
+
+// capabilities of simple/main.c and ADC/main.c
+static const struct ctrl_caps streamCaps = {
+    CTRL_VERSION,
+    1<<CTRL_FORMAT_ALPHABET | 1<<CTRL_FORMAT_COUNTER | 1<<CTRL_FORMAT_PRBS31,
+    IN_PACKETSIZE*IN_MULT, PATTERN_BLOCK, 1, 0x01, 0
+};
+static const struct ctrl_caps adcCaps = {
+    CTRL_VERSION, 1<<CTRL_FORMAT_U16, IN_PACKETSIZE*IN_MULT, 2, 1024, (1<<ADC_CHANNELS)-1, 0
+};
+static struct control_state ctrl;
+
+/*
+ * Takes parameters set on EP0 over, called by the stream between two
+ * transfers. Returns 1 if they changed.
+ */
+static int apply_params(void)
+{
+    int r;
+
+    pthread_mutex_lock(&ctrlLock);
+    r = controlApply(&ctrl);
+    pthread_mutex_unlock(&ctrlLock);
+    return r;
+}
+
+/*
+ * Blocks until the host configured the device.
+ */
+static void wait_enabled(void)
+{
+    pthread_mutex_lock(&lock);
+    while (!enabled && !do_exit)
+        pthread_cond_wait(&enabledCond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+static void set_enabled(int e)
+{
+    pthread_mutex_lock(&lock);
+    enabled = e;
+    pthread_cond_broadcast(&enabledCond);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Blocks until the host configured the device and EP1 is not stopped
+ * with CTRL_STOP.
+ */
+static void wait_running(void)
+{
+    wait_enabled();
+    while (!ctrl.running && !do_exit)
+        usleep(1000);
+}
+
+/*
+ * Writes a whole buffer to the IN endpoint.
+ * Returns 0 on success, -1 if the endpoint was disabled meanwhile.
+ */
+static int write_in(const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(epIn, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * EP1 of simple/main.c: the test pattern, see simple/pattern.h
+ * It is written in pieces of 16 firmware transfers, the host sees the
+ * same byte stream.
+ */
+static void stream_pattern(void)
+{
+    static uint8_t transferBuf[IN_PACKETSIZE*IN_MULT*16];
+    struct pattern_state state;
+    size_t len = sizeof transferBuf;
+
+    patternInit(&state, pattern);
+    while (!do_exit) {
+        wait_running();
+        // like the firmware, new parameters restart the pattern
+        if (apply_params()) {
+            requestedPattern = ctrl.params.format;
+            len = 16*ctrl.params.transferSize;
+        }
+        if (requestedPattern >= 0) {
+            patternInit(&state, requestedPattern);
+            ctrl.params.format = requestedPattern;
+            requestedPattern = -1;
+        }
+        patternFill(&state, transferBuf, len);
+        if (write_in(transferBuf, len) < 0) {
+            usleep(1000);
+            continue;
+        }
+        ctrl.counters.inTransfers += 16;
+        ctrl.counters.inBytes += len;
+    }
+}
+
+/*
+ * Next word of the ADC stream, the selected channels of every
+ * decimation-th sample like ADC/main.c. The input is a 1 Hz sine around
+ * half scale, VREFINT and the temperature are constant.
+ * *sample counts the converted samples, *ch is the next channel.
+ */
+static uint16_t adc_word(uint64_t *sample, unsigned int *ch)
+{
+    for (;;) {
+        if (*ch == ADC_CHANNELS) {
+            *sample += ctrl.params.decimation;
+            *ch = 0;
+        }
+        if (ctrl.params.channels>>*ch & 1)
+            break;
+        (*ch)++;
+    }
+    switch ((*ch)++) {
+    case 0:
+        return (uint16_t)(32768+16384*sin(2*M_PI*(*sample)/adcRate));
+    case 1:
+        return ADC_VREF;
+    default:
+        return ADC_TEMP;
+    }
+}
+
+/*
+ * EP1 of ADC/main.c: one transfer of averaged 16 bit words whenever
+ * enough of them were "converted", by default a packet of the input.
+ */
+static void stream_adc(void)
+{
+    uint16_t data[IN_PACKETSIZE*IN_MULT/2];
+    struct timespec next;
+    uint64_t sample = 0, first;
+    unsigned int i, n, ch = ADC_CHANNELS;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!do_exit) {
+        wait_running();
+        if (apply_params())
+            ch = ADC_CHANNELS;
+        n = ctrl.params.transferSize/2;
+        first = sample;
+        for (i=0; i<n; i++)
+            data[i] = htole16(adc_word(&sample, &ch));
+        // the firmware sends when a transfer worth of data is there
+        next.tv_nsec += (uint64_t)(1e9*(sample-first)/adcRate);
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        if (write_in((uint8_t *)data, 2*n) < 0) {
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            continue;
+        }
+        ctrl.counters.inTransfers++;
+        ctrl.counters.inBytes += 2*n;
+    }
+}
+
+static void *in_thread(void *arg)
+{
+    (void)arg;
+    switch (mode) {
+    case mode_stream:
+    case mode_sink:
+        stream_pattern();
+        break;
+    case mode_adc:
+        stream_adc();
+        break;
+    case mode_echo:
+        // the replies are sent by the OUT thread
+        break;
+    }
+    return NULL;
+}
+
+/*
+ * Commands of both main.c files: the first byte '1'..'4' toggles LED3..6,
+ * 'a', 'c' and 'p' restart the stream with another test pattern.
+ */
+static void led_command(const uint8_t *buf, ssize_t n)
+{
+    if (n < 1)
+        return;
+    if (mode == mode_stream && (buf[0] == 'a' || buf[0] == 'c' || buf[0] == 'p')) {
+        requestedPattern = buf[0] == 'a' ? PATTERN_ALPHABET
+            : buf[0] == 'c' ? PATTERN_COUNTER : PATTERN_PRBS31;
+        return;
+    }
+    if (buf[0] < '1' || buf[0] > '4')
+        return;
+    leds[buf[0]-'1'] ^= 1;
+    fprintf(stderr, "LED%d %s\n", buf[0]-'1'+3, leds[buf[0]-'1'] ? "on" : "off");
+}
+
+static void *out_thread(void *arg)
+{
+    static uint8_t rx[ECHO_MAX];
+    static uint8_t tx[ECHO_HEADER+ECHO_MAX];
+    struct echo_state echo;
+    ssize_t n;
+    size_t len;
+
+    (void)arg;
+    echoInit(&echo);
+    while (!do_exit) {
+        wait_enabled();
+        n = read(epOut, rx, mode == mode_echo ? ECHO_MAX : sizeof rx);
+        if (n < 0) {
+            if (errno != EINTR)
+                usleep(1000);
+            continue;
+        }
+        ctrl.counters.outBytes += n;
+        switch (mode) {
+        case mode_stream:
+        case mode_adc:
+            led_command(rx, n);
+            break;
+        case mode_echo:
+            len = echoReply(&echo, rx, n, tx, sizeof tx);
+            write_in(tx, len);
+            break;
+        case mode_sink:
+            sinkBytes += n;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Handles the control endpoint events of FunctionFS.
+ * The vendor requests of simple/control.h are answered, other requests
+ * to the interface are stalled.
+ */
+static void handle_ep0(void)
+{
+    struct usb_functionfs_event event;
+    ssize_t n;
+    uint8_t dummy, *buf;
+    int len;
+
+    n = read(ep0, &event, sizeof event);
+    if (n < (ssize_t)sizeof event) {
+        if (n < 0 && errno != EINTR)
+            do_exit = 1;
+        return;
+    }
+    switch (event.type) {
+    case FUNCTIONFS_ENABLE:
+        fprintf(stderr, "configured\n");
+        set_enabled(1);
+        break;
+    case FUNCTIONFS_DISABLE:
+    case FUNCTIONFS_UNBIND:
+        fprintf(stderr, "deconfigured\n");
+        set_enabled(0);
+        break;
+    case FUNCTIONFS_SETUP:
+        pthread_mutex_lock(&ctrlLock);
+        len = controlSetup(&ctrl, (const uint8_t *)&event.u.setup, &buf);
+        if (len < 0) {
+            // stall: I/O in the opposite direction of the data stage
+            if (event.u.setup.bRequestType & USB_DIR_IN)
+                n = read(ep0, &dummy, 0);
+            else
+                n = write(ep0, &dummy, 0);
+        } else if (event.u.setup.bRequestType & USB_DIR_IN) {
+            n = write(ep0, buf, len);
+        } else {
+            // reading the data stage, or nothing, acknowledges the request
+            n = read(ep0, len ? buf : &dummy, len);
+            if (len && n == len)
+                controlReceived(&ctrl, event.u.setup.bRequest);
+        }
+        pthread_mutex_unlock(&ctrlLock);
+        break;
+    default:
+        break;
+    }
+}
+
+static void sighandler(int signum)
+{
+    do_exit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t inThread, outThread;
+    struct ctrl_params params = {0};
+    char path[256];
+    const char *dir;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:p:r:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "stream") == 0)
+                mode = mode_stream;
+            else if (strcmp(optarg, "adc") == 0)
+                mode = mode_adc;
+            else if (strcmp(optarg, "echo") == 0)
+                mode = mode_echo;
+            else if (strcmp(optarg, "sink") == 0)
+                mode = mode_sink;
+            else {
+                fprintf(stderr, "unknown mode %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            pattern = strcmp(optarg, "counter") == 0 ? PATTERN_COUNTER
+                : strcmp(optarg, "prbs") == 0 ? PATTERN_PRBS31 : PATTERN_ALPHABET;
+            break;
+        case 'r':
+            adcRate = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m stream|adc|echo|sink] [-p alphabet|counter|prbs] [-r words/s] ffs-dir\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || adcRate <= 0) {
+        fprintf(stderr, "usage: %s [-m stream|adc|echo|sink] [-p alphabet|counter|prbs] [-r words/s] ffs-dir\n", argv[0]);
+        return 1;
+    }
+    dir = argv[optind];
+    params.transferSize = mode == mode_adc ? IN_PACKETSIZE : IN_PACKETSIZE*IN_MULT;
+    params.format = mode == mode_adc ? CTRL_FORMAT_U16 : pattern;
+    params.channels = 0x01;
+    params.decimation = 1;
+    controlInit(&ctrl, mode == mode_adc ? &adcCaps : &streamCaps, &params);
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    // the descriptors have to be written before the endpoint files appear
+    snprintf(path, sizeof path, "%s/ep0", dir);
+    ep0 = open(path, O_RDWR);
+    if (ep0 < 0) {
+        perror(path);
+        return 1;
+    }
+    if (write(ep0, &descriptors, sizeof descriptors) < 0) {
+        perror("writing the descriptors");
+        return 1;
+    }
+    if (write(ep0, &strings, sizeof strings) < 0) {
+        perror("writing the strings");
+        return 1;
+    }
+    snprintf(path, sizeof path, "%s/ep1", dir);
+    epIn = open(path, O_RDWR);
+    snprintf(path, sizeof path, "%s/ep2", dir);
+    epOut = open(path, O_RDWR);
+    if (epIn < 0 || epOut < 0) {
+        perror("opening the endpoints");
+        return 1;
+    }
+
+    pthread_create(&inThread, NULL, in_thread, NULL);
+    pthread_create(&outThread, NULL, out_thread, NULL);
+    fprintf(stderr, "emulator ready, bind the gadget to the UDC now\n");
+
+    while (!do_exit)
+        handle_ep0();
+
+    // wake up the threads, blocked endpoint I/O fails once the files close
+    set_enabled(0);
+    close(epIn);
+    close(epOut);
+    pthread_cancel(inThread);
+    pthread_cancel(outThread);
+    pthread_join(inThread, NULL);
+    pthread_join(outThread, NULL);
+    close(ep0);
+    if (mode == mode_sink)
+        fprintf(stderr, "sink received %llu bytes\n", (unsigned long long)sinkBytes);
+    return 0;
+}
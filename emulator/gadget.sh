@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Creates the 0483:FFFF test device on a dummy_hcd virtual host controller
+# and runs the emulator behind it. Needs root, configfs and a kernel with
+# CONFIG_USB_DUMMY_HCD, CONFIG_USB_CONFIGFS and CONFIG_USB_CONFIGFS_F_FS.
+#
+# Run:
+#   sudo ./gadget.sh [emulator options, e.g. -m echo]
+# The device is removed again when the emulator exits (Ctrl-C).
+#
+# Several boards (e.g. for multi.c): every one needs its own virtual
+# controller, set DEVICES when the first instance loads dummy_hcd and
+# start one instance per board with INSTANCE=0,1,...
+#   sudo DEVICES=8 INSTANCE=0 ./gadget.sh &
+#   sudo INSTANCE=1 ./gadget.sh &
+#
+set -e
+
+INSTANCE=${INSTANCE:-0}
+GADGET=/sys/kernel/config/usb_gadget/stm32-$INSTANCE
+FFS=/dev/ffs-stm32-$INSTANCE
+EMULATOR=$(dirname "$0")/emulator
+
+# full speed like the board, the emulator also has high speed descriptors
+modprobe dummy_hcd num=${DEVICES:-1} is_high_speed=0 is_super_speed=0
+modprobe libcomposite
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+cleanup() {
+    echo "" > $GADGET/UDC 2>/dev/null || true
+    [ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID
+    umount $FFS 2>/dev/null || true
+    rm -f $GADGET/configs/c.1/ffs.stm32-$INSTANCE
+    rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1 \
+        $GADGET/functions/ffs.stm32-$INSTANCE $GADGET/strings/0x409 $GADGET 2>/dev/null || true
+}
+trap cleanup EXIT INT TERM
+
+# device and configuration descriptor as in usbdescriptor.h
+mkdir -p $GADGET
+echo 0x0483 > $GADGET/idVendor
+echo 0xffff > $GADGET/idProduct
+echo 0x0200 > $GADGET/bcdDevice
+echo 0x0110 > $GADGET/bcdUSB
+echo 0xff > $GADGET/bDeviceClass
+echo 0x00 > $GADGET/bDeviceSubClass
+echo 0x00 > $GADGET/bDeviceProtocol
+echo 64 > $GADGET/bMaxPacketSize0
+mkdir -p $GADGET/strings/0x409
+echo "STMicroelectronics" > $GADGET/strings/0x409/manufacturer
+echo "ChibiOS/Custom Hardware" > $GADGET/strings/0x409/product
+# the boards report their 96 bit UID in 24 hex digits
+printf "EMU%021X\n" $INSTANCE > $GADGET/strings/0x409/serialnumber
+mkdir -p $GADGET/configs/c.1/strings/0x409
+echo 0xC0 > $GADGET/configs/c.1/bmAttributes
+echo 100 > $GADGET/configs/c.1/MaxPower
+
+mkdir -p $GADGET/functions/ffs.stm32-$INSTANCE
+ln -sf $GADGET/functions/ffs.stm32-$INSTANCE $GADGET/configs/c.1/
+mkdir -p $FFS
+mount -t functionfs stm32-$INSTANCE $FFS
+
+$EMULATOR "$@" $FFS &
+PID=$!
+
+# the endpoint files exist once the emulator wrote its descriptors
+while [ ! -e $FFS/ep2 ]; do
+    kill -0 $PID || exit 1
+    sleep 0.1
+done
+echo dummy_udc.$INSTANCE > $GADGET/UDC
+echo "0483:ffff attached to $(cat $GADGET/UDC)"
+wait $PID
@@ -0,0 +1,287 @@
+/*
+ * Fan-out of the received stream to local processes, see fanout.h
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fanout.h"
+
+static inline struct fanout_slot *slot_at(const struct fanout_header *h, const uint8_t *slots, uint64_t n)
+{
+    return (struct fanout_slot *)(slots+(n % h->slots)*h->stride);
+}
+
+static uint8_t *first_slot(const struct fanout_header *h)
+{
+    return (uint8_t *)h+sizeof *h;
+}
+
+/*
+ * Sends the memfd to every reader that connects, until fanoutClose shuts
+ * the socket down.
+ */
+static void *serve_thread(void *arg)
+{
+    struct fanout *f = arg;
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte = 0;
+    int c;
+
+    for (;;) {
+        c = accept(f->listenFd, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        memset(&msg, 0, sizeof msg);
+        memset(buf, 0, sizeof buf);
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof buf;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &f->fd, sizeof(int));
+        if (sendmsg(c, &msg, MSG_NOSIGNAL) == 1)
+            f->readers++;
+        close(c);
+    }
+    return NULL;
+}
+
+int fanoutCreate(struct fanout *f, const char *path, uint32_t slots, uint32_t slotSize)
+{
+    struct sockaddr_un addr;
+    struct fanout_header *h;
+    uint32_t stride;
+    size_t size;
+    int err;
+
+    memset(f, 0, sizeof *f);
+    f->fd = -1;
+    f->listenFd = -1;
+    if (strlen(path) >= sizeof addr.sun_path || slots < 1 || slotSize < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    stride = (sizeof(struct fanout_slot)+slotSize+FANOUT_LINE-1)/FANOUT_LINE*FANOUT_LINE;
+    size = sizeof *h+(size_t)slots*stride;
+
+    f->fd = memfd_create("stm32-fanout", MFD_CLOEXEC);
+    if (f->fd < 0 || ftruncate(f->fd, size) < 0)
+        goto fail;
+    h = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, f->fd, 0);
+    if (h == MAP_FAILED)
+        goto fail;
+    // the memfd is zeroed, so every seq starts out as "nothing published"
+    h->magic = FANOUT_MAGIC;
+    h->version = FANOUT_VERSION;
+    h->slots = slots;
+    h->slotSize = slotSize;
+    h->size = size;
+    h->stride = stride;
+    f->h = h;
+
+    f->listenFd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (f->listenFd < 0)
+        goto fail;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(f->listenFd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(f->listenFd, 8) < 0)
+        goto fail;
+    snprintf(f->path, sizeof f->path, "%s", path);
+    err = pthread_create(&f->thread, NULL, serve_thread, f);
+    if (err) {
+        errno = err;
+        unlink(path);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    if (f->h)
+        munmap(f->h, f->h->size);
+    if (f->listenFd >= 0)
+        close(f->listenFd);
+    if (f->fd >= 0)
+        close(f->fd);
+    f->h = NULL;
+    errno = err;
+    return -1;
+}
+
+void fanoutPublish(struct fanout *f, const uint8_t *data, size_t len, uint64_t t)
+{
+    struct fanout_header *h = f->h;
+    struct fanout_slot *s = slot_at(h, first_slot(h), f->next);
+    uint64_t n = f->next++;
+
+    atomic_store_explicit(&s->seq, 2*n+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->truncated = len > h->slotSize;
+    if (s->truncated)
+        len = h->slotSize;
+    s->t = t;
+    s->len = len;
+    memcpy(s->data, data, len);
+    atomic_store_explicit(&s->seq, 2*n+2, memory_order_release);
+    atomic_store_explicit(&h->head, n+1, memory_order_release);
+}
+
+void fanoutClose(struct fanout *f)
+{
+    if (!f->h)
+        return;
+    atomic_store(&f->h->closed, 1);
+    // makes the accept of the serve thread fail
+    shutdown(f->listenFd, SHUT_RDWR);
+    pthread_join(f->thread, NULL);
+    close(f->listenFd);
+    unlink(f->path);
+    munmap(f->h, f->h->size);
+    close(f->fd);
+    f->h = NULL;
+}
+
+/*
+ * Receives the memfd from the writer.
+ */
+static int receive_fd(const char *path)
+{
+    struct sockaddr_un addr;
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char byte;
+    int s, fd = -1;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = EINVAL;
+        return -1;
+    }
+    s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(s, (struct sockaddr *)&addr, sizeof addr) == 0) {
+        memset(&msg, 0, sizeof msg);
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof buf;
+        if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) == 1) {
+            cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+        }
+        if (fd < 0)
+            errno = EPROTO;
+    }
+    close(s);
+    return fd;
+}
+
+int fanoutAttach(struct fanout_reader *r, const char *path)
+{
+    struct fanout_header h, *m;
+    int fd, err;
+
+    memset(r, 0, sizeof *r);
+    fd = receive_fd(path);
+    if (fd < 0)
+        return -1;
+    if (pread(fd, &h, sizeof h, 0) != sizeof h || h.magic != FANOUT_MAGIC
+            || h.version != FANOUT_VERSION) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    m = mmap(NULL, h.size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (m == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+    r->h = m;
+    r->slots = first_slot(m);
+    r->next = atomic_load_explicit(&m->head, memory_order_acquire);
+    return 0;
+}
+
+int fanoutPeek(struct fanout_reader *r, const uint8_t **data, size_t *len, uint64_t *t)
+{
+    struct fanout_header *h = r->h;
+    struct fanout_slot *s;
+    uint64_t head, seq;
+
+    for (;;) {
+        head = atomic_load_explicit(&h->head, memory_order_acquire);
+        if (r->next >= head)
+            return atomic_load(&h->closed) ? -1 : 0;
+        if (head-r->next > h->slots) {
+            // lapped by the writer, continue with the oldest message left
+            r->lost += head-r->next-h->slots;
+            r->next = head-h->slots;
+        }
+        s = slot_at(h, r->slots, r->next);
+        seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq == 2*r->next+2)
+            break;
+        // being overwritten with a newer message right now
+        r->lost++;
+        r->next++;
+    }
+    *data = s->data;
+    *len = s->len;
+    if (t)
+        *t = s->t;
+    return 1;
+}
+
+int fanoutDone(struct fanout_reader *r)
+{
+    struct fanout_slot *s = slot_at(r->h, r->slots, r->next);
+    uint64_t seq;
+
+    atomic_thread_fence(memory_order_acquire);
+    seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    if (seq != 2*r->next+2) {
+        r->lost++;
+        r->next++;
+        return -1;
+    }
+    r->received++;
+    r->next++;
+    return 0;
+}
+
+void fanoutDetach(struct fanout_reader *r)
+{
+    if (r->h)
+        munmap(r->h, r->h->size);
+    r->h = NULL;
+}
@@ -0,0 +1,115 @@
+#ifndef FANOUT_H_INCLUDED
+#define FANOUT_H_INCLUDED
+
+/*
+ * Fan-out of the received stream to local processes (Linux)
+ * Only one process can claim the interface. It publishes every filled
+ * transfer buffer into a ring of slots in a memfd. Any number of readers
+ * get the memfd through a Unix socket (SCM_RIGHTS), map it read only and
+ * consume the data in place, each at its own pace.
+ * The writer never waits for a reader. Every slot is a seqlock: its seq is
+ * 2n+1 while message n is written into it and 2n+2 once it is complete.
+ * A reader checks seq before and after using the data, so a message that
+ * was overwritten meanwhile is detected and counted as lost, like the
+ * messages a reader fell more than a whole ring behind on.
+ *
+ * Writer:
+ *   fanoutCreate(&f, "/tmp/stm32.sock", FANOUT_SLOTS, transferSize);
+ *   fanoutPublish(&f, buffer, actual_length, now_ns());    // per transfer
+ * Reader:
+ *   fanoutAttach(&r, "/tmp/stm32.sock");
+ *   while ((n = fanoutPeek(&r, &data, &len, &t)) >= 0) {
+ *       if (n == 0) { wait a bit; continue; }
+ *       use data[0..len-1]
+ *       if (fanoutDone(&r) < 0) the data was overwritten while in use
+ *   }
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define FANOUT_MAGIC    0x54554f46  /* "FOUT" */
+#define FANOUT_VERSION  1
+#define FANOUT_SLOTS    256         /* default ring size */
+#define FANOUT_LINE     64
+#define FANOUT_SOCKET   "/tmp/stm32-stream.sock"   /* default path */
+
+struct fanout_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;              // data bytes per slot
+    uint64_t size;                  // bytes of the whole mapping
+    uint32_t stride;                // bytes from one slot to the next
+    _Atomic uint32_t closed;        // the writer has exited
+    char pad0[FANOUT_LINE-32];
+    _Atomic uint64_t head;          // number of messages published
+    char pad1[FANOUT_LINE-sizeof(uint64_t)];
+};
+
+struct fanout_slot {
+    _Atomic uint64_t seq;           // 2n+1: message n being written, 2n+2: complete
+    uint64_t t;                     // receive time in ns, CLOCK_MONOTONIC
+    uint32_t len;
+    uint32_t truncated;             // the buffer was larger than the slot
+    char pad[FANOUT_LINE-24];
+    uint8_t data[];
+};
+
+struct fanout {
+    struct fanout_header *h;
+    int fd;                         // the memfd
+    int listenFd;
+    char path[108];
+    pthread_t thread;               // hands out the memfd
+    uint64_t next;
+    uint64_t readers;               // connections served
+};
+
+struct fanout_reader {
+    struct fanout_header *h;        // mapped read only
+    const uint8_t *slots;
+    uint64_t next;                  // next message to read
+    uint64_t received;
+    uint64_t lost;                  // overwritten before or while being read
+};
+
+/*
+ * Creates the ring and starts serving it at the Unix socket path.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int fanoutCreate(struct fanout *f, const char *path, uint32_t slots, uint32_t slotSize);
+
+/*
+ * Publishes one buffer, only ever from one thread. Never blocks.
+ */
+void fanoutPublish(struct fanout *f, const uint8_t *data, size_t len, uint64_t t);
+
+/*
+ * Marks the ring closed for the readers and removes the socket.
+ */
+void fanoutClose(struct fanout *f);
+
+/*
+ * Maps the ring of the writer at path. Reading starts with the next
+ * message published. Returns 0 on success, -1 with errno set otherwise.
+ */
+int fanoutAttach(struct fanout_reader *r, const char *path);
+
+/*
+ * Points data to the next message. Returns 1 if there is one, 0 if not
+ * yet and -1 when the writer has closed the ring and all was read.
+ */
+int fanoutPeek(struct fanout_reader *r, const uint8_t **data, size_t *len, uint64_t *t);
+
+/*
+ * Ends the use of the message of fanoutPeek. Returns 0 if it was intact
+ * all the time, -1 if the writer overwrote it meanwhile.
+ */
+int fanoutDone(struct fanout_reader *r);
+
+void fanoutDetach(struct fanout_reader *r);
+
+#endif // FANOUT_H_INCLUDED
@@ -0,0 +1,107 @@
+#ifndef HIST_H_INCLUDED
+#define HIST_H_INCLUDED
+
+/*
+ * Log-linear (HDR style) histogram of 64 bit values, e.g. nanoseconds.
+ * Values below 2*HIST_SUB are counted exactly. Above that every power of
+ * two range is split into HIST_SUB linear buckets, so the relative error
+ * of a percentile is below 1/HIST_SUB (~3%) over the whole 64 bit range.
+ * The buckets are a fixed array, recording is a few instructions and never
+ * allocates, so it can be called from a transfer callback.
+ * A histogram must only be written by one thread.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64-HIST_SUB_BITS+1)*HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline void hist_reset(struct hist *h)
+{
+    memset(h, 0, sizeof *h);
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+    unsigned int shift;
+    if (v < 2*HIST_SUB)
+        return (unsigned int)v;
+    shift = 63-__builtin_clzll(v)-HIST_SUB_BITS;
+    return shift*HIST_SUB + (unsigned int)(v>>shift);
+}
+
+/*
+ * Highest value that is counted in bucket i.
+ */
+static inline uint64_t hist_bucket_value(unsigned int i)
+{
+    unsigned int shift;
+    if (i < 2*HIST_SUB)
+        return i;
+    shift = i/HIST_SUB-1;
+    return (((uint64_t)(i%HIST_SUB+HIST_SUB+1))<<shift)-1;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*
+ * Smallest recorded value that p percent of all values are below or equal
+ * to, within the bucket precision. 0 if nothing was recorded.
+ */
+static inline uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t target, sum = 0;
+    unsigned int i;
+    uint64_t v;
+
+    if (!h->count)
+        return 0;
+    target = (uint64_t)(p/100.0*h->count+0.5);
+    if (target < 1)
+        target = 1;
+    for (i=0; i<HIST_BUCKETS; i++) {
+        sum += h->buckets[i];
+        if (sum >= target) {
+            v = hist_bucket_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Prints p50/p90/p99/p99.9/max of a nanosecond histogram in us.
+ */
+static inline void hist_print(FILE *f, const char *name, const struct hist *h)
+{
+    if (!h->count) {
+        fprintf(f, "%-24s no samples\n", name);
+        return;
+    }
+    fprintf(f, "%-24s n=%-10llu p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+        name, (unsigned long long)h->count,
+        hist_percentile(h, 50)/1000.0, hist_percentile(h, 90)/1000.0,
+        hist_percentile(h, 99)/1000.0, hist_percentile(h, 99.9)/1000.0,
+        h->max/1000.0);
+}
+
+#endif // HIST_H_INCLUDED
@@ -0,0 +1,211 @@
+/*
+ * Live metrics in Prometheus text format, see metrics.h
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "timing.h"
+
+// names of enum libusb_transfer_status
+static const char *statusNames[METRICS_STATUSES] = {
+    "completed", "error", "timed_out", "cancelled", "stall", "no_device", "overflow"
+};
+
+struct text {
+    char buf[16384];
+    size_t len;
+};
+
+static void put(struct text *t, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(t->buf+t->len, sizeof t->buf-t->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        t->len = t->len+n < sizeof t->buf ? t->len+n : sizeof t->buf-1;
+}
+
+static uint64_t get(const struct metric *m)
+{
+    return atomic_load_explicit(&m->v, memory_order_relaxed);
+}
+
+static void put_counter(struct text *t, const char *name, const char *help, const struct metric *m)
+{
+    put(t, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+        (unsigned long long)get(m));
+}
+
+static void put_gauge(struct text *t, const char *name, const char *help, const struct metric *m)
+{
+    put(t, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name,
+        (unsigned long long)get(m));
+}
+
+/*
+ * A nanosecond histogram as a summary in seconds.
+ */
+static void put_summary(struct text *t, const char *name, const char *help, const struct metric_hist *m)
+{
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    struct hist h;
+    unsigned int i;
+
+    // a snapshot, counts recorded meanwhile only blur it a little
+    hist_reset(&h);
+    for (i=0; i<HIST_BUCKETS; i++) {
+        h.buckets[i] = atomic_load_explicit(&m->buckets[i], memory_order_relaxed);
+        h.count += h.buckets[i];
+    }
+    h.max = atomic_load_explicit(&m->max, memory_order_relaxed);
+    put(t, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (i=0; i<sizeof quantiles/sizeof quantiles[0]; i++)
+        put(t, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i]/100,
+            hist_percentile(&h, quantiles[i])/(double)NS_PER_SEC);
+    put(t, "%s_sum %.9f\n%s_count %llu\n", name,
+        atomic_load_explicit(&m->sum, memory_order_relaxed)/(double)NS_PER_SEC,
+        name, (unsigned long long)h.count);
+}
+
+static void render(struct metrics *m, struct text *t)
+{
+    int i;
+
+    put_counter(t, "stm32_bytes_total", "Bytes received on the IN endpoint.", &m->bytes);
+    put_counter(t, "stm32_transfers_total", "IN transfers completed with data.", &m->transfers);
+    put_counter(t, "stm32_short_transfers_total", "IN transfers completed with less than requested.",
+        &m->shortTransfers);
+    put(t, "# HELP stm32_transfer_status_total IN transfer callbacks by libusb status.\n"
+        "# TYPE stm32_transfer_status_total counter\n");
+    for (i=0; i<METRICS_STATUSES; i++)
+        put(t, "stm32_transfer_status_total{status=\"%s\"} %llu\n", statusNames[i],
+            (unsigned long long)get(&m->status[i]));
+    put_gauge(t, "stm32_transfers_in_flight", "IN transfers submitted to libusb.", &m->inFlight);
+    put_gauge(t, "stm32_handoff_queue", "Filled buffers waiting for the consumer.", &m->queued);
+    put_counter(t, "stm32_dropped_buffers_total", "Buffers the capture to disk had to drop.",
+        &m->dropped);
+    put_summary(t, "stm32_transfer_latency_seconds", "Time from submit to completion of IN transfers.",
+        &m->latency);
+    put_summary(t, "stm32_completion_gap_seconds", "Time between two IN transfer completions.",
+        &m->gap);
+    put(t, "# HELP stm32_uptime_seconds Time since the metrics were started.\n"
+        "# TYPE stm32_uptime_seconds gauge\nstm32_uptime_seconds %.3f\n",
+        (now_ns()-m->started)/(double)NS_PER_SEC);
+}
+
+static void write_all(int fd, const char *p, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Answers every connection with a snapshot. A client that sends an HTTP
+ * request within 100 ms gets an HTTP response, any other just the text.
+ */
+static void *serve_thread(void *arg)
+{
+    struct metrics *m = arg;
+    struct text t;
+    char req[512], head[128];
+    struct pollfd pfd;
+    ssize_t n;
+    int c;
+
+    for (;;) {
+        c = accept(m->listenFd, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        pfd.fd = c;
+        pfd.events = POLLIN;
+        n = 0;
+        if (poll(&pfd, 1, 100) > 0)
+            n = recv(c, req, sizeof req-1, 0);
+        t.len = 0;
+        render(m, &t);
+        if (n >= 4 && memcmp(req, "GET ", 4) == 0) {
+            snprintf(head, sizeof head, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", t.len);
+            write_all(c, head, strlen(head));
+        }
+        write_all(c, t.buf, t.len);
+        close(c);
+        m->scrapes++;
+    }
+    return NULL;
+}
+
+void metricsInit(struct metrics *m)
+{
+    memset(m, 0, sizeof *m);
+    m->listenFd = -1;
+    m->started = now_ns();
+}
+
+int metricsServe(struct metrics *m, const char *path)
+{
+    struct sockaddr_un addr;
+    int err;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = EINVAL;
+        return -1;
+    }
+    m->listenFd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (m->listenFd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(m->listenFd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(m->listenFd, 8) < 0)
+        goto fail;
+    snprintf(m->path, sizeof m->path, "%s", path);
+    err = pthread_create(&m->thread, NULL, serve_thread, m);
+    if (err) {
+        unlink(path);
+        errno = err;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    close(m->listenFd);
+    m->listenFd = -1;
+    errno = err;
+    return -1;
+}
+
+void metricsStop(struct metrics *m)
+{
+    if (m->listenFd < 0)
+        return;
+    // makes the accept of the serve thread fail
+    shutdown(m->listenFd, SHUT_RDWR);
+    pthread_join(m->thread, NULL);
+    close(m->listenFd);
+    unlink(m->path);
+    m->listenFd = -1;
+}
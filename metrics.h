@@ -0,0 +1,94 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+/*
+ * Live metrics of a capture in Prometheus text format (Linux)
+ * The counters are atomics on cache lines of their own. Each one has a
+ * single writer thread, which updates it with a relaxed load and store,
+ * no locked instruction and no sharing of a line with another writer.
+ * A server thread answers every connection to a Unix socket with a
+ * snapshot, to plain reads as well as to HTTP GET requests, e.g.
+ *   curl --unix-socket /tmp/stm32-metrics.sock http://localhost/metrics
+ * so scraping never touches the capture threads.
+ * The latencies are recorded in the buckets of hist.h and exported as
+ * summaries with p50/p90/p99/p99.9.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "hist.h"
+
+#define METRICS_LINE        64
+#define METRICS_STATUSES    7       /* enum libusb_transfer_status, COMPLETED..OVERFLOW */
+#define METRICS_SOCKET      "/tmp/stm32-metrics.sock"   /* default path */
+
+struct metric {
+    _Atomic uint64_t v;
+    char pad[METRICS_LINE-sizeof(uint64_t)];
+} __attribute__((aligned(METRICS_LINE)));
+
+struct metric_hist {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+} __attribute__((aligned(METRICS_LINE)));
+
+struct metrics {
+    struct metric bytes;
+    struct metric transfers;            // completed ones
+    struct metric shortTransfers;       // completed with less than requested
+    struct metric status[METRICS_STATUSES];
+    struct metric inFlight;
+    struct metric queued;               // handoff queue of the threaded mode
+    struct metric dropped;              // e.g. buffers the capture dropped
+    struct metric_hist latency;         // submit to complete, ns
+    struct metric_hist gap;             // between completions, ns
+
+    int listenFd;
+    char path[108];
+    pthread_t thread;
+    uint64_t started;
+    _Atomic uint64_t scrapes;
+};
+
+static inline void metric_add(struct metric *m, uint64_t n)
+{
+    atomic_store_explicit(&m->v, atomic_load_explicit(&m->v, memory_order_relaxed)+n,
+        memory_order_relaxed);
+}
+
+static inline void metric_set(struct metric *m, uint64_t v)
+{
+    atomic_store_explicit(&m->v, v, memory_order_relaxed);
+}
+
+static inline void metric_record(struct metric_hist *h, uint64_t v)
+{
+    _Atomic uint64_t *b = &h->buckets[hist_index(v)];
+
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed)+1, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed)+v,
+        memory_order_relaxed);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+    atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed)+1,
+        memory_order_relaxed);
+}
+
+/*
+ * Zeroes the metrics. Call before any thread records.
+ */
+void metricsInit(struct metrics *m);
+
+/*
+ * Serves the metrics at the Unix socket path.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int metricsServe(struct metrics *m, const char *path);
+
+void metricsStop(struct metrics *m);
+
+#endif // METRICS_H_INCLUDED
@@ -0,0 +1,428 @@
+/*
+ * libusb-1.0 multi-device capture
+ * It opens every connected 0483:FFFF device (the boards report their
+ * STM32 unique ID as serial number), expects two Bulk endpoints,
+ *   EP1 should be IN
+ *   EP2 should be OUT
+ * and streams EP1 of all of them at the same time, with a ring of
+ * asynchronous transfers per device. At the end the throughput of every
+ * device and of all together is printed, with the completion gaps and the
+ * CPU cost, to see how the host scales with the number of boards.
+ * Failed transfers are retried like in async.c, a board whose ring ran
+ * empty dropped out and its throughput only counts the time until then.
+ *
+ * Event handling (-e):
+ *   shared  all devices in one libusb context, handled by one thread
+ *   device  every device in its own libusb context with its own thread,
+ *           so the devices don't serialize on the event lock of a context
+ *
+ * Compile:
+ *   gcc -O2 -o multi multi.c usbhost.c -lusb-1.0 -lpthread
+ * Run:
+ *   ./multi [-e shared|device] [-s transfersize] [-d depth] [-t seconds] [-n max]
+ *     -e  event threads (default shared)
+ *     -s  bytes per transfer (default 8192)
+ *     -d  transfers in flight per device (default 4)
+ *     -t  seconds to stream (default 10)
+ *     -n  use at most this many devices (default all)
+ * For Documentation on libusb see:
+ *   http://libusb.sourceforge.net/api-1.0/modules.html
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <signal.h>
+
+#include "usbhost.h"
+#include "timing.h"
+#include "hist.h"
+#include "cpucycles.h"
+
+#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
+                                         * 0x0483 is STMs ID
+                                         */
+#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
+#define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
+
+#define MAX_DEVICES         32          /* upper limit for devices */
+#define MAX_RETRIES         3           /* failures in a row before a slot is given up */
+
+/*
+ * One board with its ring of IN transfers.
+ * Everything but bytes and dropTime is only touched by the thread handling
+ * its context.
+ */
+struct device {
+    libusb_context *ctx;
+    struct usb_device dev;
+    char serial[64];
+    uint8_t bus, address;
+    struct usb_pool pool;
+    int inFlight;
+    uint8_t failures[USB_POOL_MAX]; // of every slot since its last data
+    _Atomic uint64_t bytes;     // read by the main thread for the progress line
+    _Atomic uint64_t dropTime;  // when the ring ran empty, 0 while streaming
+    uint64_t transfers;
+    uint32_t errors;
+    struct hist gaps;
+    uint64_t lastCompletion;
+    pthread_t thread;
+};
+
+static struct device devices[MAX_DEVICES];
+static int numDevices = 0;
+static libusb_context *shared = NULL;
+static int perDevice = 0;
+static int depth = 4;
+static int transferSize = 1024*8;
+
+static volatile int do_exit = 0;
+static volatile int stopping = 0;
+
+/*
+ * Without a transfer in flight the board never calls back again, it
+ * dropped out.
+ */
+static void check_ring(struct device *d, uint64_t now)
+{
+    if (d->inFlight == 0 && !stopping && !d->dropTime)
+        d->dropTime = now;
+}
+
+/*
+ * Like async.c, timeouts and transmission errors are retried up to
+ * MAX_RETRIES times in a row per slot, a stall or a detached board is not.
+ */
+static int retry(struct device *d, int slot, enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_OVERFLOW:
+    case LIBUSB_TRANSFER_ERROR:
+        return ++d->failures[slot] <= MAX_RETRIES;
+    default:
+        return 0;
+    }
+}
+
+static void cb_in(struct libusb_transfer *transfer)
+{
+    struct device *d = transfer->user_data;
+    int slot = (transfer->buffer-d->pool.slab)/transferSize;
+    uint64_t now = now_ns();
+
+    d->inFlight--;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        d->errors++;
+        if (!retry(d, slot, transfer->status)) {
+            check_ring(d, now);
+            return;
+        }
+    } else {
+        d->failures[slot] = 0;
+        atomic_store_explicit(&d->bytes, d->bytes+transfer->actual_length, memory_order_relaxed);
+        d->transfers++;
+        if (d->lastCompletion)
+            hist_record(&d->gaps, now-d->lastCompletion);
+        d->lastCompletion = now;
+    }
+    if (!stopping) {
+        if (libusb_submit_transfer(transfer) == 0)
+            d->inFlight++;
+        else
+            d->errors++;
+        check_ring(d, now);
+    }
+}
+
+/*
+ * Returns the number of transfers in flight on the devices of ctx.
+ */
+static int in_flight(libusb_context *ctx)
+{
+    int i, n = 0;
+
+    for (i=0; i<numDevices; i++) {
+        if (devices[i].ctx == ctx)
+            n += devices[i].inFlight;
+    }
+    return n;
+}
+
+/*
+ * Returns the number of boards on ctx that still stream, of all for NULL.
+ */
+static int active(libusb_context *ctx)
+{
+    int i, n = 0;
+
+    for (i=0; i<numDevices; i++) {
+        if ((!ctx || devices[i].ctx == ctx) && !devices[i].dropTime)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * Event thread of one context, runs until every transfer called back
+ * after stopping was set, or until every board of it dropped out.
+ */
+static void *event_thread(void *arg)
+{
+    libusb_context *ctx = arg;
+    struct timeval tv = {0, 100000};
+
+    while (stopping ? in_flight(ctx) > 0 : active(ctx) > 0) {
+        if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Opens the device at bus/address in d->ctx and prepares its ring.
+ */
+static int open_device(struct device *d)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    ssize_t n, i;
+    int r, k;
+
+    n = libusb_get_device_list(d->ctx, &list);
+    if (n < 0)
+        return (int)n;
+    r = LIBUSB_ERROR_NOT_FOUND;
+    for (i=0; i<n; i++) {
+        if (libusb_get_bus_number(list[i]) == d->bus
+                && libusb_get_device_address(list[i]) == d->address) {
+            r = usbOpenDevice(&d->dev, list[i]);
+            break;
+        }
+    }
+    libusb_free_device_list(list, 1);
+    if (r < 0)
+        return r;
+
+    strcpy(d->serial, "?");
+    if (libusb_get_device_descriptor(libusb_get_device(d->dev.h), &desc) == 0 && desc.iSerialNumber)
+        libusb_get_string_descriptor_ascii(d->dev.h, desc.iSerialNumber,
+            (unsigned char *)d->serial, sizeof d->serial);
+
+    r = usbPoolCreate(&d->pool, &d->dev, depth, depth, transferSize, 0);
+    if (r < 0)
+        return r;
+    usbPoolFill(&d->pool, &d->dev, USB_ENDPOINT_IN, cb_in, 0);
+    // cb_in needs the board rather than the slot
+    for (k=0; k<depth; k++)
+        d->pool.transfers[k]->user_data = d;
+    hist_reset(&d->gaps);
+    return 0;
+}
+
+static void close_device(struct device *d)
+{
+    usbPoolDestroy(&d->pool);
+    usbClose(&d->dev);
+    if (perDevice && d->ctx)
+        libusb_exit(d->ctx);
+}
+
+/*
+ * Finds all matching devices in the shared context and remembers where
+ * they are, so every per-device context can open its own.
+ */
+static int find_devices(int max)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    ssize_t n, i;
+
+    n = libusb_get_device_list(shared, &list);
+    if (n < 0)
+        return (int)n;
+    for (i=0; i<n && numDevices < max; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0)
+            continue;
+        if (desc.idVendor != USB_VENDOR_ID || desc.idProduct != USB_PRODUCT_ID)
+            continue;
+        devices[numDevices].bus = libusb_get_bus_number(list[i]);
+        devices[numDevices].address = libusb_get_device_address(list[i]);
+        numDevices++;
+    }
+    libusb_free_device_list(list, 1);
+    return numDevices;
+}
+
+static uint64_t total_bytes(void)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i=0; i<numDevices; i++)
+        sum += atomic_load_explicit(&devices[i].bytes, memory_order_relaxed);
+    return sum;
+}
+
+static void sighandler(int signum)
+{
+    do_exit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct cpu_cycles cycles;
+    pthread_t sharedThread;
+    uint64_t start, now, last, lastBytes, bytes, c;
+    double s, cpu, mib, sum = 0;
+    int seconds = 10, max = MAX_DEVICES;
+    int opt, r, i, k;
+
+    while ((opt = getopt(argc, argv, "e:s:d:t:n:h")) != -1) {
+        switch (opt) {
+        case 'e':
+            perDevice = strcmp(optarg, "device") == 0;
+            break;
+        case 's':
+            transferSize = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            max = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e shared|device] [-s transfersize] [-d depth] [-t seconds] [-n max]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (transferSize < 1 || depth < 1 || depth > USB_POOL_MAX || seconds < 1
+            || max < 1 || max > MAX_DEVICES) {
+        fprintf(stderr, "invalid transfer size, depth, time or device count\n");
+        return 1;
+    }
+
+    signal(SIGINT, sighandler);
+
+    r = libusb_init(&shared);
+    if (r < 0) {
+        fprintf(stderr, "Failed to initialise libusb\n");
+        return 1;
+    }
+    if (find_devices(max) <= 0) {
+        fprintf(stderr, "no device found\n");
+        libusb_exit(shared);
+        return 1;
+    }
+    for (i=0; i<numDevices; i++) {
+        if (perDevice && libusb_init(&devices[i].ctx) < 0) {
+            fprintf(stderr, "Failed to initialise libusb\n");
+            do_exit = 1;
+            break;
+        }
+        if (!perDevice)
+            devices[i].ctx = shared;
+        r = open_device(&devices[i]);
+        if (r < 0) {
+            fprintf(stderr, "device %d-%d: %s\n", devices[i].bus, devices[i].address,
+                libusb_error_name(r));
+            do_exit = 1;
+            break;
+        }
+        printf("device %2d: bus %03d address %03d serial %s\n", i, devices[i].bus,
+            devices[i].address, devices[i].serial);
+    }
+    printf("%d devices, %d transfers of %d bytes in flight each, %s\n", numDevices, depth,
+        transferSize, perDevice ? "one event thread per device" : "one shared event thread");
+
+    // the cycle counter is inherited by the event threads created below
+    cycles_start(&cycles);
+    start = now_ns();
+    for (i=0; i<numDevices && !do_exit; i++) {
+        for (k=0; k<depth; k++) {
+            if (libusb_submit_transfer(devices[i].pool.transfers[k]) == 0)
+                devices[i].inFlight++;
+            else
+                devices[i].errors++;
+        }
+    }
+    if (!do_exit) {
+        if (perDevice) {
+            for (i=0; i<numDevices; i++)
+                pthread_create(&devices[i].thread, NULL, event_thread, devices[i].ctx);
+        } else {
+            pthread_create(&sharedThread, NULL, event_thread, shared);
+        }
+
+        last = start;
+        lastBytes = 0;
+        do {
+            sleep(1);
+            now = now_ns();
+            bytes = total_bytes();
+            printf("\r%6.1f s: %12.1f B/s total", (now-start)/(double)NS_PER_SEC,
+                (bytes-lastBytes)*(double)NS_PER_SEC/(now-last));
+            fflush(stdout);
+            last = now;
+            lastBytes = bytes;
+        } while (!do_exit && now-start < seconds*NS_PER_SEC && active(NULL) > 0);
+        printf("\n");
+
+        stopping = 1;
+        for (i=0; i<numDevices; i++) {
+            for (k=0; k<depth; k++)
+                libusb_cancel_transfer(devices[i].pool.transfers[k]);
+        }
+        if (perDevice) {
+            for (i=0; i<numDevices; i++)
+                pthread_join(devices[i].thread, NULL);
+        } else {
+            pthread_join(sharedThread, NULL);
+        }
+        now = now_ns();
+
+        s = (now-start)/(double)NS_PER_SEC;
+        printf("%4s %-26s %14s %12s %12s %8s\n", "dev", "serial", "B/s", "transfers/s",
+            "gap p99 us", "errors");
+        for (i=0; i<numDevices; i++) {
+            struct device *d = &devices[i];
+            // a board that dropped out only streamed until then
+            double t = d->dropTime > start ? (d->dropTime-start)/(double)NS_PER_SEC : s;
+            printf("%4d %-26s %14.1f %12.1f %12.1f %8u", i, d->serial, d->bytes/t,
+                d->transfers/t, hist_percentile(&d->gaps, 99)/1000.0, d->errors);
+            if (d->dropTime)
+                printf("  dropped out after %.1f s", t);
+            printf("\n");
+            sum += d->bytes/t;
+        }
+        printf("%4s %-26s %14.1f\n", "all", "", sum);
+        bytes = total_bytes();
+        mib = bytes/(1024.0*1024.0);
+        c = cycles_read(&cycles);
+        cpu = cycles_cpu_seconds(&cycles);
+        if (mib > 0) {
+            if (c)
+                printf("%.0f %scycles/MiB, ", c/mib, cycles.userOnly ? "user " : "");
+            printf("%.3f ms CPU/MiB, %.1f%% of one core\n", cpu*1000/mib, cpu/s*100);
+        }
+    }
+    cycles_stop(&cycles);
+
+    for (i=0; i<numDevices; i++)
+        close_device(&devices[i]);
+    libusb_exit(shared);
+    return 0;
+}
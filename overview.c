@@ -0,0 +1,105 @@
+/*
+ * Overview of a long ADC capture from its min/max/mean pyramid
+ * Reads a capture made with ./async -o prefix -p and prints a range of it
+ * in a given number of columns, or the runs of samples outside limits.
+ * Only the pyramid level matching the width is read, see pyramid.h, the
+ * number of entries read is printed at the end.
+ *
+ * Compile:
+ *   gcc -O2 -o overview overview.c pyramid.c
+ * Run:
+ *   ./overview [-f first] [-n count] [-w width] [-l low] [-H high] prefix
+ *     -f  first sample of the range (default 0)
+ *     -n  number of samples (default: up to the end)
+ *     -w  columns (default 80), one line each with min, max and mean
+ *     -l  print the runs of samples below low ...
+ *     -H  ... or above high instead, raw 16 bit values
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "pyramid.h"
+#include "timing.h"
+
+static void print_run(uint64_t first, uint64_t count, uint16_t min, uint16_t max, void *arg)
+{
+    (void)arg;
+    printf("%12llu %12llu %6u %6u\n", (unsigned long long)first,
+        (unsigned long long)count, min, max);
+}
+
+int main(int argc, char **argv)
+{
+    struct pyramid_view v;
+    struct pyramid_entry *out;
+    uint64_t first = 0, count = 0, t, runs;
+    long low = -1, high = -1;
+    int width = 80, opt, level, i;
+
+    while ((opt = getopt(argc, argv, "f:n:w:l:H:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            first = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'l':
+            low = strtol(optarg, NULL, 0);
+            break;
+        case 'H':
+            high = strtol(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f first] [-n count] [-w width] [-l low] [-H high] prefix\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc-1 || width < 1 || low > UINT16_MAX || high > UINT16_MAX) {
+        fprintf(stderr, "usage: %s [-f first] [-n count] [-w width] [-l low] [-H high] prefix\n",
+            argv[0]);
+        return 1;
+    }
+    if (pyramidOpen(&v, argv[optind]) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    printf("%llu samples", (unsigned long long)v.samples);
+    if (v.stride > 1)
+        printf(" of the first of channels 0x%02X", v.channels);
+    printf("\n");
+
+    t = now_ns();
+    if (low >= 0 || high >= 0) {
+        printf("%12s %12s %6s %6s\n", "first", "samples", "min", "max");
+        runs = pyramidFind(&v, low >= 0 ? low : 0, high >= 0 ? high : UINT16_MAX, print_run, NULL);
+        printf("%llu runs", (unsigned long long)runs);
+    } else {
+        if (!count && first < v.samples)
+            count = v.samples-first;
+        out = malloc(width*sizeof *out);
+        level = out ? pyramidQuery(&v, first, count, width, out) : -1;
+        if (level < 0) {
+            fprintf(stderr, "range %llu+%llu is outside the capture\n",
+                (unsigned long long)first, (unsigned long long)count);
+            pyramidClose(&v);
+            return 1;
+        }
+        printf("%12s %6s %6s %10s\n", "first", "min", "max", "mean");
+        for (i=0; i<width; i++)
+            printf("%12llu %6u %6u %10.1f\n", (unsigned long long)(first+(uint64_t)((double)count*i/width)),
+                out[i].min, out[i].max, out[i].mean);
+        printf("level %d", level);
+        free(out);
+    }
+    printf(", %llu entries read in %.3f ms\n", (unsigned long long)v.reads,
+        (now_ns()-t)/(double)NS_PER_MS);
+    pyramidClose(&v);
+    return 0;
+}
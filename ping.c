@@ -0,0 +1,275 @@
+/*
+ * libusb-1.0 round-trip latency benchmark
+ * It openes an USB device running the echo mode firmware
+ * (simple/main.c built with DEFAULT_MODE=MODE_ECHO), expects two Bulk endpoints,
+ *   EP1 should be IN
+ *   EP2 should be OUT
+ * It sends a payload on EP2, waits for the echo with its sequence number on
+ * EP1 and measures the time in between. This is repeated for payload sizes
+ * from 1 to 4096 bytes, with synchronous libusb_bulk_transfer calls and with
+ * asynchronously submitted transfers.
+ *
+ * Compile:
+ *   gcc -O2 -o ping ping.c simple/echo.c usbhost.c -lusb-1.0
+ * Run:
+ *   ./ping [-m sync|async|both] [-s size] [-n count]
+ *     -m  submission style (default both)
+ *     -s  only measure this payload size (default 1,2,4,...,4096)
+ *     -n  round trips per size (default 1000)
+ * For Documentation on libusb see:
+ *   http://libusb.sourceforge.net/api-1.0/modules.html
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include "usbhost.h"
+#include "simple/echo.h"
+#include "timing.h"
+#include "hist.h"
+
+#define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
+                                         * 0x0483 is STMs ID
+                                         */
+#define USB_PRODUCT_ID	    0xFFFF      /* USB product ID used by the device */
+#define USB_ENDPOINT_IN	    (LIBUSB_ENDPOINT_IN  | 1)   /* endpoint address */
+#define USB_ENDPOINT_OUT	(LIBUSB_ENDPOINT_OUT | 2)   /* endpoint address */
+#define USB_TIMEOUT	        3000        /* Connection timeout (in ms) */
+
+static libusb_context *ctx = NULL;
+static struct usb_device dev;
+static libusb_device_handle *handle;
+static int maxPacket = 64;
+
+static uint8_t payload[ECHO_MAX];
+static uint8_t reply[ECHO_HEADER+ECHO_MAX];
+
+static volatile int do_exit = 0;
+
+// result of one size/style combination
+static struct hist rtt;
+static uint32_t errors;
+static uint32_t seqGaps;
+static int haveSeq;
+static uint32_t lastSeq;
+
+/*
+ * Checks a reply and its sequence number.
+ */
+static void check_reply(int len, int n)
+{
+    uint32_t seq;
+
+    if (echoCheck(reply, len, payload, n, &seq) < 0) {
+        errors++;
+        return;
+    }
+    if (haveSeq && seq != lastSeq+1)
+        seqGaps++;
+    lastSeq = seq;
+    haveSeq = 1;
+}
+
+/*
+ * One synchronous round trip of n bytes.
+ * A payload that is a multiple of the packet size needs a zero length
+ * packet so the device sees the end of the transfer.
+ */
+static int ping_sync(int n)
+{
+    int len, ret;
+    uint64_t t0 = now_ns();
+
+    ret = libusb_bulk_transfer(handle, USB_ENDPOINT_OUT, payload, n, &len, USB_TIMEOUT);
+    if (ret == 0 && n%maxPacket == 0 && n < ECHO_MAX)
+        ret = libusb_bulk_transfer(handle, USB_ENDPOINT_OUT, payload, 0, &len, USB_TIMEOUT);
+    if (ret == 0)
+        ret = libusb_bulk_transfer(handle, USB_ENDPOINT_IN, reply, ECHO_HEADER+n, &len, USB_TIMEOUT);
+    if (ret) {
+        errors++;
+        return ret;
+    }
+    hist_record(&rtt, now_ns()-t0);
+    check_reply(len, n);
+    return 0;
+}
+
+// the two transfers of the pool, they are filled for every round trip
+static struct usb_pool pool;
+static struct libusb_transfer *transfer_out;
+static struct libusb_transfer *transfer_in;
+static int outDone, inDone;
+static uint64_t inTime;
+
+static void cb_out(struct libusb_transfer *transfer)
+{
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+        errors++;
+    outDone = 1;
+}
+
+static void cb_in(struct libusb_transfer *transfer)
+{
+    inTime = now_ns();
+    inDone = 1;
+}
+
+/*
+ * One asynchronous round trip of n bytes.
+ * The IN transfer is submitted first, so it is already waiting when the
+ * device starts to send the echo.
+ */
+static int ping_async(int n)
+{
+    int r;
+    uint64_t t0;
+
+    outDone = inDone = 0;
+    libusb_fill_bulk_transfer(transfer_in, handle, USB_ENDPOINT_IN,
+        reply, ECHO_HEADER+n, cb_in, NULL, USB_TIMEOUT);
+    libusb_fill_bulk_transfer(transfer_out, handle, USB_ENDPOINT_OUT,
+        payload, n, cb_out, NULL, USB_TIMEOUT);
+    transfer_out->flags = (n%maxPacket == 0 && n < ECHO_MAX) ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+
+    t0 = now_ns();
+    r = libusb_submit_transfer(transfer_in);
+    if (r < 0) {
+        errors++;
+        return r;
+    }
+    r = libusb_submit_transfer(transfer_out);
+    if (r < 0) {
+        // the IN transfer calls back as cancelled and is counted below
+        libusb_cancel_transfer(transfer_in);
+        outDone = 1;
+    }
+    while (!inDone || !outDone) {
+        r = libusb_handle_events_completed(ctx, NULL);
+        if (r < 0) {
+            // both have to call back before they may be filled again
+            errors++;
+            libusb_cancel_transfer(transfer_in);
+            libusb_cancel_transfer(transfer_out);
+            while (!inDone || !outDone) {
+                if (libusb_handle_events_completed(ctx, NULL) < 0) {
+                    // still in flight, no further round trip is possible
+                    do_exit = 1;
+                    break;
+                }
+            }
+            return r;
+        }
+    }
+    if (transfer_in->status != LIBUSB_TRANSFER_COMPLETED) {
+        errors++;
+        return 0;
+    }
+    hist_record(&rtt, inTime-t0);
+    check_reply(transfer_in->actual_length, n);
+    return 0;
+}
+
+static void run(const char *style, int (*ping)(int), int n, int count)
+{
+    int i, j;
+
+    hist_reset(&rtt);
+    errors = 0;
+    seqGaps = 0;
+    haveSeq = 0;
+    for (i=0; i<count && !do_exit; i++) {
+        // a different payload every time, so stale replies are detected
+        for (j=0; j<n; j++)
+            payload[j] = i+j;
+        if (ping(n) == LIBUSB_ERROR_NO_DEVICE) {
+            do_exit = 1;
+            break;
+        }
+    }
+    printf("%-6s %6d %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %7u %7u\n", style, n,
+        (unsigned long long)rtt.count,
+        hist_percentile(&rtt, 50)/1000.0, hist_percentile(&rtt, 90)/1000.0,
+        hist_percentile(&rtt, 99)/1000.0, hist_percentile(&rtt, 99.9)/1000.0,
+        rtt.max/1000.0, errors, seqGaps);
+    fflush(stdout);
+}
+
+static void sighandler(int signum)
+{
+    do_exit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    int doSync = 1, doAsync = 1;
+    int size = 0, count = 1000;
+    int opt, r, n;
+
+    while ((opt = getopt(argc, argv, "m:s:n:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            doSync = strcmp(optarg, "async") != 0;
+            doAsync = strcmp(optarg, "sync") != 0;
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m sync|async|both] [-s size] [-n count]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (size < 0 || size > ECHO_MAX || count < 1) {
+        fprintf(stderr, "size must be 1..%d, count at least 1\n", ECHO_MAX);
+        return 1;
+    }
+
+    //Pass Interrupt Signal to our handler
+    signal(SIGINT, sighandler);
+
+    libusb_init(&ctx);
+
+    //Open Device with VendorID and ProductID and claim Interface 0
+    r = usbOpen(&dev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+    if (r < 0) {
+        fprintf(stderr, "could not open the device: %s\n", libusb_error_name(r));
+        libusb_exit(ctx);
+        return r == LIBUSB_ERROR_NOT_FOUND ? 1 : 2;
+    }
+    handle = dev.h;
+    printf("Interface claimed\n");
+    r = libusb_get_max_packet_size(libusb_get_device(handle), USB_ENDPOINT_OUT);
+    if (r > 0)
+        maxPacket = r;
+
+    // payload and reply are the buffers, the pool only has the transfers
+    if (usbPoolCreate(&pool, &dev, 2, 0, 0, 0) < 0) {
+        fprintf(stderr, "could not allocate the transfers\n");
+        usbClose(&dev);
+        libusb_exit(ctx);
+        return 1;
+    }
+    transfer_out = pool.transfers[0];
+    transfer_in = pool.transfers[1];
+
+    printf("%-6s %6s %8s %9s %9s %9s %9s %9s %7s %7s\n", "style", "bytes", "count",
+        "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "errors", "seqgaps");
+    for (n = size ? size : 1; n <= (size ? size : ECHO_MAX) && !do_exit; n *= 2) {
+        if (doSync)
+            run("sync", ping_sync, n, count);
+        if (doAsync && !do_exit)
+            run("async", ping_async, n, count);
+    }
+
+    usbPoolDestroy(&pool);
+    usbClose(&dev);
+    libusb_exit(ctx);
+
+    return 0;
+}
@@ -0,0 +1,425 @@
+/*
+ * Min/max/mean pyramid of a capture, see pyramid.h
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pyramid.h"
+
+/*
+ * Words per set of the channels.
+ */
+static unsigned stride_of(uint32_t channels)
+{
+    unsigned n = __builtin_popcount(channels);
+
+    return n ? n : 1;
+}
+
+int pyramidCreate(struct pyramid *p, const char *prefix, uint32_t channels)
+{
+    char name[256];
+    int k;
+
+    memset(p, 0, sizeof *p);
+    snprintf(p->prefix, sizeof p->prefix, "%s", prefix);
+    p->channels = channels ? channels : 0x01;
+    p->stride = stride_of(p->channels);
+    for (k=0; k<PYRAMID_LEVELS; k++) {
+        p->acc[k].min = UINT16_MAX;
+        p->acc[k].max = 0;
+    }
+    // level 1 is opened now to catch a bad path early, the levels above
+    // once they get their first entry
+    snprintf(name, sizeof name, "%s.pyr1", p->prefix);
+    p->files[0] = fopen(name, "wb");
+    return p->files[0] ? 0 : -1;
+}
+
+/*
+ * Completes the bucket of level k+1 (acc[k]) and hands it to the level above.
+ */
+static void emit(struct pyramid *p, int k)
+{
+    struct pyramid_entry e;
+    char name[256];
+
+    e.min = p->acc[k].min;
+    e.max = p->acc[k].max;
+    e.mean = (float)((double)p->acc[k].sum/p->acc[k].n);
+    if (!p->files[k]) {
+        snprintf(name, sizeof name, "%s.pyr%d", p->prefix, k+1);
+        p->files[k] = fopen(name, "wb");
+    }
+    if (!p->files[k] || fwrite(&e, sizeof e, 1, p->files[k]) != 1)
+        p->writeErrors++;
+
+    if (k+1 < PYRAMID_LEVELS) {
+        if (e.min < p->acc[k+1].min)
+            p->acc[k+1].min = e.min;
+        if (e.max > p->acc[k+1].max)
+            p->acc[k+1].max = e.max;
+        p->acc[k+1].sum += p->acc[k].sum;
+        p->acc[k+1].n += p->acc[k].n;
+        if (++p->acc[k+1].children == PYRAMID_FANOUT)
+            emit(p, k+1);
+    }
+    p->acc[k].min = UINT16_MAX;
+    p->acc[k].max = 0;
+    p->acc[k].sum = 0;
+    p->acc[k].n = 0;
+    p->acc[k].children = 0;
+}
+
+static inline void add_sample(struct pyramid *p, uint16_t s)
+{
+    if (s < p->acc[0].min)
+        p->acc[0].min = s;
+    if (s > p->acc[0].max)
+        p->acc[0].max = s;
+    p->acc[0].sum += s;
+    if (++p->acc[0].n == PYRAMID_FANOUT)
+        emit(p, 0);
+}
+
+/*
+ * One word of an interleaved stream, only the first channel is summarized.
+ */
+static inline void add_word(struct pyramid *p, uint16_t s)
+{
+    if (p->word == 0) {
+        add_sample(p, s);
+        p->samples++;
+    }
+    if (++p->word == p->stride)
+        p->word = 0;
+}
+
+void pyramidAdd(struct pyramid *p, const uint8_t *data, size_t len)
+{
+    uint16_t s, lo, hi;
+    uint32_t sum;
+    int i;
+
+    if (p->haveCarry && len > 0) {
+        add_word(p, p->carry | data[0] << 8);
+        p->haveCarry = 0;
+        data++;
+        len--;
+    }
+    // several channels: word by word, the other channels are skipped
+    if (p->stride > 1) {
+        for (; len >= 2; data += 2, len -= 2)
+            add_word(p, data[0] | data[1] << 8);
+        if (len) {
+            p->carry = data[0];
+            p->haveCarry = 1;
+        }
+        return;
+    }
+    // the rest of a started bucket
+    while (p->acc[0].n > 0 && len >= 2) {
+        add_sample(p, data[0] | data[1] << 8);
+        p->samples++;
+        data += 2;
+        len -= 2;
+    }
+    // whole buckets, this loop is vectorized
+    while (len >= 2*PYRAMID_FANOUT) {
+        lo = UINT16_MAX;
+        hi = 0;
+        sum = 0;
+        for (i=0; i<PYRAMID_FANOUT; i++) {
+            s = data[2*i] | data[2*i+1] << 8;
+            lo = s < lo ? s : lo;
+            hi = s > hi ? s : hi;
+            sum += s;
+        }
+        p->acc[0].min = lo;
+        p->acc[0].max = hi;
+        p->acc[0].sum = sum;
+        p->acc[0].n = PYRAMID_FANOUT;
+        emit(p, 0);
+        p->samples += PYRAMID_FANOUT;
+        data += 2*PYRAMID_FANOUT;
+        len -= 2*PYRAMID_FANOUT;
+    }
+    while (len >= 2) {
+        add_sample(p, data[0] | data[1] << 8);
+        p->samples++;
+        data += 2;
+        len -= 2;
+    }
+    if (len) {
+        p->carry = data[0];
+        p->haveCarry = 1;
+    }
+}
+
+int pyramidFinish(struct pyramid *p)
+{
+    struct pyramid_header h = { PYRAMID_MAGIC, PYRAMID_FANOUT, PYRAMID_LEVELS, p->channels, p->samples };
+    char name[256];
+    FILE *f;
+    int k;
+
+    // the incomplete buckets, bottom up so each one reaches the level above
+    for (k=0; k<PYRAMID_LEVELS; k++) {
+        if (p->acc[k].n > 0)
+            emit(p, k);
+    }
+    for (k=0; k<PYRAMID_LEVELS; k++) {
+        if (p->files[k] && fclose(p->files[k]))
+            p->writeErrors++;
+        p->files[k] = NULL;
+    }
+    snprintf(name, sizeof name, "%s.pyr", p->prefix);
+    f = fopen(name, "wb");
+    if (!f || fwrite(&h, sizeof h, 1, f) != 1)
+        p->writeErrors++;
+    if (f && fclose(f))
+        p->writeErrors++;
+    return p->writeErrors ? -1 : 0;
+}
+
+static const void *map_file(const char *name, size_t *size)
+{
+    struct stat st;
+    void *m = NULL;
+    int fd;
+
+    *size = 0;
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+            m = NULL;
+        else
+            *size = st.st_size;
+    }
+    close(fd);
+    return m;
+}
+
+int pyramidOpen(struct pyramid_view *v, const char *prefix)
+{
+    struct pyramid_header h;
+    char name[256];
+    size_t size;
+    void *files;
+    FILE *f;
+    int k;
+
+    memset(v, 0, sizeof *v);
+    snprintf(name, sizeof name, "%s.pyr", prefix);
+    f = fopen(name, "rb");
+    if (!f)
+        return -1;
+    if (fread(&h, sizeof h, 1, f) != 1 || h.magic != PYRAMID_MAGIC
+            || h.fanout != PYRAMID_FANOUT || h.levels != PYRAMID_LEVELS) {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+    fclose(f);
+    v->samples = h.samples;
+    v->channels = h.channels ? h.channels : 0x01;
+    v->stride = stride_of(v->channels);
+
+    for (k=1; k<=PYRAMID_LEVELS; k++) {
+        snprintf(name, sizeof name, "%s.pyr%d", prefix, k);
+        v->levels[k] = (struct pyramid_entry *)map_file(name, &size);
+        v->entries[k] = size/sizeof(struct pyramid_entry);
+    }
+    for (;;) {
+        snprintf(name, sizeof name, "%s-%04d.bin", prefix, v->numFiles);
+        if (access(name, R_OK) < 0)
+            break;
+        files = realloc(v->files, (v->numFiles+1)*sizeof *v->files);
+        if (!files)
+            break;
+        v->files = files;
+        v->files[v->numFiles].map = map_file(name, &v->files[v->numFiles].size);
+        v->numFiles++;
+    }
+    return 0;
+}
+
+void pyramidClose(struct pyramid_view *v)
+{
+    int k;
+
+    for (k=1; k<=PYRAMID_LEVELS; k++) {
+        if (v->levels[k])
+            munmap(v->levels[k], v->entries[k]*sizeof(struct pyramid_entry));
+    }
+    for (k=0; k<v->numFiles; k++) {
+        if (v->files[k].map)
+            munmap((void *)v->files[k].map, v->files[k].size);
+    }
+    free(v->files);
+    memset(v, 0, sizeof *v);
+}
+
+/*
+ * Summarizes samples a to b-1 from the capture files, the first channel
+ * of every set of v->stride words.
+ */
+static void read_samples(struct pyramid_view *v, uint64_t a, uint64_t b, struct pyramid_entry *out)
+{
+    uint64_t off = 2*a*v->stride, end = 2*(b-1)*v->stride+2, base = 0, sum = 0, n = 0;
+    uint8_t lo = 0;
+    int f, haveLo = 0;
+    uint16_t s;
+
+    out->min = UINT16_MAX;
+    out->max = 0;
+    // a sample may be split between two files
+    for (f=0; f<v->numFiles && off < end; f++) {
+        const uint8_t *m = v->files[f].map;
+        uint64_t size = v->files[f].size;
+        for (; m && off < end && off < base+size; off++) {
+            // the other channels are skipped
+            if ((off/2)%v->stride)
+                continue;
+            if (!haveLo) {
+                lo = m[off-base];
+                haveLo = 1;
+                continue;
+            }
+            s = lo | m[off-base] << 8;
+            haveLo = 0;
+            out->min = s < out->min ? s : out->min;
+            out->max = s > out->max ? s : out->max;
+            sum += s;
+            n++;
+        }
+        base += size;
+    }
+    v->reads += n;
+    out->mean = n ? (float)((double)sum/n) : 0;
+}
+
+/*
+ * Combines the entries of level k covering samples a to b-1.
+ */
+static void read_entries(struct pyramid_view *v, int k, uint64_t a, uint64_t b,
+                         struct pyramid_entry *out)
+{
+    uint64_t bucket = 1ull << (4*k), i, last, n, total = 0;
+    const struct pyramid_entry *e = v->levels[k];
+    double sum = 0;
+
+    out->min = UINT16_MAX;
+    out->max = 0;
+    last = (b-1)/bucket;
+    if (last >= v->entries[k])
+        last = v->entries[k]-1;
+    for (i=a/bucket; i<=last; i++) {
+        n = (i+1)*bucket <= v->samples ? bucket : v->samples-i*bucket;
+        out->min = e[i].min < out->min ? e[i].min : out->min;
+        out->max = e[i].max > out->max ? e[i].max : out->max;
+        sum += (double)e[i].mean*n;
+        total += n;
+        v->reads++;
+    }
+    out->mean = total ? (float)(sum/total) : 0;
+}
+
+int pyramidQuery(struct pyramid_view *v, uint64_t first, uint64_t count, int width,
+                 struct pyramid_entry *out)
+{
+    uint64_t a, b;
+    int i, k = 0;
+
+    if (width < 1 || count < 1 || first+count > v->samples)
+        return -1;
+    // the coarsest level with buckets no longer than a column
+    while (k < PYRAMID_LEVELS && v->entries[k+1] > 0
+            && (1ull << (4*(k+1)))*(uint64_t)width <= count)
+        k++;
+    for (i=0; i<width; i++) {
+        a = first+(uint64_t)((double)count*i/width);
+        b = first+(uint64_t)((double)count*(i+1)/width);
+        if (b <= a)
+            b = a+1;
+        if (k == 0)
+            read_samples(v, a, b, &out[i]);
+        else
+            read_entries(v, k, a, b, &out[i]);
+    }
+    return k;
+}
+
+struct find_state {
+    uint16_t low, high;
+    void (*found)(uint64_t, uint64_t, uint16_t, uint16_t, void *);
+    void *arg;
+    uint64_t runs;
+    uint64_t first, count;      // the open run
+    uint16_t min, max;
+};
+
+static void close_run(struct find_state *s)
+{
+    if (s->count) {
+        s->found(s->first, s->count, s->min, s->max, s->arg);
+        s->runs++;
+        s->count = 0;
+    }
+}
+
+static void descend(struct pyramid_view *v, struct find_state *s, int k, uint64_t from, uint64_t to)
+{
+    const struct pyramid_entry *e;
+    uint64_t i, bucket = 1ull << (4*k);
+
+    if (to > v->entries[k])
+        to = v->entries[k];
+    for (i=from; i<to; i++) {
+        e = &v->levels[k][i];
+        v->reads++;
+        if (e->min >= s->low && e->max <= s->high) {
+            close_run(s);
+            continue;
+        }
+        if (k > 1) {
+            descend(v, s, k-1, i*PYRAMID_FANOUT, (i+1)*PYRAMID_FANOUT);
+            continue;
+        }
+        if (s->count && s->first+s->count == i*bucket) {
+            s->min = e->min < s->min ? e->min : s->min;
+            s->max = e->max > s->max ? e->max : s->max;
+        } else {
+            close_run(s);
+            s->first = i*bucket;
+            s->min = e->min;
+            s->max = e->max;
+        }
+        s->count = (i+1)*bucket <= v->samples ? (i+1)*bucket-s->first : v->samples-s->first;
+    }
+}
+
+uint64_t pyramidFind(struct pyramid_view *v, uint16_t low, uint16_t high,
+                     void (*found)(uint64_t first, uint64_t count, uint16_t min, uint16_t max, void *arg),
+                     void *arg)
+{
+    struct find_state s = { low, high, found, arg, 0, 0, 0, 0, 0 };
+    int top = PYRAMID_LEVELS;
+
+    while (top > 1 && v->entries[top] == 0)
+        top--;
+    if (v->entries[top] == 0)
+        return 0;
+    descend(v, &s, top, 0, v->entries[top]);
+    close_run(&s);
+    return s.runs;
+}
@@ -0,0 +1,117 @@
+#ifndef PYRAMID_H_INCLUDED
+#define PYRAMID_H_INCLUDED
+
+/*
+ * Min/max/mean pyramid of a capture of 16 bit samples (e.g. ADC/main.c)
+ * Level k summarizes the samples in buckets of PYRAMID_FANOUT^k, level 0
+ * are the samples in the capture files themselves. Every level is a file
+ * <prefix>.pyrK of struct pyramid_entry, appended while the capture runs,
+ * entry i covering the samples i*FANOUT^k up to (i+1)*FANOUT^k-1.
+ * <prefix>.pyr holds the header, it is written when the capture ends.
+ *
+ * An overview of any range in any width is read from the coarsest level
+ * whose buckets are still smaller than one column, so it costs at most
+ * about width*PYRAMID_FANOUT entries, however long the capture is.
+ * Excursions beyond limits are found by descending only into the buckets
+ * whose min or max crosses them.
+ *
+ * The sample index is the time axis. Buffers dropped during the capture
+ * are missing from the files and the pyramid alike, see capture.h.
+ *
+ * A stream of several interleaved channels (ctrl_params::channels of
+ * simple/control.h) only has the first selected channel summarized, by
+ * default the input of ADC/main.c. The header records the channel set,
+ * so level 0 is read with the same stride. The set must not change while
+ * the capture runs, and a dropped buffer shifts the channels after it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PYRAMID_FANOUT  16
+#define PYRAMID_LEVELS  8           /* level 8: 2^32 samples per entry */
+#define PYRAMID_MAGIC   0x31525950  /* "PYR1" */
+
+struct pyramid_entry {
+    uint16_t min, max;
+    float mean;
+};
+
+struct pyramid_header {
+    uint32_t magic;
+    uint32_t fanout;
+    uint32_t levels;
+    uint32_t channels;              // channel set of the stream, 0 in older files means 0x01
+    uint64_t samples;               // of the first channel
+};
+
+/*
+ * Builder, fed with the stream in any portions.
+ */
+struct pyramid {
+    char prefix[200];
+    FILE *files[PYRAMID_LEVELS];    // level k in files[k-1]
+    struct {
+        uint16_t min, max;
+        uint64_t sum;
+        uint64_t n;                 // samples in the bucket so far
+        uint32_t children;          // entries of the level below
+    } acc[PYRAMID_LEVELS];
+    uint64_t samples;
+    uint32_t channels;
+    unsigned stride;                // words per set of channels
+    unsigned word;                  // position of the next word in the set
+    uint8_t carry;                  // low byte of a sample split between two portions
+    int haveCarry;
+    uint64_t writeErrors;
+};
+
+/*
+ * channels is the channel set of the stream, 0x01 for a single channel.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int pyramidCreate(struct pyramid *p, const char *prefix, uint32_t channels);
+void pyramidAdd(struct pyramid *p, const uint8_t *data, size_t len);
+
+/*
+ * Writes the incomplete buckets and the header and closes the files.
+ */
+int pyramidFinish(struct pyramid *p);
+
+/*
+ * Reader. Level 0 is read from the capture files when the range is too
+ * short for level 1.
+ */
+struct pyramid_view {
+    uint64_t samples;
+    uint32_t channels;
+    unsigned stride;                // words per set of channels in the capture files
+    struct pyramid_entry *levels[PYRAMID_LEVELS+1];  // mapped, [0] unused
+    uint64_t entries[PYRAMID_LEVELS+1];
+    int numFiles;                   // capture files, level 0
+    struct { const uint8_t *map; size_t size; } *files;
+    uint64_t reads;                 // entries and samples read by queries
+};
+
+int pyramidOpen(struct pyramid_view *v, const char *prefix);
+void pyramidClose(struct pyramid_view *v);
+
+/*
+ * Summarizes count samples from first in width columns, out[i] covers
+ * the samples first+i*count/width up to first+(i+1)*count/width-1.
+ * Returns the level used, -1 on a range outside the capture.
+ */
+int pyramidQuery(struct pyramid_view *v, uint64_t first, uint64_t count, int width,
+                 struct pyramid_entry *out);
+
+/*
+ * Calls found for every run of at least one level 1 bucket (PYRAMID_FANOUT
+ * samples) with a sample below low or above high, in order.
+ * Returns the number of runs.
+ */
+uint64_t pyramidFind(struct pyramid_view *v, uint16_t low, uint16_t high,
+                     void (*found)(uint64_t first, uint64_t count, uint16_t min, uint16_t max, void *arg),
+                     void *arg);
+
+#endif // PYRAMID_H_INCLUDED
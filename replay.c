@@ -0,0 +1,274 @@
+/*
+ * Replay of a capture in place of the device, see replay.h
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "timing.h"
+
+/*
+ * Maps one file, read only. The pages are read in right away, so the
+ * replay measures the processing and not the disk.
+ */
+static int map_file(struct replay_file *f, const char *name)
+{
+    struct stat st;
+    int fd, err;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    f->size = st.st_size;
+    f->map = NULL;
+    if (f->size > 0) {
+        f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+        if (f->map == MAP_FAILED)
+            goto fail;
+        madvise(f->map, f->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+static int add_file(struct replay *r, const char *name)
+{
+    struct replay_file *files;
+
+    files = realloc(r->files, (r->numFiles+1)*sizeof *files);
+    if (!files)
+        return -1;
+    r->files = files;
+    if (map_file(&r->files[r->numFiles], name) < 0)
+        return -1;
+    r->numFiles++;
+    return 0;
+}
+
+static int read_index(struct replay *r, const char *name)
+{
+    FILE *f;
+    long size;
+
+    f = fopen(name, "rb");
+    if (!f)
+        return -1;
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+        goto fail;
+    r->numMarks = size/sizeof(struct capture_mark);
+    r->marks = calloc(r->numMarks+1, sizeof *r->marks);
+    if (!r->marks || fread(r->marks, sizeof *r->marks, r->numMarks, f) != r->numMarks)
+        goto fail;
+    fclose(f);
+    return 0;
+
+fail:
+    fclose(f);
+    free(r->marks);
+    r->marks = NULL;
+    errno = EIO;
+    return -1;
+}
+
+int replayOpen(struct replay *r, const char *prefix, double speed)
+{
+    char name[256];
+    uint64_t indexed = 0, stored = 0;
+    size_t i;
+
+    memset(r, 0, sizeof *r);
+    r->speed = speed;
+    atomic_init(&r->cancel, 0);
+
+    for (;;) {
+        snprintf(name, sizeof name, "%s-%04d.bin", prefix, r->numFiles);
+        if (add_file(r, name) < 0)
+            break;
+    }
+    if (r->numFiles == 0 && add_file(r, prefix) < 0) {
+        fprintf(stderr, "replay: %s: %s\n", prefix, strerror(errno));
+        replayClose(r);
+        return -1;
+    }
+    for (i=0; i<(size_t)r->numFiles; i++)
+        stored += r->files[i].size;
+
+    snprintf(name, sizeof name, "%s.idx", prefix);
+    if (read_index(r, name) == 0) {
+        for (i=0; i<r->numMarks; i++) {
+            if (!r->marks[i].dropped)
+                indexed += r->marks[i].len;
+        }
+        if (indexed != stored)
+            fprintf(stderr, "replay: %s indexes %llu bytes, the files hold %llu\n", name,
+                (unsigned long long)indexed, (unsigned long long)stored);
+        r->markLeft = r->numMarks ? r->marks[0].len : 0;
+    } else if (speed > 0) {
+        fprintf(stderr, "replay: %s is needed for the timing\n", name);
+        replayClose(r);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int replaySubmit(struct replay *r, struct libusb_transfer *t)
+{
+    if (r->tail-r->head == REPLAY_QUEUE)
+        return LIBUSB_ERROR_BUSY;
+    r->queue[r->tail++ % REPLAY_QUEUE] = t;
+    return 0;
+}
+
+void replayCancel(struct replay *r)
+{
+    atomic_store(&r->cancel, 1);
+}
+
+/*
+ * Copies up to len bytes from the read position, across files.
+ */
+static size_t read_data(struct replay *r, uint8_t *buf, size_t len)
+{
+    size_t done = 0, n;
+
+    while (done < len && r->file < r->numFiles) {
+        n = r->files[r->file].size-r->pos;
+        if (n > len-done)
+            n = len-done;
+        memcpy(buf+done, r->files[r->file].map+r->pos, n);
+        done += n;
+        r->pos += n;
+        if (r->pos == r->files[r->file].size) {
+            r->file++;
+            r->pos = 0;
+        }
+    }
+    return done;
+}
+
+/*
+ * Sleeps until the recorded time of the current mark.
+ * Returns -1 if cancelled meanwhile.
+ */
+static int wait_for_mark(struct replay *r)
+{
+    uint64_t due, now, n;
+    struct timespec ts;
+
+    due = r->start+(uint64_t)((r->marks[r->mark].t-r->marks[0].t)/r->speed);
+    for (;;) {
+        now = now_ns();
+        if (now >= due)
+            break;
+        if (atomic_load(&r->cancel))
+            return -1;
+        // short enough to notice a cancel
+        n = due-now < 100*NS_PER_MS ? due-now : 100*NS_PER_MS;
+        ts.tv_sec = n/NS_PER_SEC;
+        ts.tv_nsec = n%NS_PER_SEC;
+        nanosleep(&ts, NULL);
+    }
+    if (now-due > r->maxLate)
+        r->maxLate = now-due;
+    return 0;
+}
+
+int replayEvents(struct replay *r)
+{
+    struct libusb_transfer *t;
+    size_t len;
+
+    if (atomic_exchange(&r->cancel, 0)) {
+        while (r->head != r->tail) {
+            t = r->queue[r->head++ % REPLAY_QUEUE];
+            t->actual_length = 0;
+            t->status = LIBUSB_TRANSFER_CANCELLED;
+            t->callback(t);
+        }
+        return 0;
+    }
+
+    if (r->marks) {
+        while (r->mark < r->numMarks && (r->marks[r->mark].dropped || r->markLeft == 0)) {
+            if (r->marks[r->mark].dropped)
+                r->skipped++;
+            if (++r->mark < r->numMarks)
+                r->markLeft = r->marks[r->mark].len;
+        }
+        if (r->mark == r->numMarks)
+            return REPLAY_END;
+    }
+    if (r->file == r->numFiles)
+        return REPLAY_END;
+    if (r->head == r->tail)
+        return 0;
+
+    if (!r->start)
+        r->start = now_ns();
+    if (r->marks && r->speed > 0 && wait_for_mark(r) < 0)
+        return 0;
+
+    t = r->queue[r->head++ % REPLAY_QUEUE];
+    len = t->length;
+    if (r->marks && r->markLeft < len)
+        len = r->markLeft;
+    len = read_data(r, t->buffer, len);
+    if (r->marks)
+        r->markLeft -= len;
+    t->actual_length = len;
+    t->status = LIBUSB_TRANSFER_COMPLETED;
+    r->bytes += len;
+    r->transfers++;
+    r->last = now_ns();
+    if (!r->first)
+        r->first = r->last;
+    t->callback(t);
+    return 0;
+}
+
+void replayClose(struct replay *r)
+{
+    int i;
+
+    for (i=0; i<r->numFiles; i++) {
+        if (r->files[i].map)
+            munmap(r->files[i].map, r->files[i].size);
+    }
+    free(r->files);
+    free(r->marks);
+    r->files = NULL;
+    r->marks = NULL;
+    r->numFiles = 0;
+}
+
+void replayPrint(FILE *f, const struct replay *r)
+{
+    double s = (r->last-r->first)/(double)NS_PER_SEC;
+
+    fprintf(f, "replay: %llu bytes in %llu transfers from %d file%s, %.1f MB/s",
+        (unsigned long long)r->bytes, (unsigned long long)r->transfers, r->numFiles,
+        r->numFiles == 1 ? "" : "s", s > 0 ? r->bytes/s/1e6 : 0.0);
+    if (r->marks && r->speed > 0)
+        fprintf(f, ", paced x%g, completions up to %.3f ms late", r->speed,
+            r->maxLate/(double)NS_PER_MS);
+    fprintf(f, "\n");
+    if (r->skipped)
+        fprintf(f, "replay: %llu buffers were dropped during the capture and are missing\n",
+            (unsigned long long)r->skipped);
+}
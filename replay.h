@@ -0,0 +1,86 @@
+#ifndef REPLAY_H_INCLUDED
+#define REPLAY_H_INCLUDED
+
+/*
+ * Replay of a capture (see capture.h) in place of the device
+ * The capture files are mapped and the submitted IN transfers are completed
+ * from them exactly like libusb would: the data is copied into the transfer
+ * buffer, actual_length and status are set and the transfer callback is
+ * called, in submission order. So the whole cb_in path of async.c runs
+ * unchanged on recorded data.
+ * With the index <prefix>.idx every transfer gets the length of the
+ * recorded one, and with a speed > 0 it completes at the recorded time
+ * (divided by speed). Buffers that were dropped during the capture are
+ * skipped. Speed 0 replays as fast as the callbacks allow. Without an index
+ * the transfers are filled to their full length and speed must be 0.
+ * A single raw file can be replayed too, prefix is then the file name.
+ *
+ * replaySubmit and replayEvents must be called from the same thread,
+ * replayCancel from any thread.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <libusb-1.0/libusb.h>
+
+#include "capture.h"
+
+#define REPLAY_QUEUE    256     /* max. submitted transfers, power of 2 */
+#define REPLAY_END      1       /* replayEvents: no data left */
+
+struct replay_file {
+    uint8_t *map;
+    size_t size;
+};
+
+struct replay {
+    struct replay_file *files;
+    int numFiles;
+    int file;                   // read position: file and offset in it
+    size_t pos;
+    struct capture_mark *marks; // NULL without index
+    size_t numMarks;
+    size_t mark;                // next mark to replay
+    uint32_t markLeft;          // bytes of marks[mark] not replayed yet
+    double speed;               // 0: as fast as possible
+    uint64_t start;             // replay start, for pacing
+    struct libusb_transfer *queue[REPLAY_QUEUE];
+    unsigned int head, tail;
+    _Atomic int cancel;
+
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t skipped;           // marks of buffers dropped during the capture
+    uint64_t maxLate;           // paced: worst delay of a completion in ns
+    uint64_t first, last;       // time of the first and the last completion
+};
+
+/*
+ * Maps the capture. Returns 0 on success, -1 with errno set otherwise.
+ */
+int replayOpen(struct replay *r, const char *prefix, double speed);
+
+/*
+ * Queues a transfer like libusb_submit_transfer.
+ */
+int replaySubmit(struct replay *r, struct libusb_transfer *t);
+
+/*
+ * Completes the queued transfers with LIBUSB_TRANSFER_CANCELLED at the
+ * next replayEvents.
+ */
+void replayCancel(struct replay *r);
+
+/*
+ * Completes the next transfer, waiting for its time when paced. Returns
+ * REPLAY_END when all data was replayed, 0 otherwise.
+ */
+int replayEvents(struct replay *r);
+
+void replayClose(struct replay *r);
+
+void replayPrint(FILE *f, const struct replay *r);
+
+#endif // REPLAY_H_INCLUDED
@@ -0,0 +1,143 @@
+#ifndef RT_H_INCLUDED
+#define RT_H_INCLUDED
+
+/*
+ * Real-time controls for the thread that handles the USB events (Linux)
+ * Completion jitter is mostly the scheduler and the CPU idle states, these
+ * are the knobs for it:
+ *   cpu         pin the calling thread to this core
+ *   fifo        run it under SCHED_FIFO at this priority (1..99)
+ *   lock        mlockall, no page faults on buffers or stacks
+ *   dmaLatency  hold a PM QoS request on /dev/cpu_dma_latency, the CPUs
+ *               don't enter idle states that take longer to leave (in us,
+ *               0 keeps them in C0)
+ * SCHED_FIFO, mlockall and the QoS request usually need root or
+ * CAP_SYS_NICE/CAP_IPC_LOCK. What can't be applied is reported and left
+ * out, rt_restore undoes what was applied.
+ * Needs _GNU_SOURCE for the affinity calls.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+struct rt_settings {
+    int cpu;                    // -1: not pinned
+    int fifo;                   // 0: normal scheduling
+    int lock;
+    int dmaLatency;             // us, -1: no request
+};
+
+struct rt_state {
+    int pinned, scheduled, locked;
+    int qosFd;                  // the request holds while this is open
+    cpu_set_t cpus;             // affinity before rt_apply
+    int policy;
+    struct sched_param param;
+};
+
+#define RT_SETTINGS_NONE { -1, 0, 0, -1 }
+
+/*
+ * Applies s to the calling thread. Returns the number of settings that
+ * could not be applied.
+ */
+static inline int rt_apply(const struct rt_settings *s, struct rt_state *st)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int32_t value;
+    int err, failed = 0;
+
+    memset(st, 0, sizeof *st);
+    st->qosFd = -1;
+    if (s->cpu >= 0) {
+        pthread_getaffinity_np(pthread_self(), sizeof st->cpus, &st->cpus);
+        CPU_ZERO(&cpus);
+        CPU_SET(s->cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+        if (err) {
+            fprintf(stderr, "could not pin to cpu %d: %s\n", s->cpu, strerror(err));
+            failed++;
+        } else {
+            st->pinned = 1;
+        }
+    }
+    if (s->fifo > 0) {
+        pthread_getschedparam(pthread_self(), &st->policy, &st->param);
+        memset(&param, 0, sizeof param);
+        param.sched_priority = s->fifo;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+            fprintf(stderr, "could not set SCHED_FIFO %d: %s\n", s->fifo, strerror(err));
+            failed++;
+        } else {
+            st->scheduled = 1;
+        }
+    }
+    if (s->lock) {
+        if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+            fprintf(stderr, "could not lock the memory: %s\n", strerror(errno));
+            failed++;
+        } else {
+            st->locked = 1;
+        }
+    }
+    if (s->dmaLatency >= 0) {
+        // the kernel takes a binary int32, the request ends on close
+        value = s->dmaLatency;
+        st->qosFd = open("/dev/cpu_dma_latency", O_WRONLY|O_CLOEXEC);
+        if (st->qosFd < 0 || write(st->qosFd, &value, sizeof value) != sizeof value) {
+            fprintf(stderr, "could not request %d us cpu_dma_latency: %s\n", s->dmaLatency,
+                strerror(errno));
+            if (st->qosFd >= 0)
+                close(st->qosFd);
+            st->qosFd = -1;
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static inline void rt_restore(struct rt_state *st)
+{
+    if (st->qosFd >= 0)
+        close(st->qosFd);
+    if (st->locked)
+        munlockall();
+    if (st->scheduled)
+        pthread_setschedparam(pthread_self(), st->policy, &st->param);
+    if (st->pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof st->cpus, &st->cpus);
+    memset(st, 0, sizeof *st);
+    st->qosFd = -1;
+}
+
+/*
+ * Short description of s, e.g. "cpu 2, fifo 80, mlockall, dma 0us".
+ */
+static inline const char *rt_describe(const struct rt_settings *s, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    buf[0] = 0;
+    if (s->cpu >= 0)
+        n += snprintf(buf+n, len-n, "%scpu %d", n ? ", " : "", s->cpu);
+    if (s->fifo > 0 && n < len)
+        n += snprintf(buf+n, len-n, "%sfifo %d", n ? ", " : "", s->fifo);
+    if (s->lock && n < len)
+        n += snprintf(buf+n, len-n, "%smlockall", n ? ", " : "");
+    if (s->dmaLatency >= 0 && n < len)
+        n += snprintf(buf+n, len-n, "%sdma %dus", n ? ", " : "", s->dmaLatency);
+    if (!n)
+        snprintf(buf, len, "none");
+    return buf;
+}
+
+#endif // RT_H_INCLUDED
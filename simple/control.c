@@ -0,0 +1,74 @@
+#include <string.h>
+
+#include "control.h"
+
+#define CTRL_TYPE_MASK      0x60        /* bmRequestType: type */
+#define CTRL_TYPE_VENDOR    0x40
+#define CTRL_RECIP_MASK     0x1F        /* bmRequestType: recipient */
+#define CTRL_RECIP_IFACE    0x01
+#define CTRL_DIR_IN         0x80
+
+void controlInit(struct control_state *s, const struct ctrl_caps *caps,
+                 const struct ctrl_params *params){
+    memset(s, 0, sizeof *s);
+    s->caps = *caps;
+    s->caps.version = CTRL_VERSION;
+    s->params = *params;
+    s->running = 1;
+}
+
+static int sendIn(const void *data, size_t size, uint16_t wLength, uint8_t **buf){
+    *buf = (uint8_t *)data;
+    return size < wLength ? (int)size : wLength;
+}
+
+int controlSetup(struct control_state *s, const uint8_t *setup, uint8_t **buf){
+    uint8_t type = setup[0];
+    uint16_t wIndex = setup[4] | setup[5]<<8;
+    uint16_t wLength = setup[6] | setup[7]<<8;
+    int in = type & CTRL_DIR_IN;
+
+    *buf = NULL;
+    if((type & CTRL_TYPE_MASK) != CTRL_TYPE_VENDOR
+            || (type & CTRL_RECIP_MASK) != CTRL_RECIP_IFACE || wIndex != 0)
+        return -1;
+
+    switch(setup[1]){
+    case CTRL_GET_CAPS:
+        return in ? sendIn(&s->caps, sizeof s->caps, wLength, buf) : -1;
+    case CTRL_GET_PARAMS:
+        // parameters that are set but not applied yet are read back as well
+        return in ? sendIn(s->changed ? &s->next : &s->params, sizeof s->params, wLength, buf) : -1;
+    case CTRL_GET_COUNTERS:
+        return in ? sendIn(&s->counters, sizeof s->counters, wLength, buf) : -1;
+    case CTRL_SET_PARAMS:
+        if(in || wLength != sizeof s->rx)
+            return -1;
+        *buf = (uint8_t *)&s->rx;
+        return wLength;
+    case CTRL_START:
+    case CTRL_STOP:
+        if(in || wLength)
+            return -1;
+        s->running = setup[1] == CTRL_START;
+        return 0;
+    }
+    return -1;
+}
+
+int controlReceived(struct control_state *s, uint8_t request){
+    if(request != CTRL_SET_PARAMS || !controlValid(&s->caps, &s->rx))
+        return -1;
+    s->next = s->rx;
+    s->next.reserved = 0;
+    s->changed = 1;
+    return 0;
+}
+
+int controlApply(struct control_state *s){
+    if(!s->changed)
+        return 0;
+    s->params = s->next;
+    s->changed = 0;
+    return 1;
+}
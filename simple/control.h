@@ -0,0 +1,120 @@
+#ifndef CONTROL_H_INCLUDED
+#define CONTROL_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Vendor control requests on EP0
+ * Configure and control the stream without reflashing and without
+ * touching the data endpoints. Every request goes to interface 0:
+ *   bmRequestType 0xC1 (IN) or 0x41 (OUT), wIndex 0, wValue 0
+ *   CTRL_GET_CAPS      IN   struct ctrl_caps
+ *   CTRL_GET_PARAMS    IN   struct ctrl_params
+ *   CTRL_SET_PARAMS    OUT  struct ctrl_params, wLength must match
+ *   CTRL_START         -    EP1 streams (the default after reset)
+ *   CTRL_STOP          -    EP1 stops after the current transfer
+ *   CTRL_GET_COUNTERS  IN   struct ctrl_counters
+ * An IN request returns at most wLength bytes, so a host built for an
+ * older, shorter structure still works. Unknown requests are stalled.
+ * CTRL_VERSION changes its high byte when a structure or request changes
+ * incompatibly, fields are only ever appended within one major version.
+ * New parameters are applied between two transfers. The status stage of
+ * CTRL_SET_PARAMS can't be stalled any more, parameters outside of the
+ * capabilities are ignored instead; read them back to check.
+ * All fields are little endian.
+ *
+ * This file does not depend on ChibiOS, so the same code runs in the
+ * firmware, in the device emulator and on the host (usbhost.h).
+ */
+
+#define CTRL_VERSION        0x0100      /* major.minor */
+
+#define CTRL_GET_CAPS       0x01
+#define CTRL_GET_PARAMS     0x02
+#define CTRL_SET_PARAMS     0x03
+#define CTRL_START          0x04
+#define CTRL_STOP           0x05
+#define CTRL_GET_COUNTERS   0x06
+
+/*
+ * Sample formats of the IN stream, the first three are the test patterns
+ * of pattern.h.
+ */
+#define CTRL_FORMAT_ALPHABET    0
+#define CTRL_FORMAT_COUNTER     1
+#define CTRL_FORMAT_PRBS31      2
+#define CTRL_FORMAT_U16         3       /* 16 bit ADC words */
+
+struct ctrl_caps {
+    uint16_t version;           // CTRL_VERSION of the device
+    uint16_t formats;           // bit n set if CTRL_FORMAT n is supported
+    uint16_t maxTransferSize;   // bytes
+    uint16_t transferGranule;   // the transfer size is a multiple of it
+    uint16_t maxDecimation;
+    uint8_t channels;           // bit n set if channel n exists
+    uint8_t reserved;
+};
+
+struct ctrl_params {
+    uint16_t transferSize;      // bytes per IN transfer
+    uint8_t format;             // CTRL_FORMAT_*
+    uint8_t channels;           // channel set, interleaved in bit order
+    uint16_t decimation;        // every n-th sample is sent
+    uint16_t reserved;
+};
+
+struct ctrl_counters {
+    uint32_t inTransfers;       // IN transfers completed since reset
+    uint32_t inBytes;           // wraps at 2^32
+    uint32_t overflows;         // samples lost because EP1 was too slow
+    uint32_t outBytes;          // received on EP2
+};
+
+struct control_state {
+    struct ctrl_caps caps;
+    struct ctrl_params params;
+    struct ctrl_counters counters;
+    volatile uint8_t running;   // EP1 streams
+    volatile uint8_t changed;   // next is waiting for controlApply
+    struct ctrl_params next;    // accepted by CTRL_SET_PARAMS, not applied yet
+    struct ctrl_params rx;      // data stage of CTRL_SET_PARAMS
+};
+
+/*
+ * Returns 1 if p is within caps.
+ */
+static inline int controlValid(const struct ctrl_caps *caps, const struct ctrl_params *p){
+    return p->transferSize >= caps->transferGranule && p->transferSize <= caps->maxTransferSize
+        && p->transferSize%caps->transferGranule == 0
+        && p->format < 16 && (caps->formats>>p->format & 1)
+        && p->channels && !(p->channels & ~caps->channels)
+        && p->decimation >= 1 && p->decimation <= caps->maxDecimation;
+}
+
+void controlInit(struct control_state *s, const struct ctrl_caps *caps,
+                 const struct ctrl_params *params);
+
+/*
+ * Handles the 8 byte setup packet of a vendor request.
+ * Returns the length of the data stage and sets *buf to the data to send
+ * (IN) or to the buffer to receive into (OUT), then call controlReceived
+ * once the data arrived. Returns -1 if the request is to be stalled.
+ * CTRL_START and CTRL_STOP only set running, the caller starts EP1.
+ */
+int controlSetup(struct control_state *s, const uint8_t *setup, uint8_t **buf);
+
+/*
+ * Takes the data stage of an OUT request. Returns 0 if it was accepted,
+ * -1 if it was ignored. Accepted parameters only go to params with
+ * controlApply, until then CTRL_GET_PARAMS already returns them.
+ */
+int controlReceived(struct control_state *s, uint8_t request);
+
+/*
+ * Called by the stream between two transfers, not concurrently with
+ * controlReceived. Returns 1 if new parameters were copied to params.
+ */
+int controlApply(struct control_state *s);
+
+#endif // CONTROL_H_INCLUDED
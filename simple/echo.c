@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "echo.h"
+
+void echoInit(struct echo_state *s){
+    s->seq = 0;
+}
+
+size_t echoReply(struct echo_state *s, const uint8_t *in, size_t n,
+                 uint8_t *out, size_t outSize){
+    if (n > ECHO_MAX || outSize < ECHO_HEADER+n)
+        return 0;
+    out[0] = s->seq;
+    out[1] = s->seq>>8;
+    out[2] = s->seq>>16;
+    out[3] = s->seq>>24;
+    memcpy(out+ECHO_HEADER, in, n);
+    s->seq++;
+    return ECHO_HEADER+n;
+}
+
+int echoCheck(const uint8_t *reply, size_t replyLen,
+              const uint8_t *payload, size_t n, uint32_t *seq){
+    if (replyLen != ECHO_HEADER+n)
+        return -1;
+    *seq = reply[0] | reply[1]<<8 | reply[2]<<16 | (uint32_t)reply[3]<<24;
+    return memcmp(reply+ECHO_HEADER, payload, n) ? -1 : 0;
+}
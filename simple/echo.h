@@ -0,0 +1,44 @@
+#ifndef ECHO_H_INCLUDED
+#define ECHO_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Echo mode protocol
+ * Every OUT transfer the host sends on EP2 (1..ECHO_MAX bytes, terminated
+ * by a short packet, a zero length packet or by reaching ECHO_MAX bytes)
+ * is returned on EP1 as one IN transfer:
+ *   4 byte sequence number, little endian, counting from 0 after reset
+ *   the received payload, unchanged
+ * The host knows the payload size and reads exactly ECHO_HEADER+n bytes.
+ *
+ * This file does not depend on ChibiOS, so the same code runs in the
+ * firmware, in the device emulator and in host side checks.
+ */
+
+#define ECHO_MAX     4096       /* largest payload of one echo */
+#define ECHO_HEADER  4          /* size of the sequence number */
+
+struct echo_state {
+    uint32_t seq;               // sequence number of the next reply
+};
+
+void echoInit(struct echo_state *s);
+
+/*
+ * Builds the reply to one received OUT transfer of n bytes in out.
+ * Returns the length of the reply, 0 if out is too small.
+ */
+size_t echoReply(struct echo_state *s, const uint8_t *in, size_t n,
+                 uint8_t *out, size_t outSize);
+
+/*
+ * Host side check of a reply to a payload of n bytes.
+ * Returns 0 if the reply carries the payload, -1 otherwise.
+ * *seq is set to the sequence number of the reply.
+ */
+int echoCheck(const uint8_t *reply, size_t replyLen,
+              const uint8_t *payload, size_t n, uint32_t *seq);
+
+#endif // ECHO_H_INCLUDED
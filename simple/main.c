@@ -7,15 +7,105 @@
 #include "hal.h"
 
 #include "usbdescriptor.h"
+#include "echo.h"
+#include "pattern.h"
+#include "control.h"
+
+/*
+ * Operating modes
+ *   MODE_STREAM  EP1 streams transferBuf continuously,
+ *                EP2 receives LED commands
+ *   MODE_ECHO    every OUT transfer on EP2 is returned on EP1 with a
+ *                sequence number, see echo.h
+ *   MODE_SINK    EP1 streams like MODE_STREAM, EP2 accepts continuous
+ *                OUT transfers and discards the data (full-duplex tests)
+ * Select the mode at build time with e.g.
+ *   make UDEFS=-DDEFAULT_MODE=MODE_ECHO
+ */
+#define MODE_STREAM 0
+#define MODE_ECHO   1
+#define MODE_SINK   2
+#ifndef DEFAULT_MODE
+#define DEFAULT_MODE MODE_STREAM
+#endif
+uint8_t mode = DEFAULT_MODE;
 
 uint8_t receiveBuf[OUT_PACKETSIZE];
 #define IN_MULT 4
 uint8_t transferBuf[IN_PACKETSIZE*IN_MULT];
 
+/*
+ * Test pattern of the IN stream in MODE_STREAM and MODE_SINK, see pattern.h
+ * Select it at build time with e.g.
+ *   make UDEFS=-DDEFAULT_PATTERN=PATTERN_PRBS31
+ * or at runtime with the commands 'a', 'c' and 'p' on EP2, which restart
+ * the alphabet, counter or PRBS-31 pattern at block 0.
+ */
+#ifndef DEFAULT_PATTERN
+#define DEFAULT_PATTERN PATTERN_ALPHABET
+#endif
+struct pattern_state pattern;
+volatile int8_t requestedPattern = -1;
+
+/*
+ * Vendor control requests on EP0, see control.h
+ * They select the pattern and the transfer size, start and stop EP1 and
+ * read the counters. The pattern is restarted whenever parameters are set.
+ */
+static const struct ctrl_caps caps = {
+    CTRL_VERSION,
+    1<<CTRL_FORMAT_ALPHABET | 1<<CTRL_FORMAT_COUNTER | 1<<CTRL_FORMAT_PRBS31,
+    sizeof transferBuf,         //largest transfer
+    PATTERN_BLOCK,              //the patterns are made of whole blocks
+    1,                          //no decimation
+    0x01,                       //one channel
+    0
+};
+struct control_state ctrl;
+uint16_t transferSize = sizeof transferBuf;
+volatile uint8_t transmitting = 0;
+
+struct echo_state echo;
+uint8_t echoRxBuf[ECHO_MAX];
+uint8_t echoTxBuf[ECHO_HEADER+ECHO_MAX];
+
+// sink mode receives many packets per transfer to keep the interrupt rate low
+#define SINK_LEN (OUT_PACKETSIZE*16)
+uint8_t sinkBuf[SINK_LEN];
+volatile uint32_t sinkBytes = 0;
+
 USBDriver *  	usbp = &USBD1;
 uint8_t initUSB=0;
 uint8_t usbStatus = 0;
 
+/*
+ * Sends the next transfer of the stream
+ * called from the USB interrupt
+ */
+static void streamNext(USBDriver *usbp){
+    // new parameters and a new pattern only take effect between two transfers
+    if(controlApply(&ctrl)){
+        transferSize = ctrl.params.transferSize;
+        requestedPattern = ctrl.params.format;
+    }
+    if(requestedPattern >= 0){
+        patternInit(&pattern, requestedPattern);
+        patternFill(&pattern, transferBuf, transferSize);
+        ctrl.params.format = requestedPattern;
+        requestedPattern = -1;
+    }
+    // the alphabet is the same in every full size transfer, the others continue
+    else if(pattern.type != PATTERN_ALPHABET || transferSize != sizeof transferBuf)
+        patternFill(&pattern, transferBuf, transferSize);
+
+    // Since this is a benchmarking example, the next transfer is emitted immediately
+    usbPrepareTransmit(usbp, EP_IN, transferBuf, transferSize);
+
+    chSysLockFromIsr();
+    usbStartTransmitI(usbp, EP_IN);
+    chSysUnlockFromIsr();
+}
+
 /*
  * data Transmitted Callback
  */
@@ -25,16 +115,28 @@ void dataTransmitted(USBDriver *usbp, usbep_t ep){
     //Toggle a status LED (toggles up to 1000x per second)
     palTogglePad(GPIOD, GPIOD_LED3);
 
+    ctrl.counters.inTransfers++;
+    ctrl.counters.inBytes += usbp->epc[ep]->in_state->txsize;
+
     // exit on USB reset
     if(!usbStatus) return;
 
-    // Since this is a benchmarking example, the next transfer is emitted immediately
-    usbPrepareTransmit(usbp, EP_IN, transferBuf, sizeof transferBuf);
+    // in echo mode the next request is accepted once the reply is sent
+    if(mode == MODE_ECHO){
+        usbPrepareReceive(usbp, EP_OUT, echoRxBuf, sizeof echoRxBuf);
 
-    chSysLockFromIsr();
-    usbStartTransmitI(usbp, EP_IN);
-    chSysUnlockFromIsr();
+        chSysLockFromIsr();
+        usbStartReceiveI(usbp, EP_OUT);
+        chSysUnlockFromIsr();
+        return;
+    }
 
+    // stopped with CTRL_STOP, CTRL_START sends the next transfer
+    if(!ctrl.running){
+        transmitting = 0;
+        return;
+    }
+    streamNext(usbp);
 }
 
 /**
@@ -60,14 +162,40 @@ static const USBEndpointConfig ep1config = {
 
 /*
  * data Received Callback
- * It toggles an LED based on the first received character.
+ * It toggles an LED or selects the test pattern based on the first
+ * received character.
+ * In echo mode it returns the received data instead.
  */
 void dataReceived(USBDriver *usbp, usbep_t ep){
     USBOutEndpointState *osp = usbp->epc[ep]->out_state;
+    size_t n;
     (void) usbp;
     (void) ep;
     // exit on USB reset
     if(!usbStatus) return;
+    ctrl.counters.outBytes += osp->rxcnt;
+
+    if(mode == MODE_ECHO){
+        n = echoReply(&echo, echoRxBuf, osp->rxcnt, echoTxBuf, sizeof echoTxBuf);
+        usbPrepareTransmit(usbp, EP_IN, echoTxBuf, n);
+
+        chSysLockFromIsr();
+        usbStartTransmitI(usbp, EP_IN);
+        chSysUnlockFromIsr();
+        // the next receive is started by dataTransmitted
+        return;
+    }
+
+    if(mode == MODE_SINK){
+        // discard the data and receive the next transfer right away
+        sinkBytes += osp->rxcnt;
+        usbPrepareReceive(usbp, EP_OUT, sinkBuf, SINK_LEN);
+
+        chSysLockFromIsr();
+        usbStartReceiveI(usbp, EP_OUT);
+        chSysUnlockFromIsr();
+        return;
+    }
 
     if(osp->rxcnt){
         switch(receiveBuf[0]){
@@ -83,6 +211,15 @@ void dataReceived(USBDriver *usbp, usbep_t ep){
             case '4':
                 palTogglePad(GPIOD, GPIOD_LED6);
                 break;
+            case 'a':
+                requestedPattern = PATTERN_ALPHABET;
+                break;
+            case 'c':
+                requestedPattern = PATTERN_COUNTER;
+                break;
+            case 'p':
+                requestedPattern = PATTERN_PRBS31;
+                break;
 
         }
     }
@@ -183,16 +320,35 @@ static const USBDescriptor *get_descriptor(USBDriver *usbp,
   return NULL;
 }
 
+/*
+ * End of the data stage of CTRL_SET_PARAMS
+ */
+static void paramsReceived(USBDriver *usbp) {
+    (void) usbp;
+    controlReceived(&ctrl, CTRL_SET_PARAMS);
+}
+
 /*
  * Requests hook callback.
  * This hook allows to be notified of standard requests or to
  *          handle non standard requests.
- * This implementation does nothing and passes all requests to
- *     the upper layers
+ * The vendor requests of control.h are handled here, everything else
+ *     is passed to the upper layers
  */
 bool_t requestsHook(USBDriver *usbp) {
-    (void) usbp;
-    return FALSE;
+    uint8_t *buf;
+    int n = controlSetup(&ctrl, usbp->setup, &buf);
+    if(n < 0)
+        return FALSE;
+
+    // restart a stopped stream
+    if(usbp->setup[1] == CTRL_START && usbStatus && mode != MODE_ECHO && !transmitting){
+        transmitting = 1;
+        streamNext(usbp);
+    }
+    usbSetupTransfer(usbp, buf, n,
+        n && !(usbp->setup[0] & USB_RTYPE_DIR_DEV2HOST) ? paramsReceived : NULL);
+    return TRUE;
 }
 
 /*
@@ -207,11 +363,13 @@ const USBConfig   	config =   {
 
 
 int main(void) {
-  uint16_t i;
 
+  //full size transfers of the default pattern until the host sets others
+  static const struct ctrl_params params = {sizeof transferBuf, DEFAULT_PATTERN, 0x01, 1, 0};
+  controlInit(&ctrl, &caps, &params);
   //fill the transfer buffer
-  for(i=0;i<sizeof transferBuf;i++)
-    transferBuf[i] = 'a'+(i%26);
+  patternInit(&pattern, DEFAULT_PATTERN);
+  patternFill(&pattern, transferBuf, sizeof transferBuf);
   //Start System
   halInit();
   chSysInit();
@@ -223,6 +381,7 @@ int main(void) {
   palTogglePad(GPIOD, GPIOD_LED6);
 
   //Start and Connect USB
+  usbSerialInit();
   usbStart(usbp, &config);
   usbConnectBus(usbp);
 
@@ -241,23 +400,44 @@ int main(void) {
     chThdSleepMilliseconds(100);
     palTogglePad(GPIOD, GPIOD_LED6);
     usbStatus=1;
+
+    if(mode == MODE_ECHO){
+        /*
+         * Waits for the first request
+         * all further requests are accepted by the dataTransmitted callback
+         */
+        echoInit(&echo);
+        usbPrepareReceive(usbp, EP_OUT, echoRxBuf, sizeof echoRxBuf);
+        chSysLock();
+        usbStartReceiveI(usbp, EP_OUT);
+        chSysUnlock();
+        initUSB=0;
+        continue;
+    }
+
     /*
      * Starts first receiving transaction
      * all further transactions are initiated by the dataReceived callback
      */
-    usbPrepareReceive(usbp, EP_OUT, receiveBuf, 64);
+    if(mode == MODE_SINK)
+      usbPrepareReceive(usbp, EP_OUT, sinkBuf, SINK_LEN);
+    else
+      usbPrepareReceive(usbp, EP_OUT, receiveBuf, 64);
     chSysLock();
     usbStartReceiveI(usbp, EP_OUT);
     chSysUnlock();
 
     /*
-     * Starts first transfer
+     * Starts first transfer, unless stopped with CTRL_STOP
      * all further transactions are initiated by the dataTransmitted callback
      */
-    usbPrepareTransmit(usbp, EP_IN, transferBuf, sizeof transferBuf);
-    chSysLock();
-    usbStartTransmitI(usbp, EP_IN);
-    chSysUnlock();
+    transmitting = ctrl.running;
+    if(transmitting){
+      usbPrepareTransmit(usbp, EP_IN, transferBuf, transferSize);
+      chSysLock();
+      usbStartTransmitI(usbp, EP_IN);
+      chSysUnlock();
+    }
     initUSB=0;
   }
 }
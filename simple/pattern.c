@@ -0,0 +1,44 @@
+#include "pattern.h"
+
+void patternInit(struct pattern_state *s, uint8_t type){
+    s->type = type;
+    s->offset = 0;
+    s->block = 0;
+    s->prbs = PATTERN_PRBS_SEED;
+}
+
+static void putWord(uint8_t *p, uint32_t w){
+    p[0] = w;
+    p[1] = w>>8;
+    p[2] = w>>16;
+    p[3] = w>>24;
+}
+
+void patternFill(struct pattern_state *s, uint8_t *buf, size_t len){
+    size_t i;
+    unsigned int j;
+
+    switch(s->type){
+    case PATTERN_COUNTER:
+        for(i=0; i+PATTERN_BLOCK<=len; i+=PATTERN_BLOCK, s->block++)
+            for(j=0; j<PATTERN_BLOCK_WORDS; j++)
+                putWord(buf+i+4*j, s->block*PATTERN_BLOCK_WORDS+j);
+        break;
+    case PATTERN_PRBS31:
+        for(i=0; i+PATTERN_BLOCK<=len; i+=PATTERN_BLOCK, s->block++){
+            putWord(buf+i, s->block);
+            for(j=1; j<PATTERN_BLOCK_WORDS; j++){
+                s->prbs = patternPrbsNext(s->prbs);
+                putWord(buf+i+4*j, s->prbs);
+            }
+        }
+        break;
+    default:
+        for(i=0; i<len; i++){
+            buf[i] = 'a'+(s->offset%26);
+            if(++s->offset == PATTERN_ALPHABET_PERIOD)
+                s->offset = 0;
+        }
+        break;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef PATTERN_H_INCLUDED
+#define PATTERN_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Test patterns of the IN stream
+ *   PATTERN_ALPHABET  'a'+(i%26), restarting every PATTERN_ALPHABET_PERIOD
+ *                     bytes (one firmware transfer). This is the original
+ *                     stream, it can show corrupted bytes but not lost
+ *                     transfers because all of them are identical.
+ *   PATTERN_COUNTER   32 bit little endian words 0,1,2,...
+ *                     Block n (PATTERN_BLOCK bytes) starts with 16*n.
+ *   PATTERN_PRBS31    every block starts with its 32 bit little endian
+ *                     block number, followed by 15 words of one continuous
+ *                     PRBS-31 sequence (x^31+x^28+1, LSB first).
+ *                     Each PRBS word follows from the one before it, see
+ *                     patternPrbsNext, so a checker resynchronizes after a
+ *                     single word.
+ * The stream is always a multiple of PATTERN_BLOCK bytes, block numbers
+ * count from 0 after patternInit and wrap at 2^32.
+ *
+ * This file does not depend on ChibiOS, so the same code runs in the
+ * firmware, in the device emulator and in the host verifier.
+ */
+
+#define PATTERN_ALPHABET  0
+#define PATTERN_COUNTER   1
+#define PATTERN_PRBS31    2
+
+#define PATTERN_BLOCK            64     /* unit of the block numbers */
+#define PATTERN_BLOCK_WORDS      (PATTERN_BLOCK/4)
+#define PATTERN_ALPHABET_PERIOD  256    /* IN_PACKETSIZE*IN_MULT of main.c */
+#define PATTERN_PRBS_SEED        0x2545F491
+
+struct pattern_state {
+    uint8_t type;
+    uint32_t offset;            // alphabet: position in the period
+    uint32_t block;             // number of the next block
+    uint32_t prbs;              // last PRBS word
+};
+
+void patternInit(struct pattern_state *s, uint8_t type);
+
+/*
+ * Fills buf with the next len bytes of the stream.
+ * For the counter and PRBS pattern len must be a multiple of PATTERN_BLOCK.
+ */
+void patternFill(struct pattern_state *s, uint8_t *buf, size_t len);
+
+/*
+ * PRBS-31 word following w: bit n of the sequence is bit n-31 xor bit n-28.
+ * Bits 0..27 only depend on w, bits 28..31 also on the bits 0..3 just made.
+ */
+static inline uint32_t patternPrbsNext(uint32_t w){
+    uint32_t n = ((w>>1)^(w>>4)) & 0x0FFFFFFF;
+    uint32_t hi = ((w>>29) | (n<<3)) & 0xF;
+    return n | (hi^(n&0xF))<<28;
+}
+
+#endif // PATTERN_H_INCLUDED
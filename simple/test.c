@@ -7,7 +7,7 @@
  * It uses Synchronous device I/O
  *
  * Compile:
- *   gcc -lusb-1.0 -o test test.c
+ *   gcc -o test test.c ../usbhost.c -lusb-1.0
  * Run:
  *   ./test
  * Thanks to BertOS for the example:
@@ -21,12 +21,10 @@
 
 #include <signal.h>
 
-//change if your libusb.h is located elswhere
-#include <libusb-1.0/libusb.h>
-//or uncomment this line:
-//#include <libusb.h>
+//change in ../usbhost.h if your libusb.h is located elswhere
+#include "../usbhost.h"
 //and compile with:
-//gcc -lusb-1.0 -o test -I/path/to/libusb-1.0/ test.c
+//gcc -o test -I/path/to/libusb-1.0/ test.c ../usbhost.c -lusb-1.0
 
 
 #define USB_VENDOR_ID	    0x0483      /* USB vendor ID used by the device
@@ -38,7 +36,8 @@
 #define USB_TIMEOUT	        3000        /* Connection timeout (in ms) */
 
 static libusb_context *ctx = NULL;
-static libusb_device_handle *handle;
+static struct usb_device dev;
+static volatile sig_atomic_t do_exit = 0;
 
 static uint8_t receiveBuf[64];
 uint8_t transferBuf[64];
@@ -51,7 +50,7 @@ uint16_t counter=0;
 static int usb_read(void)
 {
 	int nread, ret;
-	ret = libusb_bulk_transfer(handle, USB_ENDPOINT_IN, receiveBuf, sizeof(receiveBuf),
+	ret = libusb_bulk_transfer(dev.h, USB_ENDPOINT_IN, receiveBuf, sizeof(receiveBuf),
 			&nread, USB_TIMEOUT);
 	if (ret){
 		printf("ERROR in bulk read: %d\n", ret);
@@ -77,7 +76,7 @@ static int usb_write(void)
     n = sprintf(transferBuf, "%d\0",count++);
     //write transfer
     //probably unsafe to use n twice...
-	ret = libusb_bulk_transfer(handle, USB_ENDPOINT_OUT, transferBuf, n,
+	ret = libusb_bulk_transfer(dev.h, USB_ENDPOINT_OUT, transferBuf, n,
 			&n, USB_TIMEOUT);
     //Error handling
     switch(ret){
@@ -106,23 +105,13 @@ static int usb_write(void)
 }
 
 /*
- * on SIGINT: close USB interface
- * This still leads to a segfault on my system...
+ * on SIGINT: stop reading, main closes the USB interface
+ * libusb must not be called from a signal handler.
  */
 static void sighandler(int signum)
 {
-    printf( "\nInterrupt signal received\n" );
-	if (handle){
-        libusb_release_interface (handle, 0);
-        printf( "\nInterrupt signal received1\n" );
-        libusb_close(handle);
-        printf( "\nInterrupt signal received2\n" );
-	}
-	printf( "\nInterrupt signal received3\n" );
-	libusb_exit(NULL);
-	printf( "\nInterrupt signal received4\n" );
-
-	exit(0);
+	(void)signum;
+	do_exit = 1;
 }
 
 int main(int argc, char **argv)
@@ -133,30 +122,25 @@ int main(int argc, char **argv)
 	libusb_init(&ctx);
 	libusb_set_debug(ctx, 3);
 
-    //Open Device with VendorID and ProductID
-	handle = libusb_open_device_with_vid_pid(ctx,
-				USB_VENDOR_ID, USB_PRODUCT_ID);
-	if (!handle) {
+    //Open Device with VendorID and ProductID and claim Interface 0
+	int r = usbOpen(&dev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+	if (r == LIBUSB_ERROR_NOT_FOUND) {
 		perror("device not found");
 		return 1;
 	}
-
-	int r = 1;
-	//Claim Interface 0 from the device
-    r = libusb_claim_interface(handle, 0);
 	if (r < 0) {
 		fprintf(stderr, "usb_claim_interface error %d\n", r);
 		return 2;
 	}
 	printf("Interface claimed\n");
 
-	while (1){
+	while (!do_exit){
 		usb_read();
 //		usb_write();
     }
-    //never reached
-	libusb_close(handle);
-	libusb_exit(NULL);
+    printf( "\nInterrupt signal received\n" );
+	usbClose(&dev);
+	libusb_exit(ctx);
 
 	return 0;
 }
@@ -0,0 +1,92 @@
+#ifndef SPSC_H_INCLUDED
+#define SPSC_H_INCLUDED
+
+/*
+ * Lock-free single-producer/single-consumer ring buffer.
+ * Exactly one thread may call spsc_push and exactly one (other) thread may
+ * call spsc_pop. The elements are copied in and out, so they should be small
+ * descriptors, not the data itself.
+ *
+ * head is only written by the consumer and tail only by the producer. Both
+ * live on their own cache line so the two threads do not fight over it.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_CACHELINE 64
+
+struct spsc_ring {
+    _Atomic size_t head;                        // next element to pop
+    char pad0[SPSC_CACHELINE-sizeof(size_t)];
+    _Atomic size_t tail;                        // next free element to push
+    char pad1[SPSC_CACHELINE-sizeof(size_t)];
+    size_t mask;                                // capacity-1, capacity is a power of 2
+    size_t elemSize;
+    uint8_t *slots;
+};
+
+/*
+ * Allocates room for at least capacity elements of elemSize bytes.
+ * Returns 0 on success, -1 if the memory could not be allocated.
+ */
+static inline int spsc_init(struct spsc_ring *r, size_t capacity, size_t elemSize)
+{
+    size_t n = 1;
+    while (n < capacity)
+        n <<= 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->mask = n-1;
+    r->elemSize = elemSize;
+    r->slots = malloc(n*elemSize);
+    return r->slots ? 0 : -1;
+}
+
+static inline void spsc_free(struct spsc_ring *r)
+{
+    free(r->slots);
+    r->slots = NULL;
+}
+
+/*
+ * Producer side. Returns 0 on success, -1 if the ring is full.
+ */
+static inline int spsc_push(struct spsc_ring *r, const void *elem)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail-head > r->mask)
+        return -1;
+    memcpy(r->slots+(tail&r->mask)*r->elemSize, elem, r->elemSize);
+    atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Consumer side. Returns 0 on success, -1 if the ring is empty.
+ */
+static inline int spsc_pop(struct spsc_ring *r, void *elem)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail)
+        return -1;
+    memcpy(elem, r->slots+(head&r->mask)*r->elemSize, r->elemSize);
+    atomic_store_explicit(&r->head, head+1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Number of elements in the ring. Exact from either side, a snapshot
+ * from any other thread.
+ */
+static inline size_t spsc_count(struct spsc_ring *r)
+{
+    return atomic_load_explicit(&r->tail, memory_order_acquire)
+         - atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+#endif // SPSC_H_INCLUDED
@@ -0,0 +1,116 @@
+/*
+ * Local reader of the stream published by ./async -F (see fanout.h)
+ * Any number of taps can run next to the process that owns the device.
+ * Each one maps the shared ring, reads the buffers in place and prints its
+ * rate and the messages it lost because it fell behind. The writer is never
+ * slowed down by a tap.
+ *
+ * Compile:
+ *   gcc -O2 -o tap tap.c fanout.c verify.c simple/pattern.c -lpthread
+ * Run:
+ *   ./tap [-v alphabet|counter|prbs] [-w us] [socket]
+ *     -v  check the stream like async -v, lost messages show up as drops
+ *         and a buffer overwritten while it was checked as corruption
+ *     -w  simulated processing time per buffer in us, to provoke overruns
+ *     socket  the path given to async -F (default FANOUT_SOCKET)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "verify.h"
+#include "timing.h"
+
+static volatile int do_exit = 0;
+
+static void sighandler(int signum)
+{
+    (void)signum;
+    do_exit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct fanout_reader r;
+    struct verify verifier;
+    const char *path = FANOUT_SOCKET;
+    const uint8_t *data;
+    size_t len;
+    uint64_t t, start, last, bytes = 0, lastBytes = 0, torn = 0;
+    int opt, n, pattern = -1, workUs = 0;
+
+    while ((opt = getopt(argc, argv, "v:w:h")) != -1) {
+        switch (opt) {
+        case 'v':
+            pattern = verifyParse(optarg);
+            if (pattern < 0)
+                goto usage;
+            break;
+        case 'w':
+            workUs = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind++];
+    if (optind != argc || workUs < 0)
+        goto usage;
+
+    if (fanoutAttach(&r, path) < 0) {
+        perror(path);
+        return 1;
+    }
+    printf("attached to %s: %u slots of %u bytes\n", path, r.h->slots, r.h->slotSize);
+    if (pattern >= 0)
+        verifyInit(&verifier, pattern, stderr, 20);
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    start = last = now_ns();
+    while (!do_exit) {
+        n = fanoutPeek(&r, &data, &len, NULL);
+        if (n < 0)
+            break;
+        if (n == 0) {
+            usleep(200);
+        } else {
+            // the data is used in place, so it is only valid if fanoutDone says so
+            if (pattern >= 0)
+                verifyData(&verifier, data, len);
+            if (workUs) {
+                t = now_ns();
+                while (now_ns()-t < workUs*NS_PER_US)
+                    ;
+            }
+            if (fanoutDone(&r) == 0)
+                bytes += len;
+            else
+                torn++;
+        }
+        t = now_ns();
+        if (t-last >= NS_PER_SEC) {
+            printf("\r%10.1f B/s, %llu buffers, %llu lost", (bytes-lastBytes)*(double)NS_PER_SEC/(t-last),
+                (unsigned long long)r.received, (unsigned long long)r.lost);
+            fflush(stdout);
+            last = t;
+            lastBytes = bytes;
+        }
+    }
+
+    t = now_ns();
+    printf("\n%llu bytes in %llu buffers, %.1f B/s, %llu lost (%llu of them while being read)\n",
+        (unsigned long long)bytes, (unsigned long long)r.received,
+        bytes*(double)NS_PER_SEC/(t-start), (unsigned long long)r.lost, (unsigned long long)torn);
+    if (pattern >= 0)
+        verifyPrint(stdout, &verifier);
+    fanoutDetach(&r);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-v alphabet|counter|prbs] [-w us] [socket]\n", argv[0]);
+    return 1;
+}
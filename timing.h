@@ -0,0 +1,24 @@
+#ifndef TIMING_H_INCLUDED
+#define TIMING_H_INCLUDED
+
+/*
+ * 64 bit monotonic time in nanoseconds.
+ * CLOCK_MONOTONIC does not jump when the wall clock is adjusted and
+ * 64 bits of nanoseconds don't overflow for 584 years.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define NS_PER_SEC  1000000000ULL
+#define NS_PER_MS   1000000ULL
+#define NS_PER_US   1000ULL
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*NS_PER_SEC + t.tv_nsec;
+}
+
+#endif // TIMING_H_INCLUDED
@@ -0,0 +1,327 @@
+#ifndef USBCORO_HPP_INCLUDED
+#define USBCORO_HPP_INCLUDED
+
+/*
+ * Awaitable libusb transfers (C++20 coroutines, link usbhost.c)
+ * A multi-stage protocol written as a chain of libusb callbacks is hard to
+ * follow. Here every transfer is a co_await, the code reads like the
+ * blocking libusb_bulk_transfer version but runs on the asynchronous
+ * engine: the coroutine is suspended while the transfer is in flight and
+ * resumed from the libusb callback, e.g. command/response on EP2/EP1:
+ *
+ *   usb::Task ping(usb::AsyncDevice &dev, std::span<uint8_t> cmd, std::span<uint8_t> reply)
+ *   {
+ *       usb::Result r = co_await dev.bulk_out(cmd);
+ *       if (r.ok())
+ *           r = co_await dev.bulk_in(reply);
+ *       ...
+ *   }
+ *
+ *   usb::Device device(ctx, 0x0483, 0xFFFF);      // usbhost.hpp
+ *   usb::AsyncDevice dev(device);
+ *   usb::Task t = ping(dev, cmd, reply);
+ *   t.start();
+ *   while (!t.done())
+ *       libusb_handle_events_completed(ctx, NULL);
+ *
+ * A Task starts suspended, start() runs it up to its first co_await.
+ * Awaiting a Task from another one runs it and continues after it has
+ * finished. Several tasks streaming the same endpoint keep as many
+ * transfers in flight as a ring of callbacks would, see bench_coro.cpp.
+ *
+ * Nothing is allocated per transfer: the libusb transfers come from a pool
+ * of the AsyncDevice allocated in its constructor, and the coroutine frames
+ * from a free list per thread that keeps the frames of finished tasks for
+ * the next ones of the same size. Only the first frame of every size is
+ * taken from the heap, see frameStats().
+ * The callbacks resume the tasks, so an AsyncDevice is used from the
+ * thread that handles the libusb events only.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <span>
+#include <vector>
+
+#include "usbhost.hpp"
+
+namespace usb {
+
+/*
+ * Outcome of one transfer.
+ */
+struct Result {
+    libusb_transfer_status status;
+    int length;                         // actual_length
+    int error;                          // libusb error of the submit, 0 if submitted
+
+    bool ok() const { return !error && status == LIBUSB_TRANSFER_COMPLETED; }
+};
+
+struct FrameStats {
+    uint64_t heap;                      // frames taken from the heap
+    uint64_t pooled;                    // frames recycled from the free lists
+};
+
+namespace detail {
+
+/*
+ * Free lists of coroutine frames in size classes of Granule bytes.
+ * Frames larger than the biggest class always go to the heap.
+ */
+class FramePool {
+public:
+    static constexpr size_t Granule = 64;
+    static constexpr size_t Classes = 16;
+
+    ~FramePool()
+    {
+        for (Block *&list : free_) {
+            while (list) {
+                Block *b = list;
+                list = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    void *allocate(size_t n)
+    {
+        size_t c = (n+Granule-1)/Granule-1;
+        if (c < Classes && free_[c]) {
+            Block *b = free_[c];
+            free_[c] = b->next;
+            stats_.pooled++;
+            return b;
+        }
+        stats_.heap++;
+        return ::operator new(c < Classes ? (c+1)*Granule : n);
+    }
+
+    void deallocate(void *p, size_t n)
+    {
+        size_t c = (n+Granule-1)/Granule-1;
+        if (c >= Classes) {
+            ::operator delete(p);
+            return;
+        }
+        Block *b = static_cast<Block *>(p);
+        b->next = free_[c];
+        free_[c] = b;
+    }
+
+    FrameStats stats() const { return stats_; }
+
+private:
+    struct Block {
+        Block *next;
+    };
+
+    Block *free_[Classes] = {};
+    FrameStats stats_ = {};
+};
+
+inline FramePool &frames()
+{
+    static thread_local FramePool pool;
+    return pool;
+}
+
+} // namespace detail
+
+/*
+ * Frame allocations of the calling thread so far.
+ */
+inline FrameStats frameStats() { return detail::frames().stats(); }
+
+/*
+ * A coroutine returning nothing. The frame lives until the Task is
+ * destroyed, so done() can be checked after it finished.
+ */
+class Task {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                // back to the awaiting task, if there is one
+                if (h.promise().continuation)
+                    return h.promise().continuation;
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        // there is nobody to rethrow to inside a libusb callback
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t n) { return detail::frames().allocate(n); }
+        static void operator delete(void *p, size_t n) { detail::frames().deallocate(p, n); }
+    };
+
+    Task(Task &&t) noexcept : h_(t.h_) { t.h_ = nullptr; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    void start() { h_.resume(); }
+    bool done() const { return !h_ || h_.done(); }
+
+    // co_await task: runs it and continues when it has finished
+    bool await_ready() const { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        h_.promise().continuation = awaiting;
+        return h_;
+    }
+    void await_resume() {}
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+class AsyncDevice;
+
+/*
+ * The awaitable of one transfer, returned by AsyncDevice::bulk_in/bulk_out.
+ * It lives in the frame of the awaiting coroutine while the transfer is
+ * in flight.
+ */
+class TransferAwaiter {
+public:
+    TransferAwaiter(AsyncDevice &dev, uint8_t endpoint, uint8_t *data, int length, unsigned timeoutMs)
+        : dev_(dev), endpoint_(endpoint), data_(data), length_(length), timeoutMs_(timeoutMs) {}
+
+    bool await_ready() const { return false; }
+    inline bool await_suspend(std::coroutine_handle<> h);
+    Result await_resume() const { return result_; }
+
+private:
+    static inline void LIBUSB_CALL callback(libusb_transfer *t);
+
+    AsyncDevice &dev_;
+    uint8_t endpoint_;
+    uint8_t *data_;
+    int length_;
+    unsigned timeoutMs_;
+    std::coroutine_handle<> waiting_;
+    Result result_ = {LIBUSB_TRANSFER_ERROR, 0, 0};
+};
+
+/*
+ * Transfers on an opened Device. Keeps up to maxTransfers transfers in
+ * flight, a transfer beyond that fails with LIBUSB_ERROR_BUSY. Every
+ * transfer must have called back before it is destroyed.
+ */
+class AsyncDevice {
+public:
+    static constexpr uint8_t EndpointIn = LIBUSB_ENDPOINT_IN|1;
+    static constexpr uint8_t EndpointOut = LIBUSB_ENDPOINT_OUT|2;
+
+    explicit AsyncDevice(Device &dev, int maxTransfers = 64) : h_(dev.handle())
+    {
+        all_.reserve(maxTransfers);
+        free_.reserve(maxTransfers);
+        for (int i = 0; i < maxTransfers; i++) {
+            Transfer t;
+            if (!t)
+                break;
+            free_.push_back(t.get());
+            all_.push_back(std::move(t));
+        }
+    }
+
+    AsyncDevice(const AsyncDevice &) = delete;
+    AsyncDevice &operator=(const AsyncDevice &) = delete;
+
+    TransferAwaiter bulk_in(std::span<uint8_t> buf, uint8_t endpoint = EndpointIn, unsigned timeoutMs = 0)
+    {
+        return TransferAwaiter(*this, endpoint, buf.data(), static_cast<int>(buf.size()), timeoutMs);
+    }
+
+    // libusb does not write to the buffer of an OUT transfer
+    TransferAwaiter bulk_out(std::span<const uint8_t> buf, uint8_t endpoint = EndpointOut,
+        unsigned timeoutMs = 0)
+    {
+        return TransferAwaiter(*this, endpoint, const_cast<uint8_t *>(buf.data()),
+            static_cast<int>(buf.size()), timeoutMs);
+    }
+
+    // the awaiting tasks resume with LIBUSB_TRANSFER_CANCELLED
+    void cancel()
+    {
+        for (Transfer &t : all_)
+            libusb_cancel_transfer(t.get());
+    }
+
+    int inFlight() const { return static_cast<int>(all_.size()-free_.size()); }
+    libusb_device_handle *handle() const { return h_; }
+
+private:
+    friend class TransferAwaiter;
+
+    libusb_transfer *take()
+    {
+        if (free_.empty())
+            return nullptr;
+        libusb_transfer *t = free_.back();
+        free_.pop_back();
+        return t;
+    }
+
+    // never grows, free_ has room for every transfer
+    void give(libusb_transfer *t) { free_.push_back(t); }
+
+    libusb_device_handle *h_;
+    std::vector<Transfer> all_;
+    std::vector<libusb_transfer *> free_;
+};
+
+inline bool TransferAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    libusb_transfer *t = dev_.take();
+    if (!t) {
+        result_.error = LIBUSB_ERROR_BUSY;
+        return false;
+    }
+    waiting_ = h;
+    libusb_fill_bulk_transfer(t, dev_.h_, endpoint_, data_, length_, callback, this, timeoutMs_);
+    result_.error = libusb_submit_transfer(t);
+    if (result_.error < 0) {
+        dev_.give(t);
+        return false;
+    }
+    return true;
+}
+
+inline void LIBUSB_CALL TransferAwaiter::callback(libusb_transfer *t)
+{
+    TransferAwaiter *a = static_cast<TransferAwaiter *>(t->user_data);
+
+    a->result_.status = t->status;
+    a->result_.length = t->actual_length;
+    // the transfer is free again before the task runs on and submits the next
+    a->dev_.give(t);
+    a->waiting_.resume();
+}
+
+} // namespace usb
+
+#endif // USBCORO_HPP_INCLUDED
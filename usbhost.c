@@ -0,0 +1,227 @@
+/*
+ * Device and transfer pool shared by the host tools, see usbhost.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbhost.h"
+
+static int claim(struct usb_device *d)
+{
+    int r = libusb_claim_interface(d->h, 0);
+    if (r < 0) {
+        libusb_close(d->h);
+        d->h = NULL;
+        return r;
+    }
+    d->claimed = 1;
+    return 0;
+}
+
+int usbOpen(struct usb_device *d, libusb_context *ctx, uint16_t vid, uint16_t pid)
+{
+    memset(d, 0, sizeof *d);
+    d->h = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    if (!d->h)
+        return LIBUSB_ERROR_NOT_FOUND;
+    return claim(d);
+}
+
+int usbOpenDevice(struct usb_device *d, libusb_device *dev)
+{
+    int r;
+
+    memset(d, 0, sizeof *d);
+    r = libusb_open(dev, &d->h);
+    if (r < 0) {
+        d->h = NULL;
+        return r;
+    }
+    return claim(d);
+}
+
+void usbClose(struct usb_device *d)
+{
+    if (d->claimed)
+        libusb_release_interface(d->h, 0);
+    if (d->h)
+        libusb_close(d->h);
+    d->h = NULL;
+    d->claimed = 0;
+}
+
+enum libusb_transfer_status usbStatus(int error)
+{
+    switch (error) {
+    case 0:
+        return LIBUSB_TRANSFER_COMPLETED;
+    case LIBUSB_ERROR_TIMEOUT:
+        return LIBUSB_TRANSFER_TIMED_OUT;
+    case LIBUSB_ERROR_PIPE:
+        return LIBUSB_TRANSFER_STALL;
+    case LIBUSB_ERROR_OVERFLOW:
+        return LIBUSB_TRANSFER_OVERFLOW;
+    case LIBUSB_ERROR_NO_DEVICE:
+        return LIBUSB_TRANSFER_NO_DEVICE;
+    default:
+        return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+static int alloc_slab(struct usb_pool *p, libusb_device_handle *h)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    if (p->zeroCopy && h) {
+        p->slab = libusb_dev_mem_alloc(h, p->slabLen);
+        if (p->slab) {
+            p->mapped = h;
+            return 0;
+        }
+    }
+#endif
+    p->zeroCopy = 0;
+    p->mapped = NULL;
+    p->slab = malloc(p->slabLen);
+    return p->slab ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+static void free_slab(struct usb_pool *p)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    if (p->mapped) {
+        libusb_dev_mem_free(p->mapped, p->slab, p->slabLen);
+        p->mapped = NULL;
+        p->slab = NULL;
+        return;
+    }
+#endif
+    free(p->slab);
+    p->slab = NULL;
+}
+
+int usbPoolCreate(struct usb_pool *p, struct usb_device *d, int numTransfers, int numBuffers,
+    int bufferSize, int zeroCopy)
+{
+    int i;
+
+    memset(p, 0, sizeof *p);
+    if (numTransfers < 0 || numTransfers > USB_POOL_MAX || numBuffers < 0 || bufferSize < 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    p->numBuffers = numBuffers;
+    p->bufferSize = bufferSize;
+    p->slabLen = (size_t)numBuffers*bufferSize;
+    p->zeroCopy = zeroCopy;
+    if (p->slabLen && alloc_slab(p, d ? d->h : NULL) < 0)
+        goto fail;
+    for (i=0; i<numTransfers; i++) {
+        p->transfers[i] = libusb_alloc_transfer(0);
+        if (!p->transfers[i])
+            goto fail;
+        p->numTransfers++;
+    }
+    return 0;
+
+fail:
+    usbPoolDestroy(p);
+    return LIBUSB_ERROR_NO_MEM;
+}
+
+void usbPoolFill(struct usb_pool *p, struct usb_device *d, uint8_t endpoint,
+    libusb_transfer_cb_fn cb, unsigned int timeout)
+{
+    int i;
+
+    for (i=0; i<p->numTransfers; i++)
+        libusb_fill_bulk_transfer(p->transfers[i], d->h, endpoint,
+            i < p->numBuffers ? usbPoolBuffer(p, i) : NULL, p->bufferSize,
+            cb, (void*)(intptr_t)i, timeout);
+}
+
+void usbPoolUnbind(struct usb_pool *p)
+{
+    if (p->mapped)
+        free_slab(p);
+}
+
+int usbPoolBind(struct usb_pool *p, struct usb_device *d)
+{
+    if (p->slab || !p->slabLen)
+        return 0;
+    // zeroCopy is still set, the new device gets a new mapping
+    return alloc_slab(p, d->h);
+}
+
+void usbPoolDestroy(struct usb_pool *p)
+{
+    int i;
+
+    for (i=0; i<p->numTransfers; i++)
+        libusb_free_transfer(p->transfers[i]);
+    p->numTransfers = 0;
+    if (p->slab)
+        free_slab(p);
+}
+
+#define CTRL_IN         (LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_INTERFACE)
+#define CTRL_OUT        (LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_INTERFACE)
+#define CTRL_TIMEOUT    1000        /* ms */
+
+static int ctrl_in(struct usb_device *d, uint8_t request, void *data, uint16_t len)
+{
+    int r;
+
+    // fields an older device does not send yet stay 0
+    memset(data, 0, len);
+    r = libusb_control_transfer(d->h, CTRL_IN, request, 0, 0, data, len, CTRL_TIMEOUT);
+    return r < 0 ? r : 0;
+}
+
+static int ctrl_out(struct usb_device *d, uint8_t request, const void *data, uint16_t len)
+{
+    int r = libusb_control_transfer(d->h, CTRL_OUT, request, 0, 0, (uint8_t *)data, len,
+        CTRL_TIMEOUT);
+    return r < 0 ? r : 0;
+}
+
+int usbCtrlCaps(struct usb_device *d, struct ctrl_caps *caps)
+{
+    int r = ctrl_in(d, CTRL_GET_CAPS, caps, sizeof *caps);
+    // firmware without the requests stalls them
+    if (r == LIBUSB_ERROR_PIPE || (r == 0 && caps->version>>8 != CTRL_VERSION>>8))
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    return r;
+}
+
+int usbCtrlGetParams(struct usb_device *d, struct ctrl_params *p)
+{
+    return ctrl_in(d, CTRL_GET_PARAMS, p, sizeof *p);
+}
+
+int usbCtrlCounters(struct usb_device *d, struct ctrl_counters *c)
+{
+    return ctrl_in(d, CTRL_GET_COUNTERS, c, sizeof *c);
+}
+
+int usbCtrlStart(struct usb_device *d)
+{
+    return ctrl_out(d, CTRL_START, NULL, 0);
+}
+
+int usbCtrlStop(struct usb_device *d)
+{
+    return ctrl_out(d, CTRL_STOP, NULL, 0);
+}
+
+int usbCtrlSetParams(struct usb_device *d, const struct ctrl_params *p)
+{
+    struct ctrl_params now;
+    int r;
+
+    r = ctrl_out(d, CTRL_SET_PARAMS, p, sizeof *p);
+    if (r == 0)
+        r = usbCtrlGetParams(d, &now);
+    if (r == 0 && (now.transferSize != p->transferSize || now.format != p->format
+            || now.channels != p->channels || now.decimation != p->decimation))
+        return LIBUSB_ERROR_INVALID_PARAM;
+    return r;
+}
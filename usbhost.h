@@ -0,0 +1,128 @@
+#ifndef USBHOST_H_INCLUDED
+#define USBHOST_H_INCLUDED
+
+/*
+ * Device and transfer pool shared by the host tools
+ * Every tool used to open the device, claim interface 0, allocate its
+ * transfers and buffers and tear it all down again in its own way. Here
+ * that is done once:
+ *   usb_device  an opened device with interface 0 claimed
+ *   usb_pool    a fixed set of libusb transfers and one slab of equally
+ *               sized buffers, optionally mapped from usbfs (zero-copy)
+ *   usbCtrl*    the vendor control requests of simple/control.h
+ * Everything is allocated by usbPoolCreate, nothing while streaming.
+ *
+ *   usbOpen(&dev, ctx, USB_VENDOR_ID, USB_PRODUCT_ID);
+ *   usbPoolCreate(&pool, &dev, depth, depth, transferSize, zeroCopy);
+ *   usbPoolFill(&pool, &dev, USB_ENDPOINT_IN, cb_in, 0);
+ *   ... submit pool.transfers[i], user_data is i ...
+ *   usbPoolDestroy(&pool);     // after every transfer called back
+ *   usbClose(&dev);
+ *
+ * usbhost.hpp wraps these as move-only C++ types.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libusb-1.0/libusb.h>
+
+#include "simple/control.h"
+
+#define USB_POOL_MAX    64          /* transfers of one pool */
+
+struct usb_device {
+    libusb_device_handle *h;
+    int claimed;                    // interface 0
+};
+
+struct usb_pool {
+    struct libusb_transfer *transfers[USB_POOL_MAX];
+    int numTransfers;
+    uint8_t *slab;                  // numBuffers slices of bufferSize bytes
+    size_t slabLen;
+    int numBuffers;
+    int bufferSize;
+    int zeroCopy;                   // the slab is mapped from usbfs
+    libusb_device_handle *mapped;   // the device the zero-copy slab belongs to
+};
+
+/*
+ * Opens the first vid:pid device and claims interface 0.
+ * Returns 0 or a libusb error, d is then closed again.
+ */
+int usbOpen(struct usb_device *d, libusb_context *ctx, uint16_t vid, uint16_t pid);
+
+/*
+ * The same for a device found otherwise, e.g. by hotplug.
+ */
+int usbOpenDevice(struct usb_device *d, libusb_device *dev);
+
+/*
+ * Releases the interface and closes the device, if it is open.
+ */
+void usbClose(struct usb_device *d);
+
+/*
+ * The error of a synchronous libusb call as the status an asynchronous
+ * transfer would have completed with.
+ */
+enum libusb_transfer_status usbStatus(int error);
+
+/*
+ * Allocates numTransfers transfers and numBuffers buffers of bufferSize
+ * bytes. With zeroCopy the buffers are mapped from usbfs of d, so the
+ * host controller writes directly into them instead of the kernel copying
+ * every URB. If libusb or the kernel can't, zeroCopy is cleared and they
+ * come from malloc. d may be NULL for buffers that are never submitted.
+ * Returns 0 or LIBUSB_ERROR_NO_MEM, p is then empty.
+ */
+int usbPoolCreate(struct usb_pool *p, struct usb_device *d, int numTransfers, int numBuffers,
+    int bufferSize, int zeroCopy);
+
+static inline uint8_t *usbPoolBuffer(const struct usb_pool *p, int i)
+{
+    return p->slab+(size_t)i*p->bufferSize;
+}
+
+/*
+ * Fills transfer i as a bulk transfer into buffer i, with i as user data.
+ */
+void usbPoolFill(struct usb_pool *p, struct usb_device *d, uint8_t endpoint,
+    libusb_transfer_cb_fn cb, unsigned int timeout);
+
+/*
+ * A zero-copy slab belongs to the device it was mapped from. Unbind it
+ * before that device is closed, e.g. when it was unplugged, and bind it
+ * to the next one. The buffers move then, fill the transfers again.
+ * Both do nothing for a malloc slab.
+ * usbPoolBind returns 0 or LIBUSB_ERROR_NO_MEM.
+ */
+void usbPoolUnbind(struct usb_pool *p);
+int usbPoolBind(struct usb_pool *p, struct usb_device *d);
+
+/*
+ * Frees the transfers and the buffers, none of them may be in flight.
+ */
+void usbPoolDestroy(struct usb_pool *p);
+
+/*
+ * Vendor control requests on EP0, see simple/control.h
+ * They return 0 or a libusb error. Like the device, the host side is
+ * assumed to be little endian.
+ * usbCtrlCaps fails with LIBUSB_ERROR_NOT_SUPPORTED if the device has no
+ * control requests or another major CTRL_VERSION, call it first.
+ */
+int usbCtrlCaps(struct usb_device *d, struct ctrl_caps *caps);
+int usbCtrlGetParams(struct usb_device *d, struct ctrl_params *p);
+int usbCtrlCounters(struct usb_device *d, struct ctrl_counters *c);
+int usbCtrlStart(struct usb_device *d);
+int usbCtrlStop(struct usb_device *d);
+
+/*
+ * Sets the stream parameters and reads them back. The device ignores
+ * parameters outside of its capabilities, that is reported as
+ * LIBUSB_ERROR_INVALID_PARAM.
+ */
+int usbCtrlSetParams(struct usb_device *d, const struct ctrl_params *p);
+
+#endif // USBHOST_H_INCLUDED
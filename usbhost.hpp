@@ -0,0 +1,137 @@
+#ifndef USBHOST_HPP_INCLUDED
+#define USBHOST_HPP_INCLUDED
+
+/*
+ * Move-only C++ types over usbhost.h (C++20, link usbhost.c)
+ *   usb::Device        an opened device with interface 0 claimed
+ *   usb::Transfer      one libusb transfer
+ *   usb::TransferPool  transfers and a slab of buffers, see usb_pool
+ * They release what they own when they go out of scope and can be moved
+ * but not copied, so there is always exactly one owner. Failures are not
+ * thrown, check the object and error():
+ *
+ *   usb::Device dev(ctx, 0x0483, 0xFFFF);
+ *   if (!dev)
+ *       fprintf(stderr, "%s\n", libusb_error_name(dev.error()));
+ *   usb::TransferPool pool(dev, 8, 8, 16384, true);
+ *   pool.fill(dev, LIBUSB_ENDPOINT_IN|1, cb_in);
+ */
+
+#include <cstdint>
+#include <span>
+#include <utility>
+
+extern "C" {
+#include "usbhost.h"
+}
+
+namespace usb {
+
+class Device {
+public:
+    Device() = default;
+    Device(libusb_context *ctx, uint16_t vid, uint16_t pid) { error_ = usbOpen(&d_, ctx, vid, pid); }
+    explicit Device(libusb_device *dev) { error_ = usbOpenDevice(&d_, dev); }
+
+    Device(Device &&o) noexcept : d_(o.d_), error_(o.error_) { o.d_ = usb_device{}; }
+    Device &operator=(Device &&o) noexcept
+    {
+        if (this != &o) {
+            usbClose(&d_);
+            d_ = std::exchange(o.d_, usb_device{});
+            error_ = o.error_;
+        }
+        return *this;
+    }
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    ~Device() { usbClose(&d_); }
+
+    explicit operator bool() const { return d_.h != nullptr; }
+    int error() const { return error_; }
+    libusb_device_handle *handle() const { return d_.h; }
+    usb_device *get() { return &d_; }
+
+private:
+    usb_device d_ = {};
+    int error_ = 0;
+};
+
+class Transfer {
+public:
+    Transfer() : t_(libusb_alloc_transfer(0)) {}
+    Transfer(Transfer &&o) noexcept : t_(std::exchange(o.t_, nullptr)) {}
+    Transfer &operator=(Transfer &&o) noexcept
+    {
+        if (this != &o) {
+            if (t_)
+                libusb_free_transfer(t_);
+            t_ = std::exchange(o.t_, nullptr);
+        }
+        return *this;
+    }
+    Transfer(const Transfer &) = delete;
+    Transfer &operator=(const Transfer &) = delete;
+    // it must not be in flight any more
+    ~Transfer()
+    {
+        if (t_)
+            libusb_free_transfer(t_);
+    }
+
+    explicit operator bool() const { return t_ != nullptr; }
+    libusb_transfer *get() const { return t_; }
+    libusb_transfer *operator->() const { return t_; }
+
+private:
+    libusb_transfer *t_;
+};
+
+class TransferPool {
+public:
+    TransferPool() = default;
+    TransferPool(Device &dev, int numTransfers, int numBuffers, int bufferSize, bool zeroCopy)
+    {
+        error_ = usbPoolCreate(&p_, dev.get(), numTransfers, numBuffers, bufferSize, zeroCopy);
+    }
+
+    TransferPool(TransferPool &&o) noexcept : p_(o.p_), error_(o.error_) { o.p_ = usb_pool{}; }
+    TransferPool &operator=(TransferPool &&o) noexcept
+    {
+        if (this != &o) {
+            usbPoolDestroy(&p_);
+            p_ = std::exchange(o.p_, usb_pool{});
+            error_ = o.error_;
+        }
+        return *this;
+    }
+    TransferPool(const TransferPool &) = delete;
+    TransferPool &operator=(const TransferPool &) = delete;
+    // none of the transfers may be in flight any more
+    ~TransferPool() { usbPoolDestroy(&p_); }
+
+    explicit operator bool() const { return !error_; }
+    int error() const { return error_; }
+
+    int transfers() const { return p_.numTransfers; }
+    int buffers() const { return p_.numBuffers; }
+    bool zeroCopy() const { return p_.zeroCopy; }
+    libusb_transfer *transfer(int i) const { return p_.transfers[i]; }
+    std::span<uint8_t> buffer(int i) const
+    {
+        return {usbPoolBuffer(&p_, i), static_cast<size_t>(p_.bufferSize)};
+    }
+
+    void fill(Device &dev, uint8_t endpoint, libusb_transfer_cb_fn cb, unsigned timeout = 0)
+    {
+        usbPoolFill(&p_, dev.get(), endpoint, cb, timeout);
+    }
+
+private:
+    usb_pool p_ = {};
+    int error_ = 0;
+};
+
+} // namespace usb
+
+#endif // USBHOST_HPP_INCLUDED
@@ -0,0 +1,220 @@
+/*
+ * libusb in an epoll loop of the application, see usbpoll.h
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "usbpoll.h"
+#include "timing.h"
+
+static struct usbpoll_source *add_source(struct usbpoll *u, int kind, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    int i;
+
+    for (i=0; i<USBPOLL_SOURCES; i++)
+        if (u->src[i].kind == USBPOLL_FREE)
+            break;
+    if (i == USBPOLL_SOURCES) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = &u->src[i];
+    if (epoll_ctl(u->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return NULL;
+    memset(&u->src[i], 0, sizeof u->src[i]);
+    u->src[i].kind = kind;
+    u->src[i].fd = fd;
+    return &u->src[i];
+}
+
+static void remove_source(struct usbpoll *u, struct usbpoll_source *s)
+{
+    // the fd may be closed already, then epoll has dropped it by itself
+    epoll_ctl(u->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    if (s->kind != USBPOLL_LIBUSB)
+        close(s->fd);
+    s->kind = USBPOLL_FREE;
+    s->fd = -1;
+}
+
+static uint32_t epoll_events(short events)
+{
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+static void LIBUSB_CALL pollfd_added(int fd, short events, void *user_data)
+{
+    struct usbpoll *u = user_data;
+
+    // nothing to report to from here, the fd is then just not watched
+    add_source(u, USBPOLL_LIBUSB, fd, epoll_events(events));
+}
+
+static void LIBUSB_CALL pollfd_removed(int fd, void *user_data)
+{
+    struct usbpoll *u = user_data;
+    int i;
+
+    for (i=0; i<USBPOLL_SOURCES; i++) {
+        if (u->src[i].kind == USBPOLL_LIBUSB && u->src[i].fd == fd) {
+            remove_source(u, &u->src[i]);
+            return;
+        }
+    }
+}
+
+int usbpollInit(struct usbpoll *u, libusb_context *ctx, int epfd)
+{
+    const struct libusb_pollfd **fds;
+    int i, fd, err;
+
+    memset(u, 0, sizeof *u);
+    u->ctx = ctx;
+    u->epfd = epfd;
+    for (i=0; i<USBPOLL_SOURCES; i++)
+        u->src[i].fd = -1;
+    u->libusbTimeouts = libusb_pollfds_handle_timeouts(ctx);
+    if (!u->libusbTimeouts) {
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        u->timeout = add_source(u, USBPOLL_TIMEOUT, fd, EPOLLIN);
+        if (!u->timeout) {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+
+    fds = libusb_get_pollfds(ctx);
+    if (!fds) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    for (i=0; fds[i]; i++) {
+        if (!add_source(u, USBPOLL_LIBUSB, fds[i]->fd, epoll_events(fds[i]->events))) {
+            err = errno;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+            libusb_free_pollfds(fds);
+#else
+            free(fds);
+#endif
+            errno = err;
+            goto fail;
+        }
+    }
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+    libusb_free_pollfds(fds);
+#else
+    free(fds);
+#endif
+    libusb_set_pollfd_notifiers(ctx, pollfd_added, pollfd_removed, u);
+    usbpollRearm(u);
+    return 0;
+
+fail:
+    err = errno;
+    usbpollClose(u);
+    errno = err;
+    return -1;
+}
+
+int usbpollTimer(struct usbpoll *u, uint64_t periodNs, void (*cb)(void *arg, uint64_t expirations),
+    void *arg)
+{
+    struct itimerspec its;
+    struct usbpoll_source *s;
+    int fd, err;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    its.it_value.tv_sec = periodNs/NS_PER_SEC;
+    its.it_value.tv_nsec = periodNs%NS_PER_SEC;
+    its.it_interval = its.it_value;
+    s = add_source(u, USBPOLL_TIMER, fd, EPOLLIN);
+    if (!s || timerfd_settime(fd, 0, &its, NULL) < 0) {
+        err = errno;
+        if (s)
+            remove_source(u, s);
+        else
+            close(fd);
+        errno = err;
+        return -1;
+    }
+    s->cb = cb;
+    s->arg = arg;
+    return 0;
+}
+
+void usbpollRearm(struct usbpoll *u)
+{
+    struct itimerspec its;
+    struct timeval tv;
+
+    if (!u->timeout)
+        return;
+    memset(&its, 0, sizeof its);
+    if (libusb_get_next_timeout(u->ctx, &tv) == 1) {
+        its.it_value.tv_sec = tv.tv_sec;
+        its.it_value.tv_nsec = tv.tv_usec*1000;
+        // a zero it_value would disarm the timer instead of firing now
+        if (!tv.tv_sec && !tv.tv_usec)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(u->timeout->fd, 0, &its, NULL);
+}
+
+int usbpollDispatch(struct usbpoll *u, const struct epoll_event *ev)
+{
+    struct usbpoll_source *s = ev->data.ptr;
+    struct timeval zero = {0, 0};
+    uint64_t n;
+    int r;
+
+    if ((uintptr_t)s < (uintptr_t)u->src || (uintptr_t)s >= (uintptr_t)(u->src+USBPOLL_SOURCES))
+        return 0;
+    u->wakeups++;
+    switch (s->kind) {
+    case USBPOLL_TIMER:
+        if (read(s->fd, &n, sizeof n) == sizeof n) {
+            u->ticks += n;
+            s->cb(s->arg, n);
+        }
+        return 1;
+    case USBPOLL_TIMEOUT:
+        if (read(s->fd, &n, sizeof n) < 0 && errno != EAGAIN)
+            return 1;
+        // the handler processes the expired transfers
+        /* fall through */
+    case USBPOLL_LIBUSB:
+        // never blocks, the fd is readable or a timeout is due
+        u->handled++;
+        r = libusb_handle_events_timeout_completed(u->ctx, &zero, NULL);
+        usbpollRearm(u);
+        return r < 0 ? r : 1;
+    }
+    // an fd that was removed by an earlier event of the same epoll_wait
+    return 1;
+}
+
+void usbpollClose(struct usbpoll *u)
+{
+    int i;
+
+    if (u->ctx)
+        libusb_set_pollfd_notifiers(u->ctx, NULL, NULL, NULL);
+    for (i=0; i<USBPOLL_SOURCES; i++)
+        if (u->src[i].kind != USBPOLL_FREE)
+            remove_source(u, &u->src[i]);
+    u->timeout = NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef USBPOLL_H_INCLUDED
+#define USBPOLL_H_INCLUDED
+
+/*
+ * libusb in an epoll loop of the application (Linux)
+ * libusb has no thread of its own, somebody has to call its event handler.
+ * Instead of a thread blocked in libusb_handle_events, the file descriptors
+ * libusb waits on are added to an epoll instance the application already
+ * runs, next to its sockets, pipes and so on. libusb reports fds it opens
+ * or closes later through the pollfd notifiers, they are added and removed
+ * as well. If libusb can't handle its timeouts on its own fds (it can on
+ * Linux with timerfd) the next timeout is armed on a timerfd of ours.
+ * Periodic work like printing statistics gets a timerfd too, so it runs
+ * from the loop and not from the transfer callbacks.
+ *
+ *   epfd = epoll_create1(EPOLL_CLOEXEC);
+ *   usbpollInit(&u, ctx, epfd);
+ *   usbpollTimer(&u, NS_PER_SEC, print_stats, NULL);
+ *   ... add the fds of the application to epfd ...
+ *   while (running) {
+ *       n = epoll_wait(epfd, ev, 16, -1);
+ *       for (i=0; i<n; i++)
+ *           if (usbpollDispatch(&u, &ev[i]) == 0)
+ *               handle an fd of the application
+ *   }
+ *   usbpollClose(&u);
+ *
+ * The data.ptr of the epoll events of these fds points into u, the
+ * application must not use those pointers for its own fds. Only the
+ * thread that runs the loop may handle libusb events.
+ */
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <libusb-1.0/libusb.h>
+
+#define USBPOLL_SOURCES     16      /* fds of libusb and timers together */
+
+enum {
+    USBPOLL_FREE,
+    USBPOLL_LIBUSB,                 // an fd of libusb
+    USBPOLL_TIMEOUT,                // our timerfd for the libusb timeouts
+    USBPOLL_TIMER                   // a periodic timer of usbpollTimer
+};
+
+struct usbpoll_source {
+    int kind;
+    int fd;
+    void (*cb)(void *arg, uint64_t expirations);
+    void *arg;
+};
+
+struct usbpoll {
+    libusb_context *ctx;
+    int epfd;
+    int libusbTimeouts;             // libusb handles its timeouts on its own fds
+    struct usbpoll_source *timeout; // NULL if libusbTimeouts
+    struct usbpoll_source src[USBPOLL_SOURCES];
+    uint64_t wakeups;               // events dispatched
+    uint64_t handled;               // calls of the libusb event handler
+    uint64_t ticks;                 // timer expirations
+};
+
+/*
+ * Adds the fds of ctx to epfd and keeps them in sync from now on.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int usbpollInit(struct usbpoll *u, libusb_context *ctx, int epfd);
+
+/*
+ * Calls cb every periodNs from the loop, with the number of periods that
+ * passed since the last call (more than 1 if the loop was late).
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int usbpollTimer(struct usbpoll *u, uint64_t periodNs, void (*cb)(void *arg, uint64_t expirations),
+    void *arg);
+
+/*
+ * Handles ev if it is one of the fds of u. Returns 1 if it was, 0 if ev
+ * belongs to the application and < 0 (a libusb error) if the event
+ * handler of libusb failed.
+ */
+int usbpollDispatch(struct usbpoll *u, const struct epoll_event *ev);
+
+/*
+ * Arms the timeout timerfd for the next libusb timeout. Done by
+ * usbpollDispatch, call it after submitting a transfer with a timeout
+ * from outside of a callback. Nothing to do if libusbTimeouts.
+ */
+void usbpollRearm(struct usbpoll *u);
+
+/*
+ * Removes the fds from epfd and closes the timers. epfd stays open.
+ */
+void usbpollClose(struct usbpoll *u);
+
+#endif // USBPOLL_H_INCLUDED
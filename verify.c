@@ -0,0 +1,506 @@
+/*
+ * Stream pattern verifier, see verify.h
+ */
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VERIFY_X86
+#endif
+
+#include "verify.h"
+#include "timing.h"
+
+/*
+ * The compare primitives. Each returns the index of the first element that
+ * does not match, or n if all of them do.
+ *   bytes    a[i] == b[i]
+ *   counter  word i == first+i
+ *   prbs     n PRBS blocks: block i is numbered seq+i and each of its
+ *            words follows the one before, the first one follows prev
+ * Words are little endian 32 bit values at any alignment.
+ */
+struct verify_ops {
+    const char *name;
+    size_t (*bytes)(const uint8_t *a, const uint8_t *b, size_t n);
+    size_t (*counter)(const uint8_t *p, size_t n, uint32_t first);
+    size_t (*prbs)(const uint8_t *p, size_t n, uint32_t seq, uint32_t prev);
+};
+
+static inline uint32_t word(const uint8_t *p)
+{
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return le32toh(w);
+}
+
+static size_t bytes_scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t i;
+    for (i=0; i<n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+static size_t counter_scalar(const uint8_t *p, size_t n, uint32_t first)
+{
+    size_t i;
+    for (i=0; i<n && word(p+4*i) == first+(uint32_t)i; i++)
+        ;
+    return i;
+}
+
+// n PRBS words at p, the first one following prev
+static int prbs_words_ok(const uint8_t *p, unsigned int n, uint32_t prev)
+{
+    unsigned int i;
+    for (i=0; i<n; prev = word(p+4*i), i++) {
+        if (word(p+4*i) != patternPrbsNext(prev))
+            return 0;
+    }
+    return 1;
+}
+
+static size_t prbs_scalar(const uint8_t *p, size_t n, uint32_t seq, uint32_t prev)
+{
+    size_t i;
+    for (i=0; i<n; i++, p+=PATTERN_BLOCK) {
+        if (word(p) != seq+(uint32_t)i || !prbs_words_ok(p+4, PATTERN_BLOCK_WORDS-1, prev))
+            break;
+        prev = word(p+PATTERN_BLOCK-4);
+    }
+    return i;
+}
+
+static const struct verify_ops opsScalar = {
+    "scalar", bytes_scalar, counter_scalar, prbs_scalar
+};
+
+#if defined(VERIFY_X86) && __BYTE_ORDER == __LITTLE_ENDIAN
+
+__attribute__((target("sse2")))
+static size_t bytes_sse2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t i;
+    for (i=0; i+16<=n; i+=16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            break;
+    }
+    return i+bytes_scalar(a+i, b+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static size_t counter_sse2(const uint8_t *p, size_t n, uint32_t first)
+{
+    __m128i expect = _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(0, 1, 2, 3));
+    const __m128i step = _mm_set1_epi32(4);
+    size_t i;
+
+    for (i=0; i+4<=n; i+=4) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(p+4*i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(d, expect)) != 0xFFFF)
+            break;
+        expect = _mm_add_epi32(expect, step);
+    }
+    return i+counter_scalar(p+4*i, n-i, first+(uint32_t)i);
+}
+
+// patternPrbsNext on four words at once
+__attribute__((target("sse2")))
+static inline __m128i prbs_next_sse2(__m128i w)
+{
+    __m128i n = _mm_and_si128(_mm_xor_si128(_mm_srli_epi32(w, 1), _mm_srli_epi32(w, 4)),
+                              _mm_set1_epi32(0x0FFFFFFF));
+    __m128i low = _mm_and_si128(n, _mm_set1_epi32(0xF));
+    __m128i hi = _mm_and_si128(_mm_or_si128(_mm_srli_epi32(w, 29), _mm_slli_epi32(n, 3)),
+                               _mm_set1_epi32(0xF));
+    return _mm_or_si128(n, _mm_slli_epi32(_mm_xor_si128(hi, low), 28));
+}
+
+/*
+ * Words 1..15 of a block are compared in four steps, words 12..15 overlap
+ * with the step before. In the first step word 0, the block number, is
+ * replaced by the last PRBS word of the previous block.
+ */
+__attribute__((target("sse2")))
+static size_t prbs_sse2(const uint8_t *p, size_t n, uint32_t seq, uint32_t prev)
+{
+    const __m128i keep = _mm_setr_epi32(0, -1, -1, -1);
+    __m128i a, b, c, d, ok;
+    size_t i;
+
+    for (i=0; i<n; i++, p+=PATTERN_BLOCK) {
+        if (word(p) != seq+(uint32_t)i)
+            break;
+        a = _mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i *)p), keep),
+                         _mm_cvtsi32_si128(prev));
+        b = _mm_loadu_si128((const __m128i *)(p+16));
+        c = _mm_loadu_si128((const __m128i *)(p+32));
+        d = _mm_loadu_si128((const __m128i *)(p+44));
+        ok = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+4)), prbs_next_sse2(a));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+20)),
+                                               prbs_next_sse2(b)));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+36)),
+                                               prbs_next_sse2(c)));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p+48)),
+                                               prbs_next_sse2(d)));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            break;
+        prev = word(p+PATTERN_BLOCK-4);
+    }
+    return i;
+}
+
+static const struct verify_ops opsSse2 = {
+    "sse2", bytes_sse2, counter_sse2, prbs_sse2
+};
+
+__attribute__((target("avx2")))
+static size_t bytes_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    size_t i;
+    for (i=0; i+32<=n; i+=32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != -1)
+            break;
+    }
+    return i+bytes_scalar(a+i, b+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static size_t counter_avx2(const uint8_t *p, size_t n, uint32_t first)
+{
+    __m256i expect = _mm256_add_epi32(_mm256_set1_epi32(first),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256i step = _mm256_set1_epi32(8);
+    size_t i;
+
+    for (i=0; i+8<=n; i+=8) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p+4*i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(d, expect)) != -1)
+            break;
+        expect = _mm256_add_epi32(expect, step);
+    }
+    return i+counter_scalar(p+4*i, n-i, first+(uint32_t)i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i prbs_next_avx2(__m256i w)
+{
+    __m256i n = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi32(w, 1), _mm256_srli_epi32(w, 4)),
+                                 _mm256_set1_epi32(0x0FFFFFFF));
+    __m256i low = _mm256_and_si256(n, _mm256_set1_epi32(0xF));
+    __m256i hi = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi32(w, 29), _mm256_slli_epi32(n, 3)),
+                                  _mm256_set1_epi32(0xF));
+    return _mm256_or_si256(n, _mm256_slli_epi32(_mm256_xor_si256(hi, low), 28));
+}
+
+// as prbs_sse2 in two steps, words 8..15 overlap with words 1..8
+__attribute__((target("avx2")))
+static size_t prbs_avx2(const uint8_t *p, size_t n, uint32_t seq, uint32_t prev)
+{
+    __m256i a, b, ok;
+    size_t i;
+
+    for (i=0; i<n; i++, p+=PATTERN_BLOCK) {
+        if (word(p) != seq+(uint32_t)i)
+            break;
+        a = _mm256_blend_epi32(_mm256_loadu_si256((const __m256i *)p),
+                               _mm256_set1_epi32(prev), 1);
+        b = _mm256_loadu_si256((const __m256i *)(p+28));
+        ok = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p+4)), prbs_next_avx2(a));
+        ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p+32)),
+                                                     prbs_next_avx2(b)));
+        if (_mm256_movemask_epi8(ok) != -1)
+            break;
+        prev = word(p+PATTERN_BLOCK-4);
+    }
+    return i;
+}
+
+static const struct verify_ops opsAvx2 = {
+    "avx2", bytes_avx2, counter_avx2, prbs_avx2
+};
+
+static const struct verify_ops *select_ops(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &opsAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return &opsSse2;
+    return &opsScalar;
+}
+
+#else
+
+static const struct verify_ops *select_ops(void)
+{
+    return &opsScalar;
+}
+
+#endif
+
+static const struct verify_ops *ops = NULL;
+
+// the alphabet period, repeated so that a whole run of blocks can be
+// compared at any phase in one call
+#define ALPHABET_RUN    (64*PATTERN_BLOCK)
+static uint8_t alphabet[ALPHABET_RUN+PATTERN_ALPHABET_PERIOD];
+
+int verifyParse(const char *name)
+{
+    if (strcmp(name, "alphabet") == 0)
+        return PATTERN_ALPHABET;
+    if (strcmp(name, "counter") == 0)
+        return PATTERN_COUNTER;
+    if (strcmp(name, "prbs") == 0 || strcmp(name, "prbs31") == 0)
+        return PATTERN_PRBS31;
+    return -1;
+}
+
+const char *verifyName(uint8_t type)
+{
+    switch (type) {
+    case PATTERN_COUNTER:
+        return "counter";
+    case PATTERN_PRBS31:
+        return "prbs31";
+    default:
+        return "alphabet";
+    }
+}
+
+const char *verifySimd(void)
+{
+    if (!ops)
+        ops = select_ops();
+    return ops->name;
+}
+
+void verifyInit(struct verify *v, uint8_t type, FILE *log, unsigned int maxEvents)
+{
+    struct pattern_state s;
+
+    if (!ops)
+        ops = select_ops();
+    patternInit(&s, PATTERN_ALPHABET);
+    patternFill(&s, alphabet, sizeof alphabet);
+
+    memset(v, 0, sizeof *v);
+    v->type = type;
+    v->log = log;
+    v->maxEvents = maxEvents;
+}
+
+static void event(struct verify *v, const char *what, uint64_t n, uint32_t expected, uint32_t got)
+{
+    v->events++;
+    if (!v->log || v->events > v->maxEvents)
+        return;
+    fprintf(v->log, "verify: offset %llu: %s %llu block%s (expected 0x%08x, got 0x%08x)\n",
+        (unsigned long long)v->offset, what, (unsigned long long)n, n == 1 ? "" : "s",
+        expected, got);
+    if (v->events == v->maxEvents)
+        fprintf(v->log, "verify: further events are only counted\n");
+}
+
+/*
+ * A jump in the block numbers: forward means blocks were lost, backward
+ * that blocks were received again (or the device restarted the pattern).
+ */
+static void jump(struct verify *v, uint32_t expected, uint32_t got)
+{
+    int32_t d = (int32_t)(got-expected);
+
+    if (d > 0) {
+        v->dropped += d;
+        event(v, "dropped", d, expected, got);
+    } else {
+        v->duplicated += -(int64_t)d;
+        event(v, "duplicated", -(int64_t)d, expected, got);
+    }
+}
+
+/*
+ * Detailed check of one block that failed the fast path.
+ */
+static void alphabet_block(struct verify *v, const uint8_t *p)
+{
+    uint32_t phase;
+
+    for (phase=0; phase<PATTERN_ALPHABET_PERIOD; phase+=PATTERN_BLOCK) {
+        if (ops->bytes(p, alphabet+phase, PATTERN_BLOCK) == PATTERN_BLOCK)
+            break;
+    }
+    if (phase == PATTERN_ALPHABET_PERIOD) {
+        // no position in the period matches
+        if (!v->synced) {
+            v->skipped++;
+            return;
+        }
+        v->corrupt++;
+        event(v, "corrupt", 1, v->phase, phase);
+        v->phase = (v->phase+PATTERN_BLOCK)%PATTERN_ALPHABET_PERIOD;
+        return;
+    }
+    if (v->synced && phase != v->phase) {
+        // lost whole periods can not be seen, only the blocks in between
+        uint32_t skipped = (phase+PATTERN_ALPHABET_PERIOD-v->phase)%PATTERN_ALPHABET_PERIOD;
+        v->dropped += skipped/PATTERN_BLOCK;
+        event(v, "out of step by", skipped/PATTERN_BLOCK, v->phase, phase);
+    }
+    v->synced = 1;
+    v->phase = (phase+PATTERN_BLOCK)%PATTERN_ALPHABET_PERIOD;
+}
+
+static void counter_block(struct verify *v, const uint8_t *p)
+{
+    uint32_t first = word(p);
+
+    if (first%PATTERN_BLOCK_WORDS != 0
+            || ops->counter(p, PATTERN_BLOCK_WORDS, first) != PATTERN_BLOCK_WORDS) {
+        if (!v->synced) {
+            v->skipped++;
+            return;
+        }
+        v->corrupt++;
+        event(v, "corrupt", 1, v->nextWord, first);
+        v->nextWord += PATTERN_BLOCK_WORDS;
+        return;
+    }
+    if (v->synced && first != v->nextWord)
+        jump(v, v->nextWord/PATTERN_BLOCK_WORDS, first/PATTERN_BLOCK_WORDS);
+    v->synced = 1;
+    v->nextWord = first+PATTERN_BLOCK_WORDS;
+}
+
+static void prbs_block(struct verify *v, const uint8_t *p)
+{
+    uint32_t seq = word(p);
+    int continues = v->synced && word(p+4) == patternPrbsNext(v->prbs);
+
+    // words 2..15 have to follow word 1 in any case
+    if (!prbs_words_ok(p+8, PATTERN_BLOCK_WORDS-2, word(p+4))) {
+        if (!v->synced) {
+            v->skipped++;
+            return;
+        }
+        v->corrupt++;
+        event(v, "corrupt", 1, v->nextBlock, seq);
+        v->nextBlock++;
+    } else if (v->synced && seq != v->nextBlock && !continues) {
+        jump(v, v->nextBlock, seq);
+        v->nextBlock = seq+1;
+    } else if (v->synced && (seq != v->nextBlock || !continues)) {
+        // either the block number or the first PRBS word is wrong
+        v->corrupt++;
+        event(v, "corrupt", 1, v->nextBlock, seq);
+        v->nextBlock++;
+    } else {
+        v->nextBlock = seq+1;
+    }
+    // the PRBS resynchronizes on the last word
+    v->synced = 1;
+    v->prbs = word(p+PATTERN_BLOCK-4);
+}
+
+/*
+ * Checks n whole blocks. Runs of good blocks are compared in one call,
+ * the loop only stops at the blocks that need a closer look.
+ */
+static void check_blocks(struct verify *v, const uint8_t *p, size_t n)
+{
+    size_t good;
+
+    while (n > 0) {
+        good = 0;
+        switch (v->type) {
+        case PATTERN_COUNTER:
+            if (v->synced)
+                good = ops->counter(p, n*PATTERN_BLOCK_WORDS, v->nextWord)/PATTERN_BLOCK_WORDS;
+            v->nextWord += good*PATTERN_BLOCK_WORDS;
+            break;
+        case PATTERN_PRBS31:
+            if (v->synced)
+                good = ops->prbs(p, n, v->nextBlock, v->prbs);
+            if (good) {
+                v->prbs = word(p+good*PATTERN_BLOCK-4);
+                v->nextBlock += good;
+            }
+            break;
+        default:
+            if (v->synced) {
+                good = n < ALPHABET_RUN/PATTERN_BLOCK ? n : ALPHABET_RUN/PATTERN_BLOCK;
+                good = ops->bytes(p, alphabet+v->phase, good*PATTERN_BLOCK)/PATTERN_BLOCK;
+                v->phase = (v->phase+good*PATTERN_BLOCK)%PATTERN_ALPHABET_PERIOD;
+            }
+            break;
+        }
+        p += good*PATTERN_BLOCK;
+        n -= good;
+        v->blocks += good;
+        v->offset += good*PATTERN_BLOCK;
+        if (n == 0 || (v->type == PATTERN_ALPHABET && good > 0))
+            continue;
+
+        switch (v->type) {
+        case PATTERN_COUNTER:
+            counter_block(v, p);
+            break;
+        case PATTERN_PRBS31:
+            prbs_block(v, p);
+            break;
+        default:
+            alphabet_block(v, p);
+            break;
+        }
+        p += PATTERN_BLOCK;
+        n--;
+        v->blocks++;
+        v->offset += PATTERN_BLOCK;
+    }
+}
+
+void verifyData(struct verify *v, const uint8_t *buf, size_t len)
+{
+    uint64_t start = now_ns();
+    size_t n;
+
+    // complete a block left over from the last buffer
+    if (v->partialLen) {
+        n = PATTERN_BLOCK-v->partialLen;
+        if (n > len)
+            n = len;
+        memcpy(v->partial+v->partialLen, buf, n);
+        v->partialLen += n;
+        buf += n;
+        len -= n;
+        if (v->partialLen < PATTERN_BLOCK)
+            goto out;
+        check_blocks(v, v->partial, 1);
+        v->partialLen = 0;
+    }
+    check_blocks(v, buf, len/PATTERN_BLOCK);
+    n = len%PATTERN_BLOCK;
+    memcpy(v->partial, buf+len-n, n);
+    v->partialLen = n;
+out:
+    v->ns += now_ns()-start;
+}
+
+void verifyPrint(FILE *f, const struct verify *v)
+{
+    fprintf(f, "verify %s (%s): %llu bytes, %llu blocks, %llu before sync, %llu dropped, "
+        "%llu duplicated, %llu corrupt, checked at %.1f MB/s\n", verifyName(v->type), verifySimd(),
+        (unsigned long long)v->offset, (unsigned long long)v->blocks, (unsigned long long)v->skipped,
+        (unsigned long long)v->dropped, (unsigned long long)v->duplicated,
+        (unsigned long long)v->corrupt, v->ns ? v->offset*1000.0/v->ns : 0.0);
+    if (v->type == PATTERN_ALPHABET)
+        fprintf(f, "verify: the alphabet pattern can not show lost whole transfers, "
+            "use counter or prbs for that\n");
+}
@@ -0,0 +1,64 @@
+#ifndef VERIFY_H_INCLUDED
+#define VERIFY_H_INCLUDED
+
+/*
+ * Host side checker of the IN stream test patterns, see simple/pattern.h
+ * Every byte is compared, the bulk of the work is done with AVX2 or SSE2
+ * compares chosen at runtime, with a scalar fallback on other machines.
+ * Only blocks that fail the fast check are looked at in detail. Lost,
+ * repeated and corrupted blocks are counted and reported with their
+ * offset in the received stream.
+ * The first good block received is taken as the start of the stream, so
+ * the capture may begin while the device is already streaming. Blocks
+ * before it, e.g. of the previous pattern, are only counted as skipped.
+ * A verifier must only be used by one thread.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "simple/pattern.h"
+
+struct verify {
+    uint8_t type;
+    int synced;                 // the position in the pattern is known
+    uint64_t offset;            // stream bytes checked so far
+    uint8_t partial[PATTERN_BLOCK]; // a block split between two buffers
+    size_t partialLen;
+    uint32_t phase;             // alphabet: expected offset in the period
+    uint32_t nextWord;          // counter: expected first word of the next block
+    uint32_t nextBlock;         // PRBS: expected number of the next block
+    uint32_t prbs;              // PRBS: last word received
+    uint64_t blocks;
+    uint64_t skipped;           // blocks before the pattern was found
+    uint64_t dropped;           // blocks missing from the stream
+    uint64_t duplicated;        // blocks received again or out of order
+    uint64_t corrupt;           // blocks with wrong content
+    uint64_t events;
+    uint64_t ns;                // time spent in verifyData
+    FILE *log;                  // every event is printed here, may be NULL
+    unsigned int maxEvents;     // ... up to this many
+};
+
+/*
+ * Returns the pattern type for "alphabet", "counter" or "prbs", -1 otherwise.
+ */
+int verifyParse(const char *name);
+const char *verifyName(uint8_t type);
+
+/*
+ * Name of the compare implementation in use: "avx2", "sse2" or "scalar".
+ */
+const char *verifySimd(void);
+
+void verifyInit(struct verify *v, uint8_t type, FILE *log, unsigned int maxEvents);
+
+/*
+ * Checks the next len bytes of the stream.
+ */
+void verifyData(struct verify *v, const uint8_t *buf, size_t len);
+
+void verifyPrint(FILE *f, const struct verify *v);
+
+#endif // VERIFY_H_INCLUDED